@@ -0,0 +1,76 @@
+#!/bin/sh
+# Builtin utility rate: runs COUNT lines of the kind shell scripts are full
+# of (test, [, printf, basename, dirname, true) through quash, first with
+# the in-process builtins and then with "command" in front of each so the
+# external programs run instead, and reports lines per second for both.
+# The redirect and pipeline runs do the same for builtins writing to a
+# file ("echo ... >> file", run in the shell with its descriptors
+# remapped) and for builtins as pipeline stages ("seq | cat", run on
+# threads). A seq and a cat run measure the two bulk utilities'
+# throughput.
+#
+# Usage: bench/builtins_bench.sh [quash-binary] [count] [megabytes]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-3000}
+MB=${3:-256}
+SCRIPT=$(mktemp)
+EXTERNAL=$(mktemp)
+DATA=$(mktemp)
+OUT=$(mktemp)
+trap 'rm -f "$SCRIPT" "$EXTERNAL" "$DATA" "$OUT"' EXIT
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    case $((i % 6)) in
+        0) echo "test -d /tmp" ;;
+        1) echo "[ $i -lt 100 ]" ;;
+        2) printf '%s\n' "printf '%s:%05d\\n' item $i" ;;
+        3) echo "basename /usr/lib/file$i.so .so" ;;
+        4) echo "dirname /usr/lib/file$i.so" ;;
+        5) echo "true" ;;
+    esac
+    i=$((i + 1))
+done > "$SCRIPT"
+
+# Run the script as is and with "command" before every command, reporting
+# lines/s for each as NAME_in_process and NAME_external
+compare() {
+    sed 's/^/command /; s/| /| command /g' "$SCRIPT" > "$EXTERNAL"
+    start=$(now_ns)
+    "$QUASH" < "$SCRIPT" > /dev/null
+    end=$(now_ns)
+    report "$1_in_process" "$(rate "$COUNT" $((end - start)))" lines/s
+    start=$(now_ns)
+    "$QUASH" < "$EXTERNAL" > /dev/null
+    end=$(now_ns)
+    report "$1_external" "$(rate "$COUNT" $((end - start)))" lines/s
+}
+compare builtins
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "echo line $i >> $OUT"
+    i=$((i + 1))
+done > "$SCRIPT"
+compare builtins_redirected
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "seq 100 | cat"
+    i=$((i + 1))
+done > "$SCRIPT"
+compare builtins_pipeline
+
+head -c $((MB * 1048576)) /dev/zero > "$DATA"
+start=$(now_ns)
+echo "cat $DATA" | "$QUASH" > /dev/null
+end=$(now_ns)
+report builtin_cat_throughput $((MB * 1048576 * 1000 / (end - start))) MB/s
+
+start=$(now_ns)
+echo "seq 10000000" | "$QUASH" > /dev/null
+end=$(now_ns)
+report builtin_seq_rate "$(rate 10000000 $((end - start)))" numbers/s
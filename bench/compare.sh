@@ -0,0 +1,14 @@
+#!/bin/sh
+# Compare two benchmark outputs: prints each metric with both values and
+# the new/old ratio.
+#
+# Usage: bench/compare.sh old_output.txt new_output.txt
+
+awk '
+    /^#/ { next }
+    NR == FNR { old[$1] = $2; next }
+    $1 in old {
+        ratio = old[$1] != 0 ? $2 / old[$1] : 0
+        printf "%-32s %12s %12s %7.2fx %s\n", $1, old[$1], $2, ratio, $3
+    }
+' "$1" "$2"
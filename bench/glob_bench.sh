@@ -0,0 +1,40 @@
+#!/bin/sh
+# Pathname expansion: expands *.log in a directory of COUNT files, half of
+# them matching, and **/*.log over a tree of the same files split into
+# subdirectories, next to find(1) doing the same listing.
+#
+# Usage: bench/glob_bench.sh [quash-binary] [count]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-200000}
+
+# The runs happen inside the test directories, so a relative path won't do
+case $QUASH in
+    /*) ;;
+    */*) QUASH=$(cd "$(dirname "$QUASH")" && pwd)/$(basename "$QUASH") ;;
+    *) QUASH=$(command -v "$QUASH") ;;
+esac
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/flat" "$DIR/tree"
+(cd "$DIR/flat" && seq "$COUNT" | awk '{ print "f" $1 (NR % 2 ? ".log" : ".txt") }' | xargs touch)
+(cd "$DIR/tree" && seq 100 | xargs mkdir &&
+    seq "$COUNT" | awk '{ print (NR % 100 + 1) "/f" $1 (NR % 2 ? ".log" : ".txt") }' | xargs touch)
+
+run() {
+    start=$(now_ns)
+    if ! (cd "$DIR/$2" && eval "$3") > /dev/null; then
+        echo "glob_bench: $1 failed" >&2
+        exit 1
+    fi
+    end=$(now_ns)
+    report "$1" "$(rate "$COUNT" $((end - start)))" files/s
+}
+
+run glob_flat flat "\"\$QUASH\" -c 'echo *.log'"
+run glob_flat_find flat "find . -maxdepth 1 -name '*.log'"
+run glob_recursive tree "\"\$QUASH\" -c 'echo **/*.log'"
+run glob_recursive_find tree "find . -name '*.log'"
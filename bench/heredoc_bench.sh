@@ -0,0 +1,49 @@
+#!/bin/sh
+# Here-document cost: runs COUNT here-strings into an external command
+# ("command wc -c <<< word") and the same number of commands reading a
+# file written for them beforehand ("command wc -c < file"), reporting
+# commands per second for both. A last run feeds an MB-megabyte quoted
+# here-document to wc -c to measure how fast bodies are stored.
+#
+# Usage: bench/heredoc_bench.sh [quash-binary] [count] [megabytes]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-3000}
+MB=${3:-256}
+SCRIPT=$(mktemp)
+FILE=$(mktemp)
+trap 'rm -f "$SCRIPT" "$FILE"' EXIT
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "command wc -c <<< line$i"
+    i=$((i + 1))
+done > "$SCRIPT"
+start=$(now_ns)
+"$QUASH" < "$SCRIPT" > /dev/null
+end=$(now_ns)
+report heredoc_string "$(rate "$COUNT" $((end - start)))" commands/s
+
+echo line > "$FILE"
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "command wc -c < $FILE"
+    i=$((i + 1))
+done > "$SCRIPT"
+start=$(now_ns)
+"$QUASH" < "$SCRIPT" > /dev/null
+end=$(now_ns)
+report heredoc_file_baseline "$(rate "$COUNT" $((end - start)))" commands/s
+
+{
+    echo "command wc -c <<'EOF'"
+    head -c $((MB * 1048576)) /dev/zero | tr '\0' x | fold -w 99
+    echo
+    echo EOF
+} > "$SCRIPT"
+start=$(now_ns)
+"$QUASH" < "$SCRIPT" > /dev/null
+end=$(now_ns)
+report heredoc_body_throughput $((MB * 1048576 * 1000 / (end - start))) MB/s
@@ -0,0 +1,49 @@
+#!/bin/sh
+# History: fills a log with COUNT entries through "history -s", then
+# measures startup with that log (open + map + last entry) against an
+# empty one, and the first substring search (which builds the trigram
+# index) and a second one in the same shell.
+#
+# Usage: bench/history_bench.sh [quash-binary] [count]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-1000000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v count="$COUNT" 'BEGIN {
+    split("ls -la|git status|make -j8|grep -rn pattern src|cd /var/log|tail -f syslog|vim main.c|ssh build-host", cmds, "|")
+    for (i = 0; i < count; i++) print "history -s " cmds[i % 8 + 1] " " i
+}' > "$DIR/fill"
+
+start=$(now_ns)
+QUASH_HISTFILE=$DIR/log "$QUASH" < "$DIR/fill"
+end=$(now_ns)
+report history_append "$(rate "$COUNT" $((end - start)))" entries/s
+
+startup() {
+    i=0
+    start=$(now_ns)
+    while [ "$i" -lt 100 ]; do
+        QUASH_HISTFILE=$1 "$QUASH" -c 'history 1' > /dev/null
+        i=$((i + 1))
+    done
+    end=$(now_ns)
+    echo $(((end - start) / 100000))
+}
+report history_startup_empty "$(startup "$DIR/empty")" us
+report history_startup_full "$(startup "$DIR/log")" us
+
+start=$(now_ns)
+QUASH_HISTFILE=$DIR/log "$QUASH" -c 'history -f pattern 4242' > /dev/null
+end=$(now_ns)
+first=$((end - start))
+report history_first_search $((first / 1000000)) ms
+
+start=$(now_ns)
+QUASH_HISTFILE=$DIR/log "$QUASH" -c 'history -f pattern 4242
+history -f host 99999' > /dev/null
+end=$(now_ns)
+report history_second_search $(((end - start - first) / 1000)) us
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Background job churn: starts COUNT background jobs, then waits for all of
+# them, and reports jobs started and reaped per second. A parallel run then
+# feeds COUNT items on standard input to "parallel" as a pipeline stage,
+# which runs as a forked builtin and must reap its own children; a run
+# that fails or does not finish within a minute stops the script.
+#
+# Usage: bench/jobs_bench.sh [quash-binary] [count]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-10000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo 'true &'
+    i=$((i + 1))
+done > "$SCRIPT"
+echo wait >> "$SCRIPT"
+
+start=$(now_ns)
+"$QUASH" < "$SCRIPT" > /dev/null
+end=$(now_ns)
+report job_churn "$(rate "$COUNT" $((end - start)))" jobs/s
+
+echo "seq $COUNT | parallel -j 8 true" > "$SCRIPT"
+start=$(now_ns)
+if ! timeout 60 "$QUASH" < "$SCRIPT" > /dev/null 2>&1; then
+    echo "jobs_bench: parallel from a pipe failed or hung" >&2
+    exit 1
+fi
+end=$(now_ns)
+report parallel_stdin "$(rate "$COUNT" $((end - start)))" jobs/s
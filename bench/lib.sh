@@ -0,0 +1,19 @@
+# Shared helpers for the benchmark scripts (POSIX sh, sourced)
+#
+# Every result is printed as one line: "name value unit", so the output of
+# two builds can be compared line by line (see bench/compare.sh).
+
+# Current time in nanoseconds
+now_ns() {
+    date +%s%N
+}
+
+# report NAME VALUE UNIT
+report() {
+    printf '%-32s %12s %s\n' "$1" "$2" "$3"
+}
+
+# rate COUNT ELAPSED_NS: COUNT per second
+rate() {
+    echo $(($1 * 1000000000 / $2))
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Parse and expansion throughput: feeds LINES generated lines of WORDS
+# words each (quoted strings, variable references and plain words) to the
+# echo builtin, so no process is started, and reports input MB/s.
+#
+# Usage: bench/parse_bench.sh [quash-binary] [lines] [words]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+LINES=${2:-200}
+WORDS=${3:-5000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v lines="$LINES" -v words="$WORDS" 'BEGIN {
+    print "NAME=value"
+    for (i = 0; i < lines; i++) {
+        line = "echo"
+        for (j = 0; j < words; j++) {
+            k = j % 4
+            if (k == 0) line = line " plain" j
+            else if (k == 1) line = line " \"double $NAME quoted\""
+            else if (k == 2) line = line " '\''single quoted'\''"
+            else line = line " ${NAME}_$HOME"
+        }
+        print line
+    }
+}' > "$SCRIPT"
+bytes=$(wc -c < "$SCRIPT")
+
+start=$(now_ns)
+"$QUASH" < "$SCRIPT" > /dev/null
+end=$(now_ns)
+elapsed=$((end - start))
+report parse_expand_throughput $((bytes * 1000 / elapsed)) MB/s
+report parse_expand_lines "$(rate "$LINES" "$elapsed")" lines/s
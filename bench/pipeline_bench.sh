@@ -0,0 +1,24 @@
+#!/bin/sh
+# Pipeline throughput: pushes MB megabytes through pipelines of 2, 10 and
+# 100 stages (head | cat | ... | cat) and reports MB/s.
+#
+# Usage: bench/pipeline_bench.sh [quash-binary] [megabytes]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+MB=${2:-256}
+
+for stages in 2 10 100; do
+    line="head -c $((MB * 1048576)) /dev/zero"
+    i=1
+    while [ "$i" -lt "$stages" ]; do
+        line="$line | cat"
+        i=$((i + 1))
+    done
+
+    start=$(now_ns)
+    "$QUASH" -c "$line > /dev/null"
+    end=$(now_ns)
+    report "pipeline_${stages}_stages" "$(rate "$MB" $((end - start)))" MB/s
+done
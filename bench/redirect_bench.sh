@@ -0,0 +1,36 @@
+#!/bin/sh
+# Redirection overhead: runs COUNT trivial commands plain, with output
+# redirected to a file and with input redirected from one, and reports the
+# extra cost per command of each redirection.
+#
+# Usage: bench/redirect_bench.sh [quash-binary] [count]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-5000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+: > "$DIR/in"
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo true
+    i=$((i + 1))
+done > "$DIR/plain"
+sed "s|\$| > $DIR/out|" "$DIR/plain" > "$DIR/output"
+sed "s|\$| >> $DIR/out|" "$DIR/plain" > "$DIR/append"
+sed "s|\$| < $DIR/in|" "$DIR/plain" > "$DIR/input"
+
+start=$(now_ns)
+"$QUASH" < "$DIR/plain" > /dev/null
+end=$(now_ns)
+base=$((end - start))
+report redirect_baseline $((base / COUNT)) ns/cmd
+
+for kind in output append input; do
+    start=$(now_ns)
+    "$QUASH" < "$DIR/$kind" > /dev/null
+    end=$(now_ns)
+    report "redirect_${kind}_overhead" $(((end - start - base) / COUNT)) ns/cmd
+done
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Run the whole benchmark suite against one quash binary. Comment lines
+# describe the run; every other line is "name value unit".
+#
+# Usage: bench/run_all.sh [quash-binary]
+
+BENCH=$(dirname "$0")
+QUASH=${1:-./quash}
+
+echo "# quash benchmark suite"
+echo "# binary: $QUASH"
+echo "# host: $(uname -srm), $(getconf _NPROCESSORS_ONLN 2>/dev/null || echo '?') cpus"
+echo "# date: $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+
+for bench in spawn pipeline redirect parse jobs tee history glob serve builtins subst heredoc startup; do
+    sh "$BENCH/${bench}_bench.sh" "$QUASH"
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Server mode: runs COUNT one-line steps the way an orchestrator would,
+# once by starting a new quash -c for each and once by sending each to a
+# warm quash --serve through quash --client, and reports steps per second.
+#
+# Usage: bench/serve_bench.sh [quash-binary] [count]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-1000}
+DIR=$(mktemp -d)
+SOCK="$DIR/quash.sock"
+
+"$QUASH" --serve "$SOCK" &
+SERVER=$!
+trap 'kill $SERVER; rm -rf "$DIR"' EXIT
+while [ ! -S "$SOCK" ]; do
+    sleep 0.1
+done
+
+run() {
+    start=$(now_ns)
+    i=0
+    while [ "$i" -lt "$COUNT" ]; do
+        "$@" 'true' > /dev/null
+        i=$((i + 1))
+    done
+    end=$(now_ns)
+    report "$name" "$(rate "$COUNT" $((end - start)))" steps/s
+}
+
+name=serve_new_shell run "$QUASH" -c
+name=serve_client run "$QUASH" --client "$SOCK"
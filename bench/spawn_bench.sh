@@ -0,0 +1,45 @@
+#!/bin/sh
+# Spawn-rate microbenchmark: runs COUNT trivial commands ("command true", so
+# the true program rather than the builtin) through quash with each spawn
+# backend and reports spawns per second. The zygote backend runs with its
+# default pool size. The large_ runs repeat this with a shell that
+# holds a MB-megabyte variable, where forking the shell's own image costs
+# the most; the time taken to read the variable is measured separately and
+# left out.
+#
+# Usage: bench/spawn_bench.sh [quash-binary] [count] [megabytes]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-5000}
+MB=${3:-64}
+SCRIPT=$(mktemp)
+LARGE=$(mktemp)
+LARGE_SETUP=$(mktemp)
+trap 'rm -f "$SCRIPT" "$LARGE" "$LARGE_SETUP"' EXIT
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo command true
+    i=$((i + 1))
+done > "$SCRIPT"
+
+{ printf 'LARGE='; head -c $((MB * 1048576)) /dev/zero | tr '\0' x; echo; } > "$LARGE_SETUP"
+cat "$LARGE_SETUP" "$SCRIPT" > "$LARGE"
+
+for backend in posix_spawn fork zygote; do
+    start=$(now_ns)
+    QUASH_SPAWN=$backend "$QUASH" < "$SCRIPT" > /dev/null
+    end=$(now_ns)
+    report "spawn_$backend" "$(rate "$COUNT" $((end - start)))" spawns/s
+done
+
+for backend in posix_spawn fork zygote; do
+    start=$(now_ns)
+    QUASH_SPAWN=$backend "$QUASH" < "$LARGE_SETUP" > /dev/null
+    setup=$(now_ns)
+    QUASH_SPAWN=$backend "$QUASH" < "$LARGE" > /dev/null
+    end=$(now_ns)
+    report "spawn_large_$backend" "$(rate "$COUNT" $((end - setup - (setup - start))))" spawns/s
+done
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Startup latency: average wall time of `quash -c true` (start the shell,
+# resolve and exec the first command, exit) over COUNT runs.
+#
+# Usage: bench/startup_bench.sh [quash-binary] [count]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-500}
+
+i=0
+start=$(now_ns)
+while [ "$i" -lt "$COUNT" ]; do
+    "$QUASH" -c true
+    i=$((i + 1))
+done
+end=$(now_ns)
+report startup_c_true $(((end - start) / COUNT / 1000)) us/run
+
+# The same through a pipe on stdin, which is how the shell had to be driven
+# before -c existed
+i=0
+start=$(now_ns)
+while [ "$i" -lt "$COUNT" ]; do
+    echo true | "$QUASH" > /dev/null
+    i=$((i + 1))
+done
+end=$(now_ns)
+report startup_stdin_true $(((end - start) / COUNT / 1000)) us/run
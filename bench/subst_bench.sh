@@ -0,0 +1,42 @@
+#!/bin/sh
+# Command substitution rate: runs COUNT assignments of the form
+# x=$(basename ...) through quash, first with the builtin writing straight
+# into the substitution's buffer and then with "command" in front so each
+# one spawns the external program and reads its output back over a pipe,
+# and reports substitutions per second for both. A last run captures an
+# MB-megabyte file with $(cat ...) to measure the capture throughput.
+#
+# Usage: bench/subst_bench.sh [quash-binary] [count] [megabytes]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+COUNT=${2:-3000}
+MB=${3:-64}
+SCRIPT=$(mktemp)
+EXTERNAL=$(mktemp)
+DATA=$(mktemp)
+trap 'rm -f "$SCRIPT" "$EXTERNAL" "$DATA"' EXIT
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "x=\$(basename /usr/lib/file$i.so .so)"
+    i=$((i + 1))
+done > "$SCRIPT"
+sed 's/\$(/$(command /' "$SCRIPT" > "$EXTERNAL"
+
+start=$(now_ns)
+"$QUASH" < "$SCRIPT" > /dev/null
+end=$(now_ns)
+report subst_in_process "$(rate "$COUNT" $((end - start)))" substitutions/s
+
+start=$(now_ns)
+"$QUASH" < "$EXTERNAL" > /dev/null
+end=$(now_ns)
+report subst_external "$(rate "$COUNT" $((end - start)))" substitutions/s
+
+head -c $((MB * 1048576)) /dev/zero | tr '\0' x > "$DATA"
+start=$(now_ns)
+echo "x=\$(cat $DATA)" | "$QUASH" > /dev/null
+end=$(now_ns)
+report subst_capture_throughput $((MB * 1048576 * 1000 / (end - start))) MB/s
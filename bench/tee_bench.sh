@@ -0,0 +1,26 @@
+#!/bin/sh
+# Tee throughput: pushes MB megabytes through "tee file | cat" with the
+# splice-based tee builtin and with the external tee, and through a plain
+# two-stage pipeline with default and 1 MB pipes (QUASH_PIPESIZE).
+#
+# Usage: bench/tee_bench.sh [quash-binary] [megabytes]
+
+. "$(dirname "$0")/lib.sh"
+
+QUASH=${1:-./quash}
+MB=${2:-512}
+TEE=$(command -v tee)
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+run() {
+    start=$(now_ns)
+    "$QUASH" -c "$2 head -c $((MB * 1048576)) /dev/zero | $3 > /dev/null"
+    end=$(now_ns)
+    report "$1" "$(rate "$MB" $((end - start)))" MB/s
+}
+
+run tee_builtin "" "tee $OUT | cat"
+run tee_external "" "$TEE $OUT | cat"
+run pipe_default_size "" "cat"
+run pipe_1m_size QUASH_PIPESIZE=1m "cat"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,951 +7,8344 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <signal.h>
-
-#define MAX_INPUT 10024
-#define MAX_ARGS 10000
+#include <errno.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sched.h>
+#endif
+
+#define READ_BUFFER_SIZE 65536
+#define PATH_CACHE_INITIAL_SIZE 64
+#define ARENA_CHUNK_SIZE 65536
+#define VAR_TABLE_INITIAL_SIZE 256
+#define JOB_TABLE_INITIAL_SIZE 64
+#define TRACE_BUFFER_SIZE 65536
+#define HISTORY_MAGIC 0x51484953  // Ends every complete history record
+#define TRIGRAM_TABLE_INITIAL_SIZE 4096
+#define GLOB_DIRENT_BUFFER_SIZE 65536
+#define BUILTIN_TABLE_SIZE 64  // Power of two, at least twice the number of builtins
+#define OUTPUT_BUFFER_SIZE 65536
+#define SERVE_REQUEST_MAX 1048576
+#define ZYGOTE_POOL_DEFAULT 4
+#define ZYGOTE_POOL_MAX 64
+#define ZYGOTE_MESSAGE_MAX 131072  // Larger spawn requests (huge environments) fork instead
+#define ZYGOTE_MAX_FDS 64
+#define REDIRECT_FD_MIN 10  // Redirection files are opened at or above this descriptor
+#define PATH_RECHECK_INTERVAL_NS 1000000000L  // Re-stat $PATH directories at most once per second
+#define WITH_MAX_RLIMITS 10  // One of each resource in rlimit_names
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+#define BUILTIN_UTILITY 1      // Stands in for an external command: also runs as a pipeline stage, and "command NAME" bypasses it
+#define BUILTIN_READS_INPUT 2  // Reads the shell's standard input
+
+#define CAT_NUMBER 1           // -n
+#define CAT_NUMBER_NONBLANK 2  // -b
+#define CAT_SQUEEZE 4          // -s
+#define CAT_ENDS 8             // -E
+#define CAT_TABS 16            // -T
+#define CAT_NONPRINTING 32     // -v
+
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\n')
+#define IS_OPERATOR(c) ((c) == '|' || (c) == '&' || (c) == '<' || (c) == '>')
+#define TRIGRAM_KEY(p) ((uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | (uint32_t)(p)[2])
+
+#ifdef __APPLE__
+#define ST_MTIM(st) ((st).st_mtimespec)
+#define RU_MAXRSS_KB(ru) ((ru).ru_maxrss / 1024)  // Bytes on macOS
+#else
+#define ST_MTIM(st) ((st).st_mtim)
+#define RU_MAXRSS_KB(ru) ((ru).ru_maxrss)
+#endif
 
  
 
 typedef struct {
     int job_id;
     pid_t pid;
-    char command[256];
+    char *command;
+    char *settings;  // Scheduling and limits set with "with", as KEY=VALUE words, or NULL
+    pid_t *pids;     // Every stage's process, for "with %N" to change
+    int num_pids;
 } Job;
 
-Job jobs[100];  // Store background jobs
+// Pid map entry: pid 0 is a free slot, -1 a tombstone left by remove_job
+typedef struct {
+    pid_t pid;
+    Job *job;
+} JobPidEntry;
+
+Job **job_slots = NULL;  // Store background jobs, indexed by job id - 1
+int job_slots_cap = 0;
+int max_job_id = 0;  // Highest job id in use
 int num_jobs = 0;  // Track the number of jobs
-int next_job_id = 1;  // Track the next available job ID
+JobPidEntry *job_pid_map = NULL;  // Open-addressing table from pid to job
+size_t job_pid_map_size = 0;
+size_t job_pid_map_used = 0;  // Live entries plus tombstones
+int child_event_fd = -1;  // Readable when children have exited
+#ifndef __linux__
+int child_event_pipe[2];  // Self-pipe written by the SIGCHLD handler
+#endif
+int num_background_children = 0;  // Background children not yet reaped
+int last_job_status = 0;  // Exit status of the last reaped job
+char **job_notices = NULL;  // Completion messages waiting to be printed
+int num_job_notices = 0;
+int job_notices_cap = 0;
+
+// Bump allocator for everything that lives only as long as one input line:
+// tokens, expanded strings and argument vectors. Chunks are kept across
+// resets, so a steady workload stops calling malloc after the first lines.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *first;
+    ArenaChunk *current;
+    size_t reserved;        // Bytes obtained from malloc, never shrinks
+    size_t line_bytes;      // Bytes handed out since the last reset
+    size_t peak_line_bytes; // Largest line_bytes seen at a reset
+    unsigned long resets;   // Number of lines processed
+} Arena;
+
+Arena line_arena;
+
+// Execution trace ($QUASH_TRACE): one JSON line per executed input line,
+// formatted into a static buffer and written out when it fills up
+int trace_fd = -1;              // -1 when tracing is off
+int trace_fd_owned = 0;         // trace_fd was opened by the shell
+char trace_buf[TRACE_BUFFER_SIZE];
+size_t trace_len = 0;
+unsigned long trace_lines = 0;  // Input lines read
+long long trace_line_start = 0; // When the current line was read
+long long trace_parse_end = 0;  // When it was parsed
+long long trace_expand_ns = 0;  // Time spent expanding variables while parsing it
+
+// Growable string and word list, both backed by the line arena
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+typedef struct {
+    char **items;  // NULL-terminated
+    int count;
+    int cap;
+} WordList;
+
+// A builtin command; run gets the arguments from the command name on and
+// returns the exit status
+typedef struct {
+    const char *name;
+    int (*run)(char **args);
+    int flags;             // BUILTIN_* bits
+} Builtin;
+
+Builtin *builtin_table[BUILTIN_TABLE_SIZE];  // Open-addressing table over builtins[]
+int shell_interactive = 0;  // Reading commands from a terminal
+int shell_exiting = 0;      // exit has run
+int substitution_status = -1;  // Status of the line's last $(...), or -1
+
+// Builtin output bound for a descriptor other than the shell's own
+// standard output, collected and written out with writev in large batches,
+// or captured in memory for a command substitution
+typedef struct {
+    int fd;
+    StrBuf *capture;       // Collects the output instead of fd, for $(...)
+    int error;             // errno of the first failed write, or 0
+    size_t used;
+    char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+// Builtins write through output_write() and friends and read builtin_input.
+// Both are per thread, since builtin pipeline stages run on threads of
+// their own; a NULL builtin_output means stdio's stdout.
+__thread Output *builtin_output = NULL;
+__thread int builtin_input = STDIN_FILENO;
+
+// Parsed form of an input line: a pipeline of commands, each with its
+// arguments (already unquoted and expanded) and redirections
+typedef enum {
+    REDIR_INPUT,       // [N]< file
+    REDIR_OUTPUT,      // [N]> file
+    REDIR_APPEND,      // [N]>> file
+    REDIR_READ_WRITE,  // [N]<> file
+    REDIR_DUP,         // [N]>&M, [N]<&M, or N>&- to close
+    REDIR_HEREDOC      // [N]<< word, [N]<<- word, or [N]<<< word
+} RedirectType;
+
+typedef struct Redirect {
+    RedirectType type;
+    int fd;               // Descriptor of the command being redirected
+    char *target;         // File name, or the descriptor number or "-" for REDIR_DUP
+    int body_fd;          // REDIR_HEREDOC: sealed anonymous file holding the body
+    int strip_tabs;       // <<-: leading tabs come off the body lines
+    int expand;           // Unquoted << delimiter: the body is expanded
+    struct Redirect *next;
+    struct Redirect *next_heredoc;  // Next here-document of the line
+} Redirect;
+
+Redirect *line_heredocs = NULL;  // Here-documents of the current line, closed once it is done
+
+typedef struct {
+    char **argv;          // NULL-terminated; argv[0] is NULL for a bare redirection
+    int argc;
+    int num_assignments;  // Leading NAME=value words
+    Redirect *redirects;  // In source order
+} Command;
+
+// Report format of a pipeline run under the time keyword
+typedef enum {
+    TIME_NONE,
+    TIME_DEFAULT,  // time
+    TIME_POSIX,    // time -p
+    TIME_JSON      // time -j
+} TimeFormat;
+
+// Scheduling and resource settings applied to a job's processes:
+// "with cpus=4-7 nice=10 ionice=idle rlimit.as=2G command &"
+typedef struct {
+    int has_cpus;
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+    int has_nice;
+    int nice;
+    int ioprio;           // Value for ioprio_set, or -1 to leave it alone
+    int num_rlimits;
+    int rlimit_resources[WITH_MAX_RLIMITS];
+    struct rlimit rlimits[WITH_MAX_RLIMITS];
+    char *text;           // The settings as written
+} WithSettings;
+
+typedef struct {
+    Command *commands;
+    int num_commands;
+    int background;       // Line ended with '&'
+    char *text;           // Source text, without the trailing '&'
+    TimeFormat timed;     // Line started with the time keyword
+    WithSettings *with;   // Line started with "with KEY=VALUE...", or NULL
+} Pipeline;
+
+// Resource limits that "with rlimit.NAME=VALUE" can set
+typedef struct {
+    const char *name;
+    int resource;
+} RlimitName;
+
+RlimitName rlimit_names[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"memlock", RLIMIT_MEMLOCK},
+    {"nofile", RLIMIT_NOFILE},
+    {"nproc", RLIMIT_NPROC},
+    {"rss", RLIMIT_RSS},
+    {"stack", RLIMIT_STACK},
+    {NULL, 0}
+};
+
+// When a stage of a traced pipeline was spawned and reaped
+typedef struct {
+    long long spawn;      // spawn_stage called
+    long long spawned;    // spawn_stage returned
+    long long exit;       // Reaped
+} StageTimes;
+
+// Single-pass lexer/parser state
+typedef struct {
+    const char *pos;      // Next character to read
+    StrBuf word;          // Word being built
+    int word_started;     // The word exists even if empty (e.g. "")
+    StrBuf pattern;       // The word with its quoted glob characters escaped,
+    int pattern_started;  // kept once the word contains one of *?[ or a backslash
+    int word_glob;        // The word has an unquoted *, ? or [
+    WordList *fields;     // Where finished words go
+    int no_split;         // Reading a NAME=value word: expansions are not split
+    int commands_cap;
+} Parser;
+
+// Pathname patterns are compiled once per word into one component per path
+// segment, each either a plain name or a list of match operations
+typedef enum {
+    GLOB_OP_LITERAL,  // One byte
+    GLOB_OP_ANY,      // ?
+    GLOB_OP_STAR,     // *
+    GLOB_OP_CLASS     // [...]
+} GlobOpType;
+
+typedef struct {
+    GlobOpType type;
+    unsigned char ch;
+    const uint8_t *class;  // 256-bit set of accepted bytes
+} GlobOp;
+
+typedef struct {
+    char *literal;       // The unescaped name when there are no wildcards
+    GlobOp *ops;
+    int num_ops;
+    int recursive;       // ** : any number of directories
+    int match_dot;       // Starts with a literal '.', so hidden names match
+    const char *suffix;  // Literal bytes every match ends with
+    size_t suffix_len;
+    int tail_star;       // Index of a last * followed only by the suffix, or -1
+} GlobComponent;
+
+typedef struct {
+    GlobComponent *components;
+    int num_components;
+    int dirs_only;       // The pattern ends in '/'
+    char path[PATH_MAX]; // Match being built, up to the directory being scanned
+    WordList *out;
+} Glob;
+
+// Directory listing in large batches: getdents64 on Linux, readdir elsewhere
+typedef struct {
+    int fd;
+#ifdef __linux__
+    char *buf;
+    long len;
+    long pos;
+#else
+    DIR *dir;
+#endif
+} DirScan;
+
+// Buffered reader over the shell's input, a script file or a -c string
+typedef struct {
+    int fd;           // -1 when reading from a string
+    char *buf;
+    size_t cap;
+    size_t start;     // First byte of the next line
+    size_t scan;      // Bytes before this are known to contain no newline
+    size_t end;       // End of the buffered data
+    int eof;
+    int seekable;     // fd is a regular file, see reader_sync
+    int event_fd;     // Also watched while waiting for input, -1 for none
+    void (*on_event)();  // Called when event_fd becomes readable
+} LineReader;
+
+// Interactive line editor, used when the shell reads from a terminal
+typedef struct {
+    char *buf;           // Line being edited, NUL-terminated
+    size_t len;
+    size_t cap;
+    size_t cursor;       // Byte offset of the cursor
+    const char *prompt;
+    size_t *nav;         // Log offsets of the history entries stepped back through
+    int nav_depth;       // 0 while editing the draft line
+    int nav_cap;
+    char *draft;         // The line as typed before stepping into history
+    int last_tab;        // The previous key was Tab: a second one lists the matches
+    StrBuf out;          // Terminal output being put together, reused for every redraw
+    StrBuf word;         // The word being completed
+} LineEditor;
+
+// Executables of one $PATH directory, for command completion
+typedef struct {
+    char *dir;
+    struct timespec mtime;  // When the names were read, -1 before the first scan
+    char **names;
+    size_t count;
+} CommandDir;
+
+LineEditor editor;
+struct termios editor_saved_termios;  // Terminal settings to restore after a line
+
+CommandDir *command_dirs = NULL;
+int num_command_dirs = 0;
+char *command_index_path = NULL;  // $PATH the index was built from
+char **command_index = NULL;      // Distinct names of all command_dirs and builtins, sorted
+size_t command_index_count = 0;
+
+// A descriptor operation applied in the child before exec:
+// dup2(src_fd, target_fd), or close(target_fd) when src_fd is negative
+typedef struct {
+    int src_fd;
+    int target_fd;
+} SpawnAction;
+
+// A utility builtin running as a pipeline stage on a thread of the shell.
+// It owns in_fd and out_fd and closes them when done, which is what the
+// stages around it see as EOF.
+typedef struct {
+    pthread_t thread;
+    Builtin *builtin;
+    char **args;
+    int in_fd;
+    int out_fd;
+    int status;
+    struct rusage usage;  // The thread's own, where the system keeps it
+} BuiltinStage;
+
+// How external commands are started, selected at runtime through $QUASH_SPAWN
+typedef enum {
+    SPAWN_BACKEND_POSIX_SPAWN,
+    SPAWN_BACKEND_FORK,
+    SPAWN_BACKEND_ZYGOTE
+} SpawnBackend;
+
+// A spawn handed to a zygote helper, followed by the shell's number and
+// close-on-exec flag of each attached descriptor (int32 pairs), the
+// SpawnActions, and the path, arguments and environment as NUL-terminated
+// strings. The first attached descriptor is the working directory.
+typedef struct {
+    uint32_t num_args;
+    uint32_t num_env;
+    uint32_t num_actions;
+    uint32_t num_fds;
+} ZygoteRequest;
+
+// A request to quash --serve: the command line, the directory to run it in
+// and num_env NAME=value overrides follow as NUL-terminated strings. The
+// client's standard input, output and error come attached (SCM_RIGHTS).
+typedef struct {
+    uint32_t num_env;
+} ServeRequest;
+
+// Sent back once the line has finished
+typedef struct {
+    int32_t status;     // Exit status of the line
+    int32_t pid;        // Process that ran it
+    int64_t real_us;
+    int64_t user_us;    // Including the commands it ran
+    int64_t sys_us;
+    int64_t maxrss_kb;
+} ServeReply;
+
+// A connected client of the server and the line it is running
+typedef struct {
+    int fd;             // -1 for a free slot
+    pid_t pid;          // Process running its request, 0 while idle
+    long long start;
+} ServeClient;
+
+ServeClient *serve_clients = NULL;  // Clients of quash --serve
+int num_serve_clients = 0;
+
+SpawnBackend spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+int zygote_fd = -1;    // The shell's end of the socket the helpers read requests from
+pid_t zygote_pid = 0;  // Process keeping the helper pool full
+long pipe_size = 0;  // Capacity of new pipes ($QUASH_PIPESIZE), 0 for the system default
+WithSettings *spawn_with = NULL;  // Settings for the children being spawned, or NULL
+
+// One argument of a parallel command template, split once at each {}:
+// the item goes between consecutive parts
+typedef struct {
+    char **parts;
+    size_t *part_lens;
+    int num_parts;      // Number of {} plus one
+    size_t fixed_len;   // Length of all parts together
+} TemplateArg;
+
+// A worker slot of the parallel builtin
+typedef struct {
+    pid_t pid;          // 0 when the slot is free
+    long seq;           // Position of the job's item in the input
+    char *item;
+    int out_fd;         // Read end of the job's output pipe (-k), -1 at EOF
+    int exited;
+    int status;
+    char *out;          // Output held back until earlier items are written
+    size_t out_len;
+    size_t out_cap;
+} ParallelSlot;
+
+// Output of a finished job waiting for the jobs before it (-k)
+typedef struct HeldOutput {
+    long seq;
+    char *data;
+    size_t len;
+    struct HeldOutput *next;
+} HeldOutput;
+
+typedef struct {
+    TemplateArg *tmpl;
+    int tmpl_argc;
+    int append_item;    // The template has no {}: the item is the last argument
+    char *path;         // Resolved command, NULL if it depends on the item
+    char **argv;        // Argument vector of the job being started
+    char *arg_buf;      // Storage for the arguments that contain the item
+    size_t arg_buf_cap;
+    char **items;       // Items given after :::, or NULL
+    LineReader *reader; // Otherwise items are lines read from here
+    ParallelSlot *slots;
+    int max_jobs;
+    int running;
+    int keep_order;     // -k: write outputs in input order
+    int notify;         // Queue notices for background jobs reaped meanwhile
+    long next_seq;      // Sequence number of the next item
+    long next_output;   // First item whose output is not written yet (-k)
+    HeldOutput *held;   // Sorted by seq
+    HeldOutput *held_tail;
+    long failed;
+} Parallel;
+
+int last_status = 0;        // Exit status of the last foreground command ($?)
+int *pipe_status = NULL;    // Exit status of each stage of it ($PIPESTATUS)
+int num_pipe_status = 0;
+extern char **environ;
+
+// A shell variable. Exported ones also own an entry of env_snapshot.
+typedef struct {
+    char *name;       // NULL for a free slot
+    char *value;
+    int exported;
+    int deleted;      // Tombstone left by unset, keeps probe chains intact
+    int env_index;    // Position in env_snapshot, -1 if not exported
+} ShellVar;
+
+ShellVar *var_table = NULL;     // Open-addressing table, size is a power of two
+size_t var_table_size = 0;
+size_t var_table_count = 0;     // Live variables
+size_t var_table_used = 0;      // Live variables plus tombstones
+
+// envp handed to children, kept in step with the exported variables so it
+// never has to be rebuilt from scratch; env_version counts the changes
+char **env_snapshot = NULL;
+int env_count = 0;
+int env_cap = 0;
+unsigned long env_version = 0;
+
+// History log: an append-only file of records laid out as
+// [record_len][cwd][text][trailer]. The fixed-size trailer at the end of
+// each record lets the log be walked backwards from its end; the leading
+// length allows a forward scan to repair a torn tail.
+typedef struct {
+    int64_t timestamp;     // When the command started, seconds since the epoch
+    int64_t duration_us;
+    uint32_t seq;          // Entry number, counting from 1
+    int32_t status;
+    uint32_t cwd_len;
+    uint32_t text_len;
+    uint32_t record_len;   // Whole record, length and trailer included
+    uint32_t magic;        // HISTORY_MAGIC
+} HistoryTrailer;
+
+typedef struct {
+    const char *text;      // Not NUL-terminated, see trailer.text_len
+    const char *cwd;
+    size_t start;          // Log offset of the record
+    HistoryTrailer trailer;
+} HistoryEntry;
+
+// Entries containing a trigram, for substring search
+typedef struct {
+    uint32_t key;          // Three bytes of text, 0 for a free slot
+    uint32_t last_id;      // Last entry added
+    uint32_t count;
+    uint8_t *data;         // Entry ids as varint-encoded deltas
+    size_t len;
+    size_t cap;
+} TrigramPosting;
+
+int history_fd = -1;
+char *history_map = NULL;            // The log, mapped read-only
+size_t history_map_size = 0;         // Size of the log when it was last mapped
+char *history_pending = NULL;        // Interactive line that is running
+char *history_pending_cwd = NULL;
+time_t history_pending_time;
+long long history_pending_start;
+size_t *history_offsets = NULL;      // End offset of each indexed entry, by id
+size_t history_num_indexed = 0;
+size_t history_offsets_cap = 0;
+size_t history_indexed_end = 0;      // Log offset up to which entries are indexed
+TrigramPosting *trigram_table = NULL; // Open-addressing table, size is a power of two
+size_t trigram_table_size = 0;
+size_t trigram_table_count = 0;
+
+// Resolved command paths, keyed by command name
+typedef struct {
+    char *name;
+    char *path;
+    unsigned long hits;
+} PathCacheEntry;
+
+// A $PATH directory and the mtime it had when the cache was filled
+typedef struct {
+    char *dir;
+    struct timespec mtime;
+} PathDir;
+
+PathCacheEntry *path_cache = NULL;  // Open-addressing table, size is a power of two
+size_t path_cache_size = 0;
+size_t path_cache_count = 0;
+PathDir *path_dirs = NULL;          // Directories of the $PATH the cache was built from
+int num_path_dirs = 0;
+char *path_cache_path = NULL;       // Copy of $PATH the cache was built from
+struct timespec path_cache_checked; // Last time the directory mtimes were checked
 
 // Function declarations
-char *expand_env_var_in_string(char *arg);
-char *expand_env_var_in_string_2(char *arg);
-
-void tokenize_command(char *command, char **args);
-void execute_single_command(char **args);
-void execute_piped_commands(char *input);
-void execute_multiple_pipes(char *input);
-int count_pipes(const char *input);
-void execute_command_with_redirection(char **args, char *output_file);
-void execute_command_with_input_redirection(char **args, char *input_file);
-void execute_command_with_append_redirection(char **args, char *output_file);
-void execute_command_with_input_output_redirection(char **args, char *input_file, char *output_file);
-void execute_command_with_input_output_append_redirection(char **args, char *input_file, char *output_file);
-void execute_command(char **args);
-void run_shell();
-void quash_pwd();
-void quash_echo(char **args);
-void quash_export(char **args);
-void quash_cd(char **args);
-void quash_jobs();
-void add_job(pid_t pid, char **args);
+char *get_special_var(const char *name);
+size_t hash_string(const char *str, size_t len);
+ShellVar *var_lookup(const char *name, size_t len);
+char *var_get(const char *name);
+char *var_value(const char *name, size_t len);
+void var_set(const char *name, const char *value, int export);
+int var_export(const char *name);
+void var_unset(const char *name);
+void var_init();
+char **var_envp();
+int quash_unset(char **args);
+void strbuf_reserve(StrBuf *buf, size_t len);
+void strbuf_append(StrBuf *buf, const char *str, size_t len);
+void wordlist_append(WordList *list, char *word);
+const char *substitution_end(const char *p);
+int lex_substitution(Parser *ps, int quoted);
+int lex_word(Parser *ps, WordList *fields);
+int heredoc_delimiter(Parser *ps, Redirect *redirect);
+char *heredoc_expand(const char *line);
+Pipeline *parse_line(const char *line);
+int glob_compile_component(GlobComponent *comp, const char *pattern, size_t len);
+int glob_match(const GlobComponent *comp, const char *name, size_t len);
+int dirscan_open(DirScan *scan, int dir_fd, const char *name);
+int dirscan_next(DirScan *scan, const char **name, unsigned char *type);
+void dirscan_close(DirScan *scan);
+void glob_emit(Glob *g, size_t path_len);
+void glob_walk(Glob *g, int dir_fd, int index, size_t path_len);
+int compare_strings(const void *a, const void *b);
+int glob_expand(const char *pattern, WordList *out);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *str);
+void arena_reset(Arena *arena);
+void arena_report(Arena *arena);
+
+void execute_pipeline(Pipeline *pipeline, StrBuf *capture);
+long long monotonic_ns();
+void trace_update();
+void trace_flush();
+void trace_printf(const char *fmt, ...);
+void trace_string(const char *str);
+void trace_line(Pipeline *pipeline, const char *executor, pid_t *pids, StageTimes *times, int *statuses, int num_stages);
+void trace_exit(pid_t pid, int status);
+void time_prefix(Pipeline *pipeline);
+int with_prefix(Pipeline *pipeline);
+int with_parse(WithSettings *with, const char *word);
+#ifdef __linux__
+int with_cpus(const char *list, cpu_set_t *set);
+#endif
+int with_apply(WithSettings *with, pid_t pid);
+char *with_merge(const char *settings, char **words);
+void with_sync_open(int fds[2]);
+void with_sync_wait(int fds[2]);
+double elapsed_since(struct timespec *start);
+void time_report(Pipeline *pipeline, double real, struct rusage *usages, int *statuses, int num_stages);
+int stage_actions(Command *cmd, int in_fd, int out_fd, SpawnAction *actions, int *num_actions, int *opened, int *num_opened);
+pid_t spawn_stage(Command *cmd, int in_fd, int out_fd, int *status, BuiltinStage **thread);
+int run_builtin(Command *cmd, Builtin *builtin, char **args, StrBuf *capture);
+void command_substitute(char *text, StrBuf *out);
+int status_to_exit_code(int status);
+void set_pipe_status(int *statuses, int count);
+int run_shell(LineReader *reader, int interactive);
+void reader_init_fd(LineReader *reader, int fd);
+void reader_init_string(LineReader *reader, const char *str);
+char *reader_next_line(LineReader *reader);
+void reader_sync(LineReader *reader);
+int editor_raw_mode(int fd, int enable);
+int editor_getc(LineReader *reader);
+void editor_append(StrBuf *buf, const char *str, size_t len);
+void editor_refresh();
+void editor_set_line(const char *str, size_t len);
+void editor_insert(const char *str, size_t len);
+void editor_delete(size_t start, size_t end);
+void editor_history_step(int older);
+void editor_complete();
+char *editor_read_line(LineReader *reader, const char *prompt);
+void command_dir_scan(CommandDir *cd);
+void command_index_update();
+void complete_commands(const char *prefix, size_t len, WordList *out);
+void complete_files(const char *word, size_t len, int executables, WordList *out);
+void complete_variables(const char *prefix, size_t len, WordList *out);
+void complete_jobs(const char *prefix, size_t len, WordList *out);
+int quash_pwd(char **args);
+int quash_echo(char **args);
+int quash_export(char **args);
+int quash_cd(char **args);
+int quash_jobs(char **args);
+Job *add_job(pid_t pid, const char *command);
+Job *find_job_by_pid(pid_t pid);
+Job *find_job_by_id(int job_id);
 void remove_job(pid_t pid);
-void quash_kill(char **args);
-void check_background_jobs();
+int quash_kill(char **args);
+void check_background_jobs(int notify);
 void sigchld_handler(int signum);
+void child_events_init();
+void child_exited(pid_t pid, int status, int notify);
+void reap_children(int notify);
+void flush_job_notices();
+void interactive_child_event();
+int quash_wait(char **args);
+int quash_with(char **args);
+int serve(const char *path);
+void serve_accept(int listen_fd);
+void serve_request(ServeClient *client, int listen_fd);
+void serve_reap();
+int client_main(const char *path, char **args);
+char *history_path();
+int history_open();
+int history_map_refresh();
+int history_entry_at(size_t end, HistoryEntry *entry);
+void history_repair();
+void history_append(const char *text, const char *cwd, time_t timestamp, long long duration_us, int status);
+void history_begin_line(const char *line);
+void history_finish_line();
+char *history_expand(const char *line);
+TrigramPosting *trigram_slot(TrigramPosting *table, size_t size, uint32_t key);
+void trigram_table_grow();
+void trigram_add(uint32_t key, uint32_t id);
+void trigram_decode(TrigramPosting *posting, uint32_t *ids);
+void history_index_update();
+void history_print(HistoryEntry *entry, int long_format);
+void history_search(const char *pattern, int long_format);
+int quash_history(char **args);
+TemplateArg *parallel_compile(char **args, int argc, int *num_holes);
+int parallel_expand(Parallel *par, const char *item);
+int write_all(int fd, const char *data, size_t len);
+void parallel_start(Parallel *par, ParallelSlot *slot, const char *item);
+void parallel_finish(Parallel *par, ParallelSlot *slot);
+void parallel_advance(Parallel *par);
+void parallel_read_output(Parallel *par, ParallelSlot *slot);
+void parallel_reap(Parallel *par);
+void parallel_abort(Parallel *par);
+int quash_parallel(char **args);
+char *lookup_command(char *name);
+char *path_cache_resolve(const char *name, int count_hit);
+void path_cache_clear();
+void path_cache_check();
+int quash_hash(char **args);
+void spawn_backend_update();
+void zygote_start();
+void zygote_stop();
+void zygote_helper(int sock, int refill_fd);
+void zygote_main(int sock, int pool);
+pid_t zygote_spawn(char *path, char **args, char **envp, SpawnAction *actions, int num_actions);
+pid_t spawn_command(char *path, char **args, char **envp, SpawnAction *actions, int num_actions);
+int apply_spawn_actions(SpawnAction *actions, int num_actions);
+char **script_args(char *path, char **args);
+void exec_command(char *path, char **args, char **envp);
+char **command_envp(Command *cmd);
+char *command_name(Command *cmd);
+int make_pipe(int fds[2]);
+long parse_size(const char *value);
+void pipe_size_update();
+void set_pipe_size(int fd, long size);
+void close_cloexec_fds();
+pid_t spawn_builtin(int (*builtin)(char **), char **args, SpawnAction *actions, int num_actions);
+BuiltinStage *builtin_stage_start(Builtin *builtin, char **args, SpawnAction *actions, int num_actions);
+void *builtin_stage_main(void *arg);
+int tee_copy(int in, int out, int *fds, int num_fds);
+int splice_all(int in, int out, size_t len);
+int tee_splice(int in, int out, int *fds, int num_fds);
+int quash_tee(char **args);
+int open_redirect_file(const char *file, int flags);
+int heredoc_create();
+void heredoc_seal(int fd);
+int heredoc_string(const char *word);
+int heredoc_read(Pipeline *pipeline, LineReader *reader, int interactive);
+void heredoc_close_all();
+void builtin_table_init();
+Builtin *builtin_lookup(const char *name);
+int quash_exit(char **args);
+void output_write(const char *data, size_t len);
+void output_writev(Output *out, const char *data, size_t len);
+void output_format(const char *fmt, ...);
+void output_flush();
+int output_failed();
+int output_fd();
+int quash_true(char **args);
+int quash_false(char **args);
+int test_integer(const char *str, long long *value, int *error);
+int test_unary(const char *op, const char *arg, int *error);
+int test_binary(const char *left, const char *op, const char *right, int *error);
+int test_is_unary(const char *op);
+int test_is_binary(const char *op);
+int test_or(char **args, int *pos, int end, int *error);
+int test_and(char **args, int *pos, int end, int *error);
+int test_not(char **args, int *pos, int end, int *error);
+int test_primary(char **args, int *pos, int end, int *error);
+int test_eval(char **args, int pos, int end, int *error);
+int quash_test(char **args);
+int printf_escape(const char *p, char *out, size_t *len, int in_b, int *stop);
+long long printf_integer(const char *arg, int *status);
+int quash_printf(char **args);
+int cat_copy(int fd, int *state, long long *line, int flags);
+int quash_cat(char **args);
+int quash_basename(char **args);
+int quash_dirname(char **args);
+int seq_format(char *text, size_t size, const char *format, int decimals, long double value);
+void seq_write(const char *text, int len, int width);
+int quash_seq(char **args);
+
+// The builtins, by name; lookups go through builtin_table
+Builtin builtins[] = {
+    {"[", quash_test, BUILTIN_UTILITY},
+    {"basename", quash_basename, BUILTIN_UTILITY},
+    {"cat", quash_cat, BUILTIN_UTILITY | BUILTIN_READS_INPUT},
+    {"cd", quash_cd, 0},
+    {"dirname", quash_dirname, BUILTIN_UTILITY},
+    {"echo", quash_echo, BUILTIN_UTILITY},
+    {"exit", quash_exit, 0},
+    {"export", quash_export, 0},
+    {"false", quash_false, BUILTIN_UTILITY},
+    {"hash", quash_hash, 0},
+    {"history", quash_history, 0},
+    {"jobs", quash_jobs, 0},
+    {"kill", quash_kill, 0},
+    {"parallel", quash_parallel, BUILTIN_READS_INPUT},
+    {"printf", quash_printf, BUILTIN_UTILITY},
+    {"pwd", quash_pwd, BUILTIN_UTILITY},
+    {"quit", quash_exit, 0},
+    {"seq", quash_seq, BUILTIN_UTILITY},
+    {"tee", quash_tee, BUILTIN_UTILITY | BUILTIN_READS_INPUT},
+    {"test", quash_test, BUILTIN_UTILITY},
+    {"true", quash_true, BUILTIN_UTILITY},
+    {"unset", quash_unset, 0},
+    {"wait", quash_wait, 0},
+    {"with", quash_with, 0},
+    {NULL, NULL, 0}
+};
 
 
 
 
-extern Job jobs[];  // Declare the jobs array
 extern int num_jobs; // Declare the number of jobs
 
 // Main function
-int main() {
-    // Set up the signal handler for SIGCHLD
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;  // Restart interrupted system calls
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
+int main(int argc, char **argv) {
+    // Exited children are picked up from the main loop
+    child_events_init();
+
+    // Take over the environment as the shell's variable table
+    var_init();
+    builtin_table_init();
+    spawn_backend_update();
+
+    // --trace FILE logs executed lines, like QUASH_TRACE=FILE
+    if (argc > 2 && strcmp(argv[1], "--trace") == 0) {
+        var_set("QUASH_TRACE", argv[2], 0);
+        argv += 2;
+        argc -= 2;
+    }
+
+    // --serve SOCKET runs lines sent by --client SOCKET [-t] [-e NAME=value] LINE
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "quash: usage: quash --serve SOCKET\n");
+            return 2;
+        }
+        return serve(argv[2]);
+    }
+    if (argc > 1 && strcmp(argv[1], "--client") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "quash: usage: quash --client SOCKET [-t] [-e NAME=value]... LINE\n");
+            return 2;
+        }
+        return client_main(argv[2], argv + 3);
+    }
+
+    // Pick the input: quash -c 'command', quash script, or stdin
+    LineReader reader;
+    int interactive = 0;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "quash: -c: option requires an argument\n");
+            return 2;
+        }
+        reader_init_string(&reader, argv[2]);
+    } else if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "quash: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        reader_init_fd(&reader, fd);
+    } else {
+        reader_init_fd(&reader, STDIN_FILENO);
+        interactive = isatty(STDIN_FILENO);
+        if (interactive) {
+            // Report finished jobs as soon as they end, not at the next prompt
+            reader.event_fd = child_event_fd;
+            reader.on_event = interactive_child_event;
+            history_open();
+        }
+    }
+
+    // Start the shell
+    if (interactive) {
+        printf("Welcome to Quash Shell!\n");
+    }
+    return run_shell(&reader, interactive);
+}
+
+// Read input lines from a file descriptor through a large buffer
+void reader_init_fd(LineReader *reader, int fd) {
+    struct stat st;
+    memset(reader, 0, sizeof(LineReader));
+    reader->fd = fd;
+    reader->cap = READ_BUFFER_SIZE;
+    reader->buf = malloc(reader->cap);
+    if (reader->buf == NULL) {
+        perror("quash: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    reader->seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    reader->event_fd = -1;
+}
+
+// Read input lines from a string, as given with -c
+void reader_init_string(LineReader *reader, const char *str) {
+    memset(reader, 0, sizeof(LineReader));
+    reader->fd = -1;
+    reader->buf = strdup(str);
+    if (reader->buf == NULL) {
+        perror("quash: strdup failed");
         exit(EXIT_FAILURE);
     }
-
-    // Start the shell
-    printf("Welcome to Quash Shell!\n");
-    run_shell();
-    return 0;
+    reader->end = strlen(str);
+    reader->cap = reader->end + 1;
+    reader->eof = 1;
+    reader->event_fd = -1;
+}
+
+// Return the next line without its newline, or NULL at end of input. Lines
+// of any length are returned whole; the pointer is valid until the next call.
+char *reader_next_line(LineReader *reader) {
+    while (1) {
+        char *nl = memchr(reader->buf + reader->scan, '\n', reader->end - reader->scan);
+        if (nl != NULL) {
+            char *line = reader->buf + reader->start;
+            *nl = '\0';
+            reader->start = reader->scan = nl - reader->buf + 1;
+            return line;
+        }
+        reader->scan = reader->end;  // No newline up to here; don't search it again
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // Last line without a newline; there is always room for the NUL
+            char *line = reader->buf + reader->start;
+            reader->buf[reader->end] = '\0';
+            reader->start = reader->scan = reader->end;
+            return line;
+        }
+
+        // Move the partial line to the front, growing the buffer if it is full
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->scan -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end + 1 >= reader->cap) {
+            char *buf = realloc(reader->buf, reader->cap * 2);
+            if (buf == NULL) {
+                perror("quash: realloc failed");
+                exit(EXIT_FAILURE);
+            }
+            reader->buf = buf;
+            reader->cap *= 2;
+        }
+
+        // Handle events (exited children) that arrive while no input is ready
+        if (reader->event_fd >= 0) {
+            struct pollfd fds[2] = {{reader->fd, POLLIN, 0}, {reader->event_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) continue;
+                perror("quash: poll failed");
+            } else if (fds[1].revents & POLLIN) {
+                reader->on_event();
+                if (fds[0].revents == 0) continue;
+            }
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end - 1);
+        if (n > 0) {
+            reader->end += n;
+        } else if (n == 0) {
+            reader->eof = 1;
+        } else if (errno != EINTR) {
+            perror("quash: read failed");
+            reader->eof = 1;
+        }
+    }
+}
+
+// Give unread, already buffered input back to a seekable stdin so that
+// commands reading stdin start right after the current line
+void reader_sync(LineReader *reader) {
+    if (reader->fd != STDIN_FILENO || !reader->seekable || reader->start == reader->end) {
+        return;
+    }
+    if (lseek(reader->fd, -(off_t)(reader->end - reader->start), SEEK_CUR) != -1) {
+        reader->start = reader->scan = reader->end = 0;
+        reader->eof = 0;
+    }
+}
+
+
+// Switch the terminal in and out of the mode the line editor reads in: no
+// echo, no line buffering, and ^C/^Z arrive as bytes instead of signals
+int editor_raw_mode(int fd, int enable) {
+    if (!enable) {
+        return tcsetattr(fd, TCSADRAIN, &editor_saved_termios);
+    }
+    if (tcgetattr(fd, &editor_saved_termios) == -1) {
+        return -1;
+    }
+    struct termios raw = editor_saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN | ISIG);
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSADRAIN, &raw);
+}
+
+// Next input byte for the editor, taken from the reader's buffer so typed
+// ahead or pasted lines are kept for the following calls. Returns -1 at end
+// of input and -2 after handling an event, when the line must be redrawn.
+int editor_getc(LineReader *reader) {
+    while (reader->start == reader->end) {
+        reader->start = reader->scan = reader->end = 0;
+        if (reader->eof) {
+            return -1;
+        }
+        if (reader->event_fd >= 0) {
+            struct pollfd fds[2] = {{reader->fd, POLLIN, 0}, {reader->event_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) continue;
+                perror("quash: poll failed");
+            } else if (fds[1].revents & POLLIN) {
+                reader->on_event();
+                return -2;
+            }
+        }
+
+        ssize_t n = read(reader->fd, reader->buf, reader->cap - 1);
+        if (n > 0) {
+            reader->end = n;
+        } else if (n == 0) {
+            reader->eof = 1;
+        } else if (errno != EINTR) {
+            perror("quash: read failed");
+            reader->eof = 1;
+        }
+    }
+    return (unsigned char)reader->buf[reader->start++];
+}
+
+// Append to one of the editor's own buffers. They are malloc'd and reused
+// from key to key; the line arena is only reset between lines, so drawing
+// from it on every key would cost memory quadratic in the line's length.
+void editor_append(StrBuf *buf, const char *str, size_t len) {
+    if (buf->len + len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : 256;
+        while (cap < buf->len + len + 1) {
+            cap *= 2;
+        }
+        char *data = realloc(buf->data, cap);
+        if (data == NULL) {
+            perror("quash: realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// Redraw the prompt and the line, and put the cursor back in place
+void editor_refresh() {
+    StrBuf *out = &editor.out;
+    out->len = 0;
+    editor_append(out, "\r", 1);
+    editor_append(out, editor.prompt, strlen(editor.prompt));
+    editor_append(out, editor.buf, editor.len);
+    editor_append(out, "\033[K", 3);
+
+    // Count characters, not bytes, back to the cursor
+    size_t back = 0;
+    for (size_t i = editor.cursor; i < editor.len; i++) {
+        back += ((unsigned char)editor.buf[i] & 0xC0) != 0x80;
+    }
+    if (back > 0) {
+        char move[32];
+        int n = snprintf(move, sizeof(move), "\033[%zuD", back);
+        editor_append(out, move, n);
+    }
+    write_all(STDOUT_FILENO, out->data, out->len);
+}
+
+// Replace the whole line, with the cursor at its end
+void editor_set_line(const char *str, size_t len) {
+    editor.len = 0;
+    editor.cursor = 0;
+    editor_insert(str, len);
+}
+
+// Insert text at the cursor
+void editor_insert(const char *str, size_t len) {
+    if (editor.len + len + 1 > editor.cap) {
+        size_t cap = editor.cap ? editor.cap * 2 : 256;
+        while (cap < editor.len + len + 1) {
+            cap *= 2;
+        }
+        char *buf = realloc(editor.buf, cap);
+        if (buf == NULL) {
+            perror("quash: realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        editor.buf = buf;
+        editor.cap = cap;
+    }
+    memmove(editor.buf + editor.cursor + len, editor.buf + editor.cursor, editor.len - editor.cursor);
+    memcpy(editor.buf + editor.cursor, str, len);
+    editor.len += len;
+    editor.cursor += len;
+    editor.buf[editor.len] = '\0';
+}
+
+// Remove the bytes from start to end, leaving the cursor at start
+void editor_delete(size_t start, size_t end) {
+    memmove(editor.buf + start, editor.buf + end, editor.len - end);
+    editor.len -= end - start;
+    editor.cursor = start;
+    editor.buf[editor.len] = '\0';
+}
+
+// Show the previous (older) or next history entry, walking the log
+// backwards from its end; the offsets stepped through are kept to come back
+void editor_history_step(int older) {
+    HistoryEntry entry;
+    if (older) {
+        size_t end;
+        if (editor.nav_depth == 0) {
+            if (history_open() == -1 || history_map_refresh() == -1) {
+                return;
+            }
+            end = history_map_size;
+        } else if (history_entry_at(editor.nav[editor.nav_depth - 1], &entry) == 0) {
+            end = entry.start;
+        } else {
+            return;
+        }
+        if (history_entry_at(end, &entry) == -1) {
+            return;
+        }
+        if (editor.nav_depth == editor.nav_cap) {
+            int cap = editor.nav_cap ? editor.nav_cap * 2 : 64;
+            size_t *nav = realloc(editor.nav, cap * sizeof(size_t));
+            if (nav == NULL) {
+                return;
+            }
+            editor.nav = nav;
+            editor.nav_cap = cap;
+        }
+        if (editor.nav_depth == 0) {
+            free(editor.draft);
+            editor.draft = strdup(editor.buf);
+        }
+        editor.nav[editor.nav_depth++] = end;
+        editor_set_line(entry.text, entry.trailer.text_len);
+        return;
+    }
+
+    if (editor.nav_depth == 0) {
+        return;
+    }
+    editor.nav_depth--;
+    if (editor.nav_depth == 0) {
+        editor_set_line(editor.draft ? editor.draft : "", editor.draft ? strlen(editor.draft) : 0);
+    } else if (history_entry_at(editor.nav[editor.nav_depth - 1], &entry) == 0) {
+        editor_set_line(entry.text, entry.trailer.text_len);
+    }
+}
+
+// Complete the word before the cursor: a job id after kill or wait, a
+// variable after '$', a command name in command position, otherwise a path.
+// A unique match is inserted whole; several extend the word to their
+// common prefix, and a second Tab lists them.
+void editor_complete() {
+    size_t start = editor.cursor;
+    while (start > 0 && ((!IS_BLANK(editor.buf[start - 1]) && !IS_OPERATOR(editor.buf[start - 1])) ||
+                         (start > 1 && editor.buf[start - 2] == '\\'))) {
+        start--;
+    }
+
+    // The word as the lexer would read it, for backslash escapes
+    StrBuf *word = &editor.word;
+    word->len = 0;
+    editor_append(word, "", 0);
+    for (size_t i = start; i < editor.cursor; i++) {
+        if (editor.buf[i] == '\\' && i + 1 < editor.cursor) {
+            i++;
+        }
+        editor_append(word, &editor.buf[i], 1);
+    }
+
+    size_t before = start;
+    while (before > 0 && IS_BLANK(editor.buf[before - 1])) {
+        before--;
+    }
+    int command_position = before == 0 || editor.buf[before - 1] == '|' || editor.buf[before - 1] == '&';
+    size_t first_word = strspn(editor.buf, " \t");
+    size_t first_len = strcspn(editor.buf + first_word, " \t|&<>");
+
+    WordList matches = {NULL, 0, 0};
+    if (word->data[0] == '%' && !command_position &&
+        ((first_len == 4 && strncmp(editor.buf + first_word, "kill", 4) == 0) ||
+         (first_len == 4 && strncmp(editor.buf + first_word, "wait", 4) == 0))) {
+        complete_jobs(word->data, word->len, &matches);
+    } else if (word->data[0] == '$') {
+        complete_variables(word->data, word->len, &matches);
+    } else if (command_position && strchr(word->data, '/') == NULL) {
+        complete_commands(word->data, word->len, &matches);
+    } else {
+        complete_files(word->data, word->len, command_position, &matches);
+    }
+
+    if (matches.count == 0) {
+        write_all(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+
+    // Extend the word to the longest prefix all matches share
+    size_t common = strlen(matches.items[0]);
+    for (int i = 1; i < matches.count && common > word->len; i++) {
+        size_t j = word->len;
+        while (j < common && matches.items[i][j] == matches.items[0][j]) {
+            j++;
+        }
+        common = j;
+    }
+    if (common > word->len || matches.count == 1) {
+        StrBuf *add = &editor.out;
+        add->len = 0;
+        editor_append(add, "", 0);
+        for (size_t i = word->len; i < common; i++) {
+            char c = matches.items[0][i];
+            if (IS_BLANK(c) || IS_OPERATOR(c) || strchr("'\"\\$*?[", c) != NULL) {
+                editor_append(add, "\\", 1);
+            }
+            editor_append(add, &c, 1);
+        }
+        if (matches.count == 1 && (common == 0 || matches.items[0][common - 1] != '/')) {
+            editor_append(add, " ", 1);
+        }
+        editor_insert(add->data, add->len);
+        editor_refresh();
+        return;
+    }
+
+    if (!editor.last_tab) {
+        write_all(STDOUT_FILENO, "\a", 1);
+        editor.last_tab = 1;
+        return;
+    }
+
+    // List the matches in columns under the line, then redraw it
+    struct winsize ws;
+    size_t width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t widest = 0;
+    for (int i = 0; i < matches.count; i++) {
+        size_t len = strlen(matches.items[i]);
+        widest = len > widest ? len : widest;
+    }
+    size_t columns = width / (widest + 2);
+    columns = columns ? columns : 1;
+    int shown = matches.count < 1000 ? matches.count : 1000;
+    size_t rows = (shown + columns - 1) / columns;
+
+    StrBuf *out = &editor.out;
+    out->len = 0;
+    editor_append(out, "\n", 1);
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t c = 0; c < columns; c++) {
+            size_t i = c * rows + r;
+            if (i >= (size_t)shown) {
+                break;
+            }
+            size_t len = strlen(matches.items[i]);
+            editor_append(out, matches.items[i], len);
+            if ((c + 1) * rows + r < (size_t)shown) {
+                for (size_t pad = len; pad < widest + 2; pad++) {
+                    editor_append(out, " ", 1);
+                }
+            }
+        }
+        editor_append(out, "\n", 1);
+    }
+    if (shown < matches.count) {
+        char more[64];
+        int n = snprintf(more, sizeof(more), "... and %d more\n", matches.count - shown);
+        editor_append(out, more, n);
+    }
+    write_all(STDOUT_FILENO, out->data, out->len);
+    editor_refresh();
+}
+
+// Read a line from the terminal with editing, history (up/down) and
+// completion (Tab). The prompt has already been printed. Returns NULL at
+// end of input; the line is valid until the next call.
+char *editor_read_line(LineReader *reader, const char *prompt) {
+    if (editor_raw_mode(reader->fd, 1) == -1) {
+        return reader_next_line(reader);
+    }
+    editor.prompt = prompt;
+    editor.nav_depth = 0;
+    editor.last_tab = 0;
+    editor_set_line("", 0);
+
+    char *line = editor.buf;
+    while (1) {
+        int c = editor_getc(reader);
+        int tab = c == '\t';
+        if (c == -1 || (c == 4 && editor.len == 0)) {
+            // End of input, or ^D on an empty line
+            line = NULL;
+            break;
+        } else if (c == -2) {
+            editor_refresh();
+        } else if (c == '\r' || c == '\n') {
+            write_all(STDOUT_FILENO, "\n", 1);
+            break;
+        } else if (c == '\t') {
+            editor_complete();
+        } else if (c == 3) {
+            // ^C drops the line
+            write_all(STDOUT_FILENO, "^C\n", 3);
+            last_status = 130;
+            editor.nav_depth = 0;
+            editor_set_line("", 0);
+            editor_refresh();
+        } else if (c == 127 || c == 8) {
+            if (editor.cursor > 0) {
+                size_t start = editor.cursor - 1;
+                while (start > 0 && ((unsigned char)editor.buf[start] & 0xC0) == 0x80) {
+                    start--;
+                }
+                editor_delete(start, editor.cursor);
+                editor_refresh();
+            }
+        } else if (c == 4) {
+            // ^D deletes the character under the cursor
+            if (editor.cursor < editor.len) {
+                size_t end = editor.cursor + 1;
+                while (end < editor.len && ((unsigned char)editor.buf[end] & 0xC0) == 0x80) {
+                    end++;
+                }
+                size_t cursor = editor.cursor;
+                editor_delete(cursor, end);
+                editor_refresh();
+            }
+        } else if (c == 1) {
+            editor.cursor = 0;
+            editor_refresh();
+        } else if (c == 5) {
+            editor.cursor = editor.len;
+            editor_refresh();
+        } else if (c == 2 || c == 6) {
+            // ^B and ^F, one character left or right
+            if (c == 2 && editor.cursor > 0) {
+                do {
+                    editor.cursor--;
+                } while (editor.cursor > 0 && ((unsigned char)editor.buf[editor.cursor] & 0xC0) == 0x80);
+            } else if (c == 6 && editor.cursor < editor.len) {
+                do {
+                    editor.cursor++;
+                } while (editor.cursor < editor.len && ((unsigned char)editor.buf[editor.cursor] & 0xC0) == 0x80);
+            }
+            editor_refresh();
+        } else if (c == 11) {
+            editor.len = editor.cursor;
+            editor.buf[editor.len] = '\0';
+            editor_refresh();
+        } else if (c == 21) {
+            editor_delete(0, editor.cursor);
+            editor_refresh();
+        } else if (c == 23) {
+            // ^W deletes the word before the cursor
+            size_t start = editor.cursor;
+            while (start > 0 && IS_BLANK(editor.buf[start - 1])) {
+                start--;
+            }
+            while (start > 0 && !IS_BLANK(editor.buf[start - 1])) {
+                start--;
+            }
+            editor_delete(start, editor.cursor);
+            editor_refresh();
+        } else if (c == 12) {
+            write_all(STDOUT_FILENO, "\033[H\033[2J", 7);
+            editor_refresh();
+        } else if (c == 16 || c == 14) {
+            editor_history_step(c == 16);
+            editor_refresh();
+        } else if (c == 27) {
+            // Escape sequences: arrows, Home/End, Delete
+            int next = editor_getc(reader);
+            if (next != '[' && next != 'O') {
+                continue;
+            }
+            int param = 0;
+            int key = editor_getc(reader);
+            while (key >= '0' && key <= '9') {
+                param = param * 10 + key - '0';
+                key = editor_getc(reader);
+            }
+            if (key == 'A' || key == 'B') {
+                editor_history_step(key == 'A');
+            } else if (key == 'C' && editor.cursor < editor.len) {
+                do {
+                    editor.cursor++;
+                } while (editor.cursor < editor.len && ((unsigned char)editor.buf[editor.cursor] & 0xC0) == 0x80);
+            } else if (key == 'D' && editor.cursor > 0) {
+                do {
+                    editor.cursor--;
+                } while (editor.cursor > 0 && ((unsigned char)editor.buf[editor.cursor] & 0xC0) == 0x80);
+            } else if (key == 'H' || (key == '~' && (param == 1 || param == 7))) {
+                editor.cursor = 0;
+            } else if (key == 'F' || (key == '~' && (param == 4 || param == 8))) {
+                editor.cursor = editor.len;
+            } else if (key == '~' && param == 3 && editor.cursor < editor.len) {
+                size_t end = editor.cursor + 1;
+                while (end < editor.len && ((unsigned char)editor.buf[end] & 0xC0) == 0x80) {
+                    end++;
+                }
+                editor_delete(editor.cursor, end);
+            }
+            editor_refresh();
+        } else if (c >= 32) {
+            char ch = c;
+            editor_insert(&ch, 1);
+            if (editor.cursor == editor.len && c < 127) {
+                write_all(STDOUT_FILENO, &ch, 1);
+            } else if (c < 0x80 || reader->start == reader->end ||
+                       ((unsigned char)reader->buf[reader->start] & 0xC0) != 0x80) {
+                // Redraw once a multibyte character is complete
+                editor_refresh();
+            }
+        }
+        editor.last_tab = tab;
+        line = editor.buf;
+    }
+
+    editor_raw_mode(reader->fd, 0);
+    return line;
+}
+
+// Read the executables of a $PATH directory. d_type rules out directories
+// without a stat, but the permission bits still need one per name.
+void command_dir_scan(CommandDir *cd) {
+    for (size_t i = 0; i < cd->count; i++) {
+        free(cd->names[i]);
+    }
+    free(cd->names);
+    cd->names = NULL;
+    cd->count = 0;
+
+    struct stat st;
+    cd->mtime.tv_sec = 0;
+    cd->mtime.tv_nsec = 0;
+    if (stat(cd->dir, &st) == 0) {
+        cd->mtime = ST_MTIM(st);
+    }
+
+    DirScan scan;
+    if (dirscan_open(&scan, AT_FDCWD, cd->dir) == -1) {
+        return;
+    }
+    size_t cap = 0;
+    const char *name;
+    unsigned char type;
+    while (dirscan_next(&scan, &name, &type)) {
+        if (type == DT_DIR || fstatat(scan.fd, name, &st, 0) == -1 ||
+            !S_ISREG(st.st_mode) || (st.st_mode & 0111) == 0) {
+            continue;
+        }
+        if (cd->count == cap) {
+            cap = cap ? cap * 2 : 256;
+            char **names = realloc(cd->names, cap * sizeof(char *));
+            if (names == NULL) {
+                break;
+            }
+            cd->names = names;
+        }
+        cd->names[cd->count] = strdup(name);
+        if (cd->names[cd->count] != NULL) {
+            cd->count++;
+        }
+    }
+    dirscan_close(&scan);
+}
+
+// Bring the command index up to date: $PATH changes start it over, and
+// otherwise only directories whose mtime moved are read again. Checking
+// costs one stat per directory, so it runs on every completion.
+void command_index_update() {
+    char *path_env = var_get("PATH");
+    if (path_env == NULL) {
+        path_env = "/usr/local/bin:/usr/bin:/bin";
+    }
+
+    int changed = 0;
+    if (command_index_path == NULL || strcmp(path_env, command_index_path) != 0) {
+        for (int i = 0; i < num_command_dirs; i++) {
+            for (size_t j = 0; j < command_dirs[i].count; j++) {
+                free(command_dirs[i].names[j]);
+            }
+            free(command_dirs[i].names);
+            free(command_dirs[i].dir);
+        }
+        free(command_dirs);
+        free(command_index_path);
+        command_index_path = strdup(path_env);
+        num_command_dirs = 0;
+
+        int count = 1;
+        for (char *p = path_env; *p != '\0'; p++) {
+            if (*p == ':') count++;
+        }
+        command_dirs = calloc(count, sizeof(CommandDir));
+        char *start = path_env;
+        while (command_dirs != NULL) {
+            char *end = strchr(start, ':');
+            size_t len = end ? (size_t)(end - start) : strlen(start);
+            CommandDir *cd = &command_dirs[num_command_dirs++];
+            cd->dir = len ? strndup(start, len) : strdup(".");
+            cd->mtime.tv_sec = -1;
+            if (end == NULL) break;
+            start = end + 1;
+        }
+        changed = 1;
+    }
+
+    for (int i = 0; i < num_command_dirs; i++) {
+        CommandDir *cd = &command_dirs[i];
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(cd->dir, &st) == 0) {
+            mtime = ST_MTIM(st);
+        }
+        if (mtime.tv_sec != cd->mtime.tv_sec || mtime.tv_nsec != cd->mtime.tv_nsec) {
+            command_dir_scan(cd);
+            changed = 1;
+        }
+    }
+    if (!changed) {
+        return;
+    }
+
+    // The keywords "command" and "time" are completed alongside the builtins
+    size_t total = sizeof(builtins) / sizeof(builtins[0]) + 2;
+    for (int i = 0; i < num_command_dirs; i++) {
+        total += command_dirs[i].count;
+    }
+    free(command_index);
+    command_index = malloc(total * sizeof(char *));
+    command_index_count = 0;
+    if (command_index == NULL) {
+        return;
+    }
+    for (Builtin *b = builtins; b->name != NULL; b++) {
+        command_index[command_index_count++] = (char *)b->name;
+    }
+    command_index[command_index_count++] = "command";
+    command_index[command_index_count++] = "time";
+    for (int i = 0; i < num_command_dirs; i++) {
+        memcpy(command_index + command_index_count, command_dirs[i].names, command_dirs[i].count * sizeof(char *));
+        command_index_count += command_dirs[i].count;
+    }
+    qsort(command_index, command_index_count, sizeof(char *), compare_strings);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < command_index_count; i++) {
+        if (unique == 0 || strcmp(command_index[i], command_index[unique - 1]) != 0) {
+            command_index[unique++] = command_index[i];
+        }
+    }
+    command_index_count = unique;
+}
+
+// Command names starting with prefix: a binary search finds the first one
+// in the sorted index, and the rest follow it
+void complete_commands(const char *prefix, size_t len, WordList *out) {
+    command_index_update();
+    size_t lo = 0;
+    size_t hi = command_index_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(command_index[mid], prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    while (lo < command_index_count && strncmp(command_index[lo], prefix, len) == 0) {
+        wordlist_append(out, command_index[lo++]);
+    }
+}
+
+// Paths starting with word, directories with a trailing slash. Hidden names
+// are offered only once the word starts them with a dot. In command
+// position only directories and executables are offered.
+void complete_files(const char *word, size_t len, int executables, WordList *out) {
+    const char *slash = strrchr(word, '/');
+    size_t dir_len = slash ? (size_t)(slash - word) + 1 : 0;
+    const char *base = word + dir_len;
+    size_t base_len = len - dir_len;
+    char *dir = arena_alloc(&line_arena, dir_len + 2);
+    if (dir_len > 0) {
+        memcpy(dir, word, dir_len);
+        dir[dir_len] = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+
+    DirScan scan;
+    if (dirscan_open(&scan, AT_FDCWD, dir) == -1) {
+        return;
+    }
+    int start = out->count;
+    const char *name;
+    unsigned char type;
+    while (dirscan_next(&scan, &name, &type)) {
+        if (strncmp(name, base, base_len) != 0 || (name[0] == '.' && base[0] != '.')) {
+            continue;
+        }
+        struct stat st;
+        int is_dir = type == DT_DIR;
+        if (type == DT_LNK || type == DT_UNKNOWN || (executables && !is_dir)) {
+            if (fstatat(scan.fd, name, &st, 0) == -1) {
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+            if (executables && !is_dir && (st.st_mode & 0111) == 0) {
+                continue;
+            }
+        }
+        size_t name_len = strlen(name);
+        char *match = arena_alloc(&line_arena, dir_len + name_len + 2);
+        memcpy(match, word, dir_len);
+        memcpy(match + dir_len, name, name_len);
+        match[dir_len + name_len] = '/';
+        match[dir_len + name_len + is_dir] = '\0';
+        wordlist_append(out, match);
+    }
+    dirscan_close(&scan);
+    qsort(out->items + start, out->count - start, sizeof(char *), compare_strings);
+}
+
+// Shell variables whose names start after the '$' of prefix
+void complete_variables(const char *prefix, size_t len, WordList *out) {
+    int start = out->count;
+    for (size_t i = 0; i < var_table_size; i++) {
+        const char *name = var_table[i].name;
+        if (name != NULL && strncmp(name, prefix + 1, len - 1) == 0) {
+            char *match = arena_alloc(&line_arena, strlen(name) + 2);
+            match[0] = '$';
+            strcpy(match + 1, name);
+            wordlist_append(out, match);
+        }
+    }
+    qsort(out->items + start, out->count - start, sizeof(char *), compare_strings);
+}
+
+// Ids of the current jobs as %N, for kill and wait
+void complete_jobs(const char *prefix, size_t len, WordList *out) {
+    for (int i = 0; i < max_job_id; i++) {
+        if (job_slots[i] == NULL) {
+            continue;
+        }
+        char id[16];
+        snprintf(id, sizeof(id), "%%%d", job_slots[i]->job_id);
+        if (strncmp(id, prefix, len) == 0) {
+            wordlist_append(out, arena_strdup(&line_arena, id));
+        }
+    }
+}
+
+// Allocate size bytes that stay valid until the next arena_reset
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;  // Keep every allocation 16-byte aligned
+
+    // Move on to the next retained chunk with room, or add a new one
+    ArenaChunk *chunk = arena->current;
+    while (chunk != NULL && chunk->used + size > chunk->size) {
+        chunk = chunk->next;
+    }
+    if (chunk == NULL) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (chunk == NULL) {
+            perror("quash: malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = NULL;
+        if (arena->current != NULL) {
+            // Link after the current chunk so the retained ones behind it are kept
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        } else {
+            arena->first = chunk;
+        }
+        arena->reserved += sizeof(ArenaChunk) + chunk_size;
+    }
+    arena->current = chunk;
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->line_bytes += size;
+    return ptr;
+}
+
+// Copy a string into the arena
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t len = strlen(str);
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+// Release everything allocated since the last reset, keeping the chunks
+void arena_reset(Arena *arena) {
+    for (ArenaChunk *chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->first;
+    if (arena->line_bytes > arena->peak_line_bytes) {
+        arena->peak_line_bytes = arena->line_bytes;
+    }
+    arena->line_bytes = 0;
+    arena->resets++;
+}
+
+// Print the arena counters when $QUASH_MEMSTAT is set
+void arena_report(Arena *arena) {
+    if (var_get("QUASH_MEMSTAT") == NULL) {
+        return;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "quash: memstat: lines=%lu arena_reserved=%zu peak_line=%zu maxrss=%ldKB\n",
+            arena->resets, arena->reserved, arena->peak_line_bytes, RU_MAXRSS_KB(usage));
+}
+
+
+
+// Values of the shell's special parameters ($? and $PIPESTATUS), or NULL
+char *get_special_var(const char *name) {
+    static char value[4096];
+
+    if (strcmp(name, "?") == 0) {
+        snprintf(value, sizeof(value), "%d", last_status);
+        return value;
+    }
+    if (strcmp(name, "PIPESTATUS") == 0) {
+        size_t len = 0;
+        value[0] = '\0';
+        for (int i = 0; i < num_pipe_status && len + 12 < sizeof(value); i++) {
+            len += snprintf(value + len, sizeof(value) - len, i ? " %d" : "%d", pipe_status[i]);
+        }
+        return value;
+    }
+    return NULL;
+}
+
+// Find the slot for name[0..len), or the first free slot if it is not set
+ShellVar *var_slot(ShellVar *table, size_t size, const char *name, size_t len) {
+    size_t mask = size - 1;
+    size_t i = hash_string(name, len) & mask;
+    ShellVar *free_slot = NULL;
+    while (table[i].name != NULL || table[i].deleted) {
+        if (table[i].name == NULL) {
+            if (free_slot == NULL) free_slot = &table[i];
+        } else if (strncmp(table[i].name, name, len) == 0 && table[i].name[len] == '\0') {
+            return &table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return free_slot ? free_slot : &table[i];
+}
+
+// Look up a variable by a name that need not be NUL-terminated
+ShellVar *var_lookup(const char *name, size_t len) {
+    if (var_table_size == 0) {
+        return NULL;
+    }
+    ShellVar *var = var_slot(var_table, var_table_size, name, len);
+    return var->name != NULL ? var : NULL;
+}
+
+// Value of a shell or environment variable, or NULL if it is not set
+char *var_get(const char *name) {
+    ShellVar *var = var_lookup(name, strlen(name));
+    return var ? var->value : NULL;
+}
+
+// Value of a special parameter or variable, for expansion
+char *var_value(const char *name, size_t len) {
+    if ((len == 1 && name[0] == '?') || (len == 10 && strncmp(name, "PIPESTATUS", 10) == 0)) {
+        char special[11];
+        memcpy(special, name, len);
+        special[len] = '\0';
+        return get_special_var(special);
+    }
+    ShellVar *var = var_lookup(name, len);
+    return var ? var->value : NULL;
+}
+
+// Rehash into a table twice the size, dropping tombstones
+void var_table_grow() {
+    size_t new_size = var_table_size ? var_table_size * 2 : VAR_TABLE_INITIAL_SIZE;
+    ShellVar *new_table = calloc(new_size, sizeof(ShellVar));
+    if (new_table == NULL) {
+        perror("quash: calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < var_table_size; i++) {
+        if (var_table[i].name != NULL) {
+            *var_slot(new_table, new_size, var_table[i].name, strlen(var_table[i].name)) = var_table[i];
+        }
+    }
+    free(var_table);
+    var_table = new_table;
+    var_table_size = new_size;
+    var_table_used = var_table_count;
+}
+
+// Build the "NAME=value" string children see for an exported variable
+char *var_env_entry(ShellVar *var) {
+    size_t name_len = strlen(var->name);
+    size_t value_len = strlen(var->value);
+    char *entry = malloc(name_len + value_len + 2);
+    if (entry == NULL) {
+        perror("quash: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, var->name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, var->value, value_len + 1);
+    return entry;
+}
+
+// Add, replace or remove the snapshot entry of one variable. Only that
+// entry changes; the rest of the envp array is left as it is.
+void env_snapshot_update(ShellVar *var) {
+    if (var->exported && var->env_index < 0) {
+        if (env_count + 2 > env_cap) {
+            int cap = env_cap ? env_cap * 2 : 64;
+            char **snapshot = realloc(env_snapshot, cap * sizeof(char *));
+            if (snapshot == NULL) {
+                perror("quash: realloc failed");
+                exit(EXIT_FAILURE);
+            }
+            env_snapshot = snapshot;
+            env_cap = cap;
+        }
+        var->env_index = env_count++;
+        env_snapshot[var->env_index] = var_env_entry(var);
+        env_snapshot[env_count] = NULL;
+    } else if (var->exported) {
+        free(env_snapshot[var->env_index]);
+        env_snapshot[var->env_index] = var_env_entry(var);
+    } else if (var->env_index >= 0) {
+        // Move the last entry into the hole
+        free(env_snapshot[var->env_index]);
+        char *last = env_snapshot[--env_count];
+        if (var->env_index != env_count) {
+            env_snapshot[var->env_index] = last;
+            ShellVar *moved = var_lookup(last, strcspn(last, "="));
+            if (moved != NULL) moved->env_index = var->env_index;
+        }
+        env_snapshot[env_count] = NULL;
+        var->env_index = -1;
+    }
+
+    env_version++;
+    environ = env_snapshot;  // Library code calling getenv sees the same view
+}
+
+// React to changes of the variables the shell itself depends on
+void var_changed(const char *name) {
+    if (strcmp(name, "PATH") == 0) {
+        // A new $PATH invalidates every resolved command
+        path_cache_clear();
+    } else if (strcmp(name, "QUASH_SPAWN") == 0) {
+        spawn_backend_update();
+    } else if (strcmp(name, "QUASH_ZYGOTE_POOL") == 0) {
+        // The pool is started again at its new size on the next spawn
+        zygote_stop();
+    } else if (strcmp(name, "QUASH_TRACE") == 0) {
+        trace_update();
+    } else if (strcmp(name, "QUASH_PIPESIZE") == 0) {
+        pipe_size_update();
+    }
+}
+
+// Set a variable. export > 0 marks it exported; otherwise an existing
+// variable keeps its export flag and a new one is local to the shell.
+void var_set(const char *name, const char *value, int export) {
+    if ((var_table_used + 1) * 10 >= var_table_size * 7) {
+        var_table_grow();
+    }
+
+    ShellVar *var = var_slot(var_table, var_table_size, name, strlen(name));
+    if (var->name == NULL) {
+        if (!var->deleted) var_table_used++;
+        var->name = strdup(name);
+        var->value = NULL;
+        var->exported = 0;
+        var->deleted = 0;
+        var->env_index = -1;
+        var_table_count++;
+    }
+
+    char *copy = strdup(value);
+    if (var->name == NULL || copy == NULL) {
+        perror("quash: strdup failed");
+        exit(EXIT_FAILURE);
+    }
+    free(var->value);
+    var->value = copy;
+    if (export > 0) {
+        var->exported = 1;
+    }
+
+    if (var->exported) {
+        env_snapshot_update(var);
+    }
+    var_changed(name);
+}
+
+// Mark an existing variable for export. Returns -1 if it is not set.
+int var_export(const char *name) {
+    ShellVar *var = var_lookup(name, strlen(name));
+    if (var == NULL) {
+        return -1;
+    }
+    if (!var->exported) {
+        var->exported = 1;
+        env_snapshot_update(var);
+    }
+    return 0;
+}
+
+// Remove a variable from the shell and from the environment of children
+void var_unset(const char *name) {
+    ShellVar *var = var_lookup(name, strlen(name));
+    if (var == NULL) {
+        return;
+    }
+    if (var->exported) {
+        var->exported = 0;
+        env_snapshot_update(var);
+    }
+    free(var->name);
+    free(var->value);
+    var->name = NULL;
+    var->value = NULL;
+    var->deleted = 1;
+    var_table_count--;
+    var_changed(name);
+}
+
+// Import the environment the shell was started with as exported variables
+void var_init() {
+    char **initial = environ;
+    for (int i = 0; initial != NULL && initial[i] != NULL; i++) {
+        char *eq = strchr(initial[i], '=');
+        if (eq == NULL || eq == initial[i]) {
+            continue;
+        }
+        char *name = strndup(initial[i], eq - initial[i]);
+        var_set(name, eq + 1, 1);
+        free(name);
+    }
+    if (env_snapshot == NULL) {
+        // Children of a shell started with an empty environment get an empty one
+        env_snapshot = calloc(1, sizeof(char *));
+        environ = env_snapshot;
+    }
+}
+
+// The envp array for new children, rebuilt only entry by entry
+char **var_envp() {
+    return env_snapshot;
+}
+
+// Make room for len more bytes (and a terminator) in a growable string; the
+// buffer doubles in the arena, so building a string of n bytes costs O(n)
+// overall
+void strbuf_reserve(StrBuf *buf, size_t len) {
+    if (buf->len + len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : 64;
+        while (cap < buf->len + len + 1) {
+            cap *= 2;
+        }
+        char *data = arena_alloc(&line_arena, cap);
+        if (buf->len > 0) {
+            memcpy(data, buf->data, buf->len);
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+}
+
+// Append len bytes to a growable string
+void strbuf_append(StrBuf *buf, const char *str, size_t len) {
+    strbuf_reserve(buf, len);
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// Append a string to a growable list of words
+void wordlist_append(WordList *list, char *word) {
+    if (list->count + 2 > list->cap) {
+        int cap = list->cap ? list->cap * 2 : 8;
+        char **items = arena_alloc(&line_arena, cap * sizeof(char *));
+        if (list->count > 0) {
+            memcpy(items, list->items, list->count * sizeof(char *));
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count++] = word;
+    list->items[list->count] = NULL;  // Keep the list usable as an argv
+}
+
+// Finish the word being built and add it to the parser's output list
+void lex_end_field(Parser *ps) {
+    // Unquoted wildcards expand to the matching paths, or stay as written
+    // if nothing matches. Assignments are not expanded.
+    if (ps->word_started && (!ps->word_glob || ps->no_split || glob_expand(ps->pattern.data, ps->fields) == 0)) {
+        wordlist_append(ps->fields, ps->word.len ? ps->word.data : arena_strdup(&line_arena, ""));
+    }
+    ps->word.data = NULL;
+    ps->word.len = 0;
+    ps->word.cap = 0;
+    ps->word_started = 0;
+    ps->pattern.data = NULL;
+    ps->pattern.len = 0;
+    ps->pattern.cap = 0;
+    ps->pattern_started = 0;
+    ps->word_glob = 0;
+}
+
+// Append text to the current word. Once the word has a glob character, a
+// pattern is kept alongside it in which quoted text is escaped, so only
+// unquoted *, ? and [ act as wildcards. Up to then the word has nothing to
+// escape and the pattern starts as a plain copy of it.
+void lex_append(Parser *ps, const char *str, size_t len, int quoted) {
+    if (!ps->pattern_started) {
+        size_t i = 0;
+        while (i < len && str[i] != '*' && str[i] != '?' && str[i] != '[' && str[i] != '\\') {
+            i++;
+        }
+        strbuf_append(&ps->word, str, len);
+        if (i == len) {
+            return;
+        }
+        ps->pattern_started = 1;
+        strbuf_append(&ps->pattern, ps->word.data, ps->word.len - len);
+    } else {
+        strbuf_append(&ps->word, str, len);
+    }
+
+    if (!quoted) {
+        strbuf_append(&ps->pattern, str, len);
+        for (size_t i = 0; i < len && !ps->word_glob; i++) {
+            ps->word_glob = str[i] == '*' || str[i] == '?' || str[i] == '[';
+        }
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] == '*' || str[i] == '?' || str[i] == '[' || str[i] == '\\') {
+            strbuf_append(&ps->pattern, "\\", 1);
+        }
+        strbuf_append(&ps->pattern, &str[i], 1);
+    }
+}
+
+// Append the value of a parameter to the current word. Unquoted values are
+// split into separate words at blanks, like the line used to be re-split
+// after expansion.
+void lex_append_value(Parser *ps, const char *value, int quoted) {
+    if (quoted) {
+        lex_append(ps, value, strlen(value), 1);
+        ps->word_started = 1;
+        return;
+    }
+
+    const char *start = value;
+    for (const char *p = value; ; p++) {
+        if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\0') {
+            if (p > start) {
+                lex_append(ps, start, p - start, 0);
+                ps->word_started = 1;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            lex_end_field(ps);
+            start = p + 1;
+        }
+    }
+}
+
+// Expand the $NAME, ${NAME} or $? that starts at ps->pos
+void lex_dollar(Parser *ps, int quoted) {
+    const char *start = ps->pos;  // Points at the '$'
+    const char *name = start + 1;
+    size_t name_len = 0;
+    const char *end;
+
+    if (*name == '{') {
+        name++;
+        while (name[name_len] != '}' && name[name_len] != '\0') {
+            name_len++;
+        }
+        if (name[name_len] != '}') {
+            // No closing brace: keep the text as written
+            lex_append_value(ps, "$", quoted);
+            ps->pos = start + 1;
+            return;
+        }
+        end = name + name_len + 1;
+    } else if (*name == '?') {
+        name_len = 1;
+        end = name + 1;
+    } else {
+        while (isalnum((unsigned char)name[name_len]) || name[name_len] == '_') {
+            name_len++;
+        }
+        end = name + name_len;
+    }
+
+    if (name_len == 0) {
+        // A lone '$' is literal
+        lex_append(ps, "$", 1, 1);
+        ps->word_started = 1;
+        ps->pos = start + 1;
+        return;
+    }
+
+    // Get the value straight from the variable table, without copying the name
+    long long expand_start = trace_fd >= 0 ? monotonic_ns() : 0;
+    char *value = var_value(name, name_len);
+    if (value != NULL) {
+        lex_append_value(ps, value, quoted || ps->no_split);
+    } else {
+        // Keep the reference as written if the variable doesn't exist
+        lex_append(ps, start, end - start, 1);
+        ps->word_started = 1;
+    }
+    ps->pos = end;
+    if (expand_start != 0) {
+        trace_expand_ns += monotonic_ns() - expand_start;
+    }
+}
+
+// Find the ')' that closes the $( just before p, skipping over quoted text
+// and nested parentheses. Returns NULL if there is none.
+const char *substitution_end(const char *p) {
+    int depth = 1;
+    for (; *p != '\0'; p++) {
+        if (*p == '\\') {
+            if (p[1] == '\0') {
+                return NULL;
+            }
+            p++;
+        } else if (*p == '\'' || *p == '`') {
+            const char *close = strchr(p + 1, *p);
+            if (close == NULL) {
+                return NULL;
+            }
+            p = close;
+        } else if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0') {
+                    return NULL;
+                }
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                }
+            }
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Expand the $(...) or `...` that starts at ps->pos into its output, less
+// any trailing newlines. Returns -1 if it is not terminated.
+int lex_substitution(Parser *ps, int quoted) {
+    const char *start = ps->pos;
+    const char *end;
+    char *text;
+    if (*start == '$') {
+        end = substitution_end(start + 2);
+        if (end == NULL) {
+            fprintf(stderr, "quash: syntax error: unterminated command substitution\n");
+            return -1;
+        }
+        text = arena_alloc(&line_arena, end - start - 1);
+        memcpy(text, start + 2, end - start - 2);
+        text[end - start - 2] = '\0';
+    } else {
+        // Inside backquotes a backslash only escapes $, ` and itself (and
+        // " within double quotes)
+        StrBuf body = {NULL, 0, 0};
+        strbuf_reserve(&body, 0);
+        for (end = start + 1; *end != '`'; end++) {
+            if (*end == '\0') {
+                fprintf(stderr, "quash: syntax error: unterminated command substitution\n");
+                return -1;
+            }
+            if (*end == '\\' && (end[1] == '$' || end[1] == '`' || end[1] == '\\' || (quoted && end[1] == '"'))) {
+                end++;
+            }
+            strbuf_append(&body, end, 1);
+        }
+        text = body.data;
+    }
+    ps->pos = end + 1;
+
+    long long expand_start = trace_fd >= 0 ? monotonic_ns() : 0;
+    StrBuf output = {NULL, 0, 0};
+    strbuf_reserve(&output, 0);
+    command_substitute(text, &output);
+
+    // NUL bytes can't be part of a word
+    char *data = output.data;
+    size_t len = 0;
+    for (size_t i = 0; i < output.len; i++) {
+        if (data[i] != '\0') {
+            data[len++] = data[i];
+        }
+    }
+    while (len > 0 && data[len - 1] == '\n') {
+        len--;
+    }
+    data[len] = '\0';
+    lex_append_value(ps, data, quoted || ps->no_split);
+    if (expand_start != 0) {
+        trace_expand_ns += monotonic_ns() - expand_start;
+    }
+    return 0;
+}
+
+// Read one shell word starting at ps->pos, removing quotes and expanding
+// variables and command substitutions, and append the resulting field(s)
+// to fields. Returns -1 on an unterminated quote or substitution.
+int lex_word(Parser *ps, WordList *fields) {
+    ps->fields = fields;
+    ps->word.data = NULL;
+    ps->word.len = 0;
+    ps->word.cap = 0;
+    ps->word_started = 0;
+    ps->pattern.data = NULL;
+    ps->pattern.len = 0;
+    ps->pattern.cap = 0;
+    ps->pattern_started = 0;
+    ps->word_glob = 0;
+
+    while (*ps->pos != '\0' && !IS_BLANK(*ps->pos) && !IS_OPERATOR(*ps->pos)) {
+        char c = *ps->pos;
+
+        if (c == '\'') {
+            // Single quotes: everything up to the next quote is literal
+            const char *close = strchr(ps->pos + 1, '\'');
+            if (close == NULL) {
+                fprintf(stderr, "quash: syntax error: unterminated quoted string\n");
+                return -1;
+            }
+            lex_append(ps, ps->pos + 1, close - ps->pos - 1, 1);
+            ps->word_started = 1;
+            ps->pos = close + 1;
+        } else if (c == '"') {
+            // Double quotes: variables expand, but the result is one word
+            ps->pos++;
+            ps->word_started = 1;
+            while (*ps->pos != '"') {
+                if (*ps->pos == '\0') {
+                    fprintf(stderr, "quash: syntax error: unterminated quoted string\n");
+                    return -1;
+                }
+                const char *run = ps->pos;
+                while (*ps->pos != '"' && *ps->pos != '$' && *ps->pos != '\\' && *ps->pos != '`' &&
+                       *ps->pos != '\0') {
+                    ps->pos++;
+                }
+                lex_append(ps, run, ps->pos - run, 1);
+
+                if ((*ps->pos == '$' && ps->pos[1] == '(') || *ps->pos == '`') {
+                    if (lex_substitution(ps, 1) == -1) {
+                        return -1;
+                    }
+                } else if (*ps->pos == '$') {
+                    lex_dollar(ps, 1);
+                } else if (*ps->pos == '\\') {
+                    char next = ps->pos[1];
+                    if (next == '"' || next == '\\' || next == '$' || next == '`') {
+                        lex_append(ps, ps->pos + 1, 1, 1);
+                        ps->pos += 2;
+                    } else {
+                        lex_append(ps, ps->pos, 1, 1);
+                        ps->pos++;
+                    }
+                }
+            }
+            ps->pos++;  // Skip the closing quote
+        } else if (c == '\\') {
+            // A backslash makes the next character literal
+            if (ps->pos[1] != '\0') {
+                ps->pos++;
+            }
+            lex_append(ps, ps->pos, 1, 1);
+            ps->word_started = 1;
+            ps->pos++;
+        } else if ((c == '$' && ps->pos[1] == '(') || c == '`') {
+            if (lex_substitution(ps, 0) == -1) {
+                return -1;
+            }
+        } else if (c == '$') {
+            lex_dollar(ps, 0);
+        } else {
+            // Copy a run of ordinary characters at once
+            const char *run = ps->pos;
+            while (*ps->pos != '\0' && !IS_BLANK(*ps->pos) && !IS_OPERATOR(*ps->pos) &&
+                   *ps->pos != '\'' && *ps->pos != '"' && *ps->pos != '\\' && *ps->pos != '$' &&
+                   *ps->pos != '`') {
+                ps->pos++;
+            }
+            lex_append(ps, run, ps->pos - run, 0);
+            ps->word_started = 1;
+        }
+    }
+
+    lex_end_field(ps);
+    return 0;
+}
+
+// Read the delimiter word of a << here-document. Quotes are removed but
+// nothing is expanded; if any part of it is quoted, the body is taken
+// literally.
+int heredoc_delimiter(Parser *ps, Redirect *redirect) {
+    StrBuf word = {NULL, 0, 0};
+    strbuf_reserve(&word, 0);
+    int quoted = 0;
+    while (*ps->pos != '\0' && !IS_BLANK(*ps->pos) && !IS_OPERATOR(*ps->pos)) {
+        char c = *ps->pos;
+        if (c == '\'' || c == '"') {
+            const char *close = strchr(ps->pos + 1, c);
+            if (close == NULL) {
+                fprintf(stderr, "quash: syntax error: unterminated quoted string\n");
+                return -1;
+            }
+            strbuf_append(&word, ps->pos + 1, close - ps->pos - 1);
+            ps->pos = close + 1;
+            quoted = 1;
+        } else if (c == '\\' && ps->pos[1] != '\0') {
+            strbuf_append(&word, ps->pos + 1, 1);
+            ps->pos += 2;
+            quoted = 1;
+        } else {
+            strbuf_append(&word, ps->pos, 1);
+            ps->pos++;
+        }
+    }
+    redirect->target = word.data;
+    redirect->expand = !quoted;
+    return 0;
+}
+
+// Expand the variables and command substitutions in a line of a
+// here-document, where a backslash only escapes $, ` and itself
+char *heredoc_expand(const char *line) {
+    Parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.pos = line;
+    while (*ps.pos != '\0') {
+        const char *run = ps.pos;
+        while (*ps.pos != '$' && *ps.pos != '`' && *ps.pos != '\\' && *ps.pos != '\0') {
+            ps.pos++;
+        }
+        lex_append(&ps, run, ps.pos - run, 1);
+
+        if ((*ps.pos == '$' && ps.pos[1] == '(') || *ps.pos == '`') {
+            if (lex_substitution(&ps, 1) == -1) {
+                // Keep the rest of the line as written
+                lex_append(&ps, ps.pos, strlen(ps.pos), 1);
+                break;
+            }
+        } else if (*ps.pos == '$') {
+            lex_dollar(&ps, 1);
+        } else if (*ps.pos == '\\') {
+            char next = ps.pos[1];
+            int escape = next == '$' || next == '`' || next == '\\';
+            lex_append(&ps, ps.pos + escape, 1, 1);
+            ps.pos += 1 + escape;
+        }
+    }
+    return ps.word.data != NULL ? ps.word.data : "";
+}
+
+// Whether the raw word at pos has the form NAME=...
+int is_assignment_word(const char *pos) {
+    if (!isalpha((unsigned char)*pos) && *pos != '_') {
+        return 0;
+    }
+    while (isalnum((unsigned char)*pos) || *pos == '_') {
+        pos++;
+    }
+    return *pos == '=';
+}
+
+// Report a syntax error at the token starting at pos
+void syntax_error(const char *pos) {
+    if (*pos == '\0') {
+        fprintf(stderr, "quash: syntax error near unexpected token `newline'\n");
+    } else if ((pos[0] == '>' && pos[1] == '>') || (pos[0] == '&' && pos[1] == '&') || (pos[0] == '|' && pos[1] == '|')) {
+        fprintf(stderr, "quash: syntax error near unexpected token `%.2s'\n", pos);
+    } else {
+        fprintf(stderr, "quash: syntax error near unexpected token `%c'\n", *pos);
+    }
+}
+
+// Store the command being built as the next stage of the pipeline
+void parser_finish_command(Parser *ps, Pipeline *pipeline, WordList *argv, Redirect *redirects, int num_assignments) {
+    if (pipeline->num_commands == ps->commands_cap) {
+        int cap = ps->commands_cap ? ps->commands_cap * 2 : 4;
+        Command *commands = arena_alloc(&line_arena, cap * sizeof(Command));
+        if (pipeline->num_commands > 0) {
+            memcpy(commands, pipeline->commands, pipeline->num_commands * sizeof(Command));
+        }
+        pipeline->commands = commands;
+        ps->commands_cap = cap;
+    }
+
+    Command *cmd = &pipeline->commands[pipeline->num_commands++];
+    if (argv->items == NULL) {
+        wordlist_append(argv, NULL);
+        argv->count = 0;
+    }
+    cmd->argv = argv->items;
+    cmd->argc = argv->count;
+    cmd->num_assignments = num_assignments;
+    cmd->redirects = redirects;
+}
+
+// Parse an input line in a single pass into a pipeline of commands with
+// their redirections. Words are unquoted and expanded as they are read.
+// Returns NULL (after reporting it) on a syntax error; everything returned
+// lives in the line arena.
+Pipeline *parse_line(const char *line) {
+    Parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.pos = line;
+
+    Pipeline *pipeline = arena_alloc(&line_arena, sizeof(Pipeline));
+    memset(pipeline, 0, sizeof(Pipeline));
+
+    WordList argv = {NULL, 0, 0};
+    Redirect *redirects = NULL;
+    Redirect **redirect_tail = &redirects;
+    int command_started = 0;  // The current command has a word or redirection
+    int num_assignments = 0;  // Leading NAME=value words of the current command
+    const char *text_end = NULL;
+
+    while (1) {
+        while (IS_BLANK(*ps.pos)) {
+            ps.pos++;
+        }
+        char c = *ps.pos;
+
+        if (c == '\0') {
+            if (command_started) {
+                parser_finish_command(&ps, pipeline, &argv, redirects, num_assignments);
+            } else if (pipeline->num_commands > 0) {
+                syntax_error(ps.pos);  // Line ends right after a '|'
+                return NULL;
+            }
+            break;
+        }
+
+        if (c == '|') {
+            if (!command_started) {
+                syntax_error(ps.pos);
+                return NULL;
+            }
+            parser_finish_command(&ps, pipeline, &argv, redirects, num_assignments);
+            argv = (WordList){NULL, 0, 0};
+            redirects = NULL;
+            redirect_tail = &redirects;
+            command_started = 0;
+            num_assignments = 0;
+            ps.pos++;
+            continue;
+        }
+
+        if (c == '&') {
+            // Only a trailing '&' is supported: run the pipeline in the background
+            const char *amp = ps.pos++;
+            while (IS_BLANK(*ps.pos)) {
+                ps.pos++;
+            }
+            if (!command_started || *ps.pos != '\0') {
+                syntax_error(command_started ? ps.pos : amp);
+                return NULL;
+            }
+            pipeline->background = 1;
+            text_end = amp;
+            parser_finish_command(&ps, pipeline, &argv, redirects, num_assignments);
+            break;
+        }
+
+        // Digits written right before < or > name the descriptor to redirect
+        int io_number = -1;
+        if (isdigit((unsigned char)c)) {
+            const char *digits_end = ps.pos;
+            while (isdigit((unsigned char)*digits_end)) {
+                digits_end++;
+            }
+            if (*digits_end == '<' || *digits_end == '>') {
+                io_number = atoi(ps.pos);
+                ps.pos = digits_end;
+                c = *ps.pos;
+            }
+        }
+
+        if (c == '<' || c == '>') {
+            Redirect *redirect = arena_alloc(&line_arena, sizeof(Redirect));
+            redirect->next = NULL;
+            redirect->fd = c == '<' ? STDIN_FILENO : STDOUT_FILENO;
+            redirect->body_fd = -1;
+            redirect->strip_tabs = 0;
+            redirect->expand = 0;
+            int here_string = 0;
+            if (c == '<' && ps.pos[1] == '<' && ps.pos[2] == '<') {
+                redirect->type = REDIR_HEREDOC;
+                here_string = 1;
+                ps.pos += 3;
+            } else if (c == '<' && ps.pos[1] == '<') {
+                redirect->type = REDIR_HEREDOC;
+                ps.pos += 2;
+                if (*ps.pos == '-') {
+                    redirect->strip_tabs = 1;
+                    ps.pos++;
+                }
+            } else if (c == '<' && ps.pos[1] == '>') {
+                redirect->type = REDIR_READ_WRITE;
+                ps.pos += 2;
+            } else if (c == '<' && ps.pos[1] == '&') {
+                redirect->type = REDIR_DUP;
+                ps.pos += 2;
+            } else if (c == '<') {
+                redirect->type = REDIR_INPUT;
+                ps.pos++;
+            } else if (ps.pos[1] == '>') {
+                redirect->type = REDIR_APPEND;
+                ps.pos += 2;
+            } else if (ps.pos[1] == '&') {
+                redirect->type = REDIR_DUP;
+                ps.pos += 2;
+            } else {
+                redirect->type = REDIR_OUTPUT;
+                ps.pos++;
+            }
+            if (io_number >= 0) {
+                redirect->fd = io_number;
+            }
+
+            while (IS_BLANK(*ps.pos)) {
+                ps.pos++;
+            }
+            if (*ps.pos == '\0' || IS_OPERATOR(*ps.pos)) {
+                syntax_error(ps.pos);
+                return NULL;
+            }
+
+            if (redirect->type == REDIR_HEREDOC) {
+                // Closed with the rest of the line's here-documents
+                redirect->next_heredoc = line_heredocs;
+                line_heredocs = redirect;
+            }
+            if (redirect->type == REDIR_HEREDOC && !here_string) {
+                // The body is read from the lines that follow, once this
+                // one has been parsed
+                if (heredoc_delimiter(&ps, redirect) == -1) {
+                    return NULL;
+                }
+                *redirect_tail = redirect;
+                redirect_tail = &redirect->next;
+                command_started = 1;
+                continue;
+            }
+
+            // A here-string is expanded but, like an assignment, not split
+            const char *target_start = ps.pos;
+            WordList target = {NULL, 0, 0};
+            ps.no_split = here_string;
+            int lexed = lex_word(&ps, &target);
+            ps.no_split = 0;
+            if (lexed == -1) {
+                return NULL;
+            }
+            if (here_string && target.count == 0) {
+                wordlist_append(&target, "");
+            }
+            if (target.count != 1) {
+                fprintf(stderr, "quash: %.*s: ambiguous redirect\n", (int)(ps.pos - target_start), target_start);
+                return NULL;
+            }
+            redirect->target = target.items[0];
+            if (redirect->type == REDIR_DUP && strcmp(redirect->target, "-") != 0 &&
+                (redirect->target[0] == '\0' || strspn(redirect->target, "0123456789") != strlen(redirect->target))) {
+                fprintf(stderr, "quash: %s: ambiguous redirect\n", redirect->target);
+                return NULL;
+            }
+            if (here_string) {
+                redirect->body_fd = heredoc_string(redirect->target);
+                if (redirect->body_fd == -1) {
+                    return NULL;
+                }
+            }
+
+            *redirect_tail = redirect;
+            redirect_tail = &redirect->next;
+            command_started = 1;
+            continue;
+        }
+
+        // NAME=value words before the command name are assignments; like
+        // them, the NAME=value arguments of export are not split
+        int assignment = is_assignment_word(ps.pos);
+        int leading = assignment && argv.count == num_assignments;
+        ps.no_split = leading || (assignment && argv.count > num_assignments &&
+                                  strcmp(argv.items[num_assignments], "export") == 0);
+        if (lex_word(&ps, &argv) == -1) {
+            return NULL;
+        }
+        ps.no_split = 0;
+        num_assignments += leading;
+        command_started = 1;
+    }
+
+    // Keep the source text for job listings, without the trailing '&'
+    if (text_end == NULL) {
+        text_end = line + strlen(line);
+    }
+    while (text_end > line && IS_BLANK(text_end[-1])) {
+        text_end--;
+    }
+    char *text = arena_alloc(&line_arena, text_end - line + 1);
+    memcpy(text, line, text_end - line);
+    text[text_end - line] = '\0';
+    pipeline->text = text;
+
+    return pipeline;
+}
+
+
+// Compile one slash-free segment of a pattern. Returns 1 if it has wildcards.
+int glob_compile_component(GlobComponent *comp, const char *pattern, size_t len) {
+    memset(comp, 0, sizeof(*comp));
+    comp->tail_star = -1;
+    if (len == 2 && pattern[0] == '*' && pattern[1] == '*') {
+        comp->recursive = 1;
+        return 1;
+    }
+
+    GlobOp *ops = arena_alloc(&line_arena, (len + 1) * sizeof(GlobOp));
+    char *literal = arena_alloc(&line_arena, len + 1);
+    int n = 0;
+    int wild = 0;
+    const char *p = pattern;
+    const char *end = pattern + len;
+
+    while (p < end) {
+        GlobOp *op = &ops[n];
+        op->class = NULL;
+        if (*p == '*') {
+            wild = 1;
+            p++;
+            if (n > 0 && ops[n - 1].type == GLOB_OP_STAR) {
+                continue;
+            }
+            op->type = GLOB_OP_STAR;
+            n++;
+            continue;
+        }
+        if (*p == '?') {
+            wild = 1;
+            op->type = GLOB_OP_ANY;
+            n++;
+            p++;
+            continue;
+        }
+        if (*p == '[') {
+            // Find the closing bracket; a ']' right after the opening one
+            // (or its negation) is a member. Without one, '[' is literal.
+            const char *q = p + 1;
+            int negate = q < end && (*q == '!' || *q == '^');
+            q += negate;
+            const char *first = q;
+            while (q < end && (*q != ']' || q == first)) {
+                q += (*q == '\\' && q + 1 < end) ? 2 : 1;
+            }
+            if (q < end) {
+                uint8_t *set = arena_alloc(&line_arena, 32);
+                memset(set, 0, 32);
+                const char *c = first;
+                while (c < q) {
+                    unsigned char lo = (*c == '\\' && c + 1 < q) ? *++c : *c;
+                    unsigned char hi = lo;
+                    c++;
+                    if (c + 1 < q && *c == '-') {
+                        hi = (c[1] == '\\' && c + 2 < q) ? c[2] : c[1];
+                        c += (c[1] == '\\' && c + 2 < q) ? 3 : 2;
+                    }
+                    for (unsigned int b = lo; b <= hi; b++) {
+                        set[b >> 3] |= 1 << (b & 7);
+                    }
+                }
+                if (negate) {
+                    for (int b = 0; b < 32; b++) {
+                        set[b] = ~set[b];
+                    }
+                }
+                wild = 1;
+                op->type = GLOB_OP_CLASS;
+                op->class = set;
+                n++;
+                p = q + 1;
+                continue;
+            }
+        }
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+        }
+        op->type = GLOB_OP_LITERAL;
+        op->ch = *p++;
+        literal[n] = op->ch;
+        n++;
+    }
+
+    if (!wild) {
+        literal[n] = '\0';
+        comp->literal = literal;
+        return 0;
+    }
+
+    // Every match ends with the trailing literal bytes, which rejects most
+    // names with one memcmp; if only they follow the last '*', matching
+    // that far means the whole name matches
+    int tail = n;
+    while (tail > 0 && ops[tail - 1].type == GLOB_OP_LITERAL) {
+        tail--;
+    }
+    comp->suffix = literal + tail;
+    comp->suffix_len = n - tail;
+    if (tail > 0 && ops[tail - 1].type == GLOB_OP_STAR) {
+        comp->tail_star = tail - 1;
+    }
+    comp->ops = ops;
+    comp->num_ops = n;
+    comp->match_dot = ops[0].type == GLOB_OP_LITERAL && ops[0].ch == '.';
+    return 1;
+}
+
+// Match a name against a compiled component, backtracking only to the most
+// recent '*', which keeps it linear in practice
+int glob_match(const GlobComponent *comp, const char *name, size_t len) {
+    if (len < comp->suffix_len || memcmp(name + len - comp->suffix_len, comp->suffix, comp->suffix_len) != 0) {
+        return 0;
+    }
+
+    const GlobOp *ops = comp->ops;
+    int n = comp->num_ops;
+    int op = 0;
+    size_t i = 0;
+    int star_op = -1;
+    size_t star_i = 0;
+
+    while (i < len) {
+        if (op < n) {
+            const GlobOp *o = &ops[op];
+            if (o->type == GLOB_OP_STAR) {
+                if (op == comp->tail_star) {
+                    return len - i >= comp->suffix_len;
+                }
+                star_op = op++;
+                star_i = i;
+                continue;
+            }
+            unsigned char c = name[i];
+            if (o->type == GLOB_OP_ANY ||
+                (o->type == GLOB_OP_LITERAL && o->ch == c) ||
+                (o->type == GLOB_OP_CLASS && (o->class[c >> 3] & (1 << (c & 7))))) {
+                op++;
+                i++;
+                continue;
+            }
+        }
+        if (star_op < 0) {
+            return 0;
+        }
+        op = star_op + 1;
+        i = ++star_i;
+    }
+    while (op < n && ops[op].type == GLOB_OP_STAR) {
+        op++;
+    }
+    return op == n;
+}
+
+// Open a directory for listing, relative to dir_fd
+int dirscan_open(DirScan *scan, int dir_fd, const char *name) {
+    scan->fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan->fd == -1) {
+        return -1;
+    }
+#ifdef __linux__
+    scan->buf = malloc(GLOB_DIRENT_BUFFER_SIZE);
+    if (scan->buf == NULL) {
+        close(scan->fd);
+        return -1;
+    }
+    scan->len = 0;
+    scan->pos = 0;
+#else
+    int fd = dup(scan->fd);
+    scan->dir = fd == -1 ? NULL : fdopendir(fd);
+    if (scan->dir == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        close(scan->fd);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Next entry of a directory, skipping "." and "..". The type is DT_UNKNOWN
+// where the filesystem doesn't report one. Returns 0 at the end.
+int dirscan_next(DirScan *scan, const char **name, unsigned char *type) {
+    for (;;) {
+#ifdef __linux__
+        if (scan->pos >= scan->len) {
+            scan->len = syscall(SYS_getdents64, scan->fd, scan->buf, GLOB_DIRENT_BUFFER_SIZE);
+            scan->pos = 0;
+            if (scan->len <= 0) {
+                return 0;
+            }
+        }
+        struct dirent64 *entry = (struct dirent64 *)(scan->buf + scan->pos);
+        scan->pos += entry->d_reclen;
+#else
+        struct dirent *entry = readdir(scan->dir);
+        if (entry == NULL) {
+            return 0;
+        }
+#endif
+        const char *n = entry->d_name;
+        if (n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0'))) {
+            continue;
+        }
+        *name = n;
+        *type = entry->d_type;
+        return 1;
+    }
+}
+
+void dirscan_close(DirScan *scan) {
+#ifdef __linux__
+    free(scan->buf);
+#else
+    closedir(scan->dir);
+#endif
+    close(scan->fd);
+}
+
+// Add the path built so far to the results
+void glob_emit(Glob *g, size_t path_len) {
+    char *match = arena_alloc(&line_arena, path_len + 1);
+    memcpy(match, g->path, path_len);
+    match[path_len] = '\0';
+    wordlist_append(g->out, match);
+}
+
+// Match components index.. of the pattern inside dir_fd, whose path (with a
+// trailing slash unless empty) is the first path_len bytes of g->path.
+// Names are only stat'ed when their d_type can't answer the question.
+void glob_walk(Glob *g, int dir_fd, int index, size_t path_len) {
+    const GlobComponent *comp = &g->components[index];
+    int last = index == g->num_components - 1;
+
+    if (comp->literal != NULL) {
+        size_t len = strlen(comp->literal);
+        if (path_len + len + 2 > sizeof(g->path)) {
+            return;
+        }
+        memcpy(g->path + path_len, comp->literal, len);
+        if (last) {
+            struct stat st;
+            if (fstatat(dir_fd, comp->literal, &st, 0) == 0 && (!g->dirs_only || S_ISDIR(st.st_mode))) {
+                if (g->dirs_only) {
+                    g->path[path_len + len++] = '/';
+                }
+                glob_emit(g, path_len + len);
+            }
+            return;
+        }
+        int fd = openat(dir_fd, comp->literal, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            g->path[path_len + len] = '/';
+            glob_walk(g, fd, index + 1, path_len + len + 1);
+            close(fd);
+        }
+        return;
+    }
+
+    // "**" matches this directory and every one below it that isn't hidden
+    // or a symbolic link. Each directory is listed once, both to find the
+    // next component's matches and the subdirectories to descend into.
+    const GlobComponent *match = comp;
+    int match_index = index;
+    if (comp->recursive) {
+        if (!last) {
+            match_index = index + 1;
+            match = &g->components[match_index];
+            if (match->literal != NULL) {
+                glob_walk(g, dir_fd, match_index, path_len);
+                match = NULL;
+            }
+        }
+    }
+
+    DirScan scan;
+    if (dirscan_open(&scan, dir_fd, ".") == -1) {
+        return;
+    }
+    int match_last = match_index == g->num_components - 1;
+    const char *name;
+    unsigned char type;
+    while (dirscan_next(&scan, &name, &type)) {
+        size_t len = strlen(name);
+        if (path_len + len + 2 > sizeof(g->path)) {
+            continue;
+        }
+        if (name[0] == '.' && (match == NULL || !match->match_dot)) {
+            continue;
+        }
+
+        int matched = match != NULL && (match->recursive || glob_match(match, name, len));
+        if (!matched && !comp->recursive) {
+            continue;
+        }
+
+        // Whether the name is a directory only matters when descending or
+        // for a trailing '/'; matching a link counts its target, but "**"
+        // doesn't follow links
+        int is_dir = type == DT_DIR;
+        int is_link = type == DT_LNK;
+        if ((comp->recursive || !match_last || g->dirs_only) && (type == DT_UNKNOWN || is_link)) {
+            struct stat st;
+            if (type == DT_UNKNOWN && fstatat(scan.fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_link = S_ISLNK(st.st_mode);
+            }
+            if (is_link && matched && (!match_last || g->dirs_only)) {
+                is_dir = fstatat(scan.fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+        }
+        memcpy(g->path + path_len, name, len);
+
+        if (matched && match_last && (!g->dirs_only || is_dir)) {
+            if (g->dirs_only) {
+                g->path[path_len + len++] = '/';
+                glob_emit(g, path_len + len--);
+            } else {
+                glob_emit(g, path_len + len);
+            }
+        }
+
+        int descend_match = matched && !match_last && is_dir;
+        int descend_recursive = comp->recursive && is_dir && !is_link && name[0] != '.';
+        if (!descend_match && !descend_recursive) {
+            continue;
+        }
+        int fd = openat(scan.fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        g->path[path_len + len] = '/';
+        if (descend_match) {
+            glob_walk(g, fd, match_index + 1, path_len + len + 1);
+        }
+        if (descend_recursive) {
+            glob_walk(g, fd, index, path_len + len + 1);
+        }
+        close(fd);
+    }
+    dirscan_close(&scan);
+}
+
+// qsort comparator for an array of strings, in byte order
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Expand a pattern in which quoted wildcard characters are escaped with
+// '\\', appending the matching paths to out in sorted order. Returns the
+// number of matches, or 0 if the pattern has no wildcards.
+int glob_expand(const char *pattern, WordList *out) {
+    Glob *g = malloc(sizeof(Glob));
+    if (g == NULL) {
+        return 0;
+    }
+    size_t len = strlen(pattern);
+    g->components = arena_alloc(&line_arena, (len / 2 + 1) * sizeof(GlobComponent));
+    g->num_components = 0;
+    g->dirs_only = len > 0 && pattern[len - 1] == '/';
+    g->out = out;
+
+    int wild = 0;
+    const char *p = pattern;
+    while (*p != '\0') {
+        const char *slash = strchr(p, '/');
+        size_t seg = slash ? (size_t)(slash - p) : strlen(p);
+        if (seg > 0) {
+            GlobComponent *comp = &g->components[g->num_components];
+            wild |= glob_compile_component(comp, p, seg);
+            // "**/**" is the same as "**"
+            if (!(comp->recursive && g->num_components > 0 && comp[-1].recursive)) {
+                g->num_components++;
+            }
+        }
+        p += seg + (slash != NULL);
+    }
+
+    int start = out->count;
+    if (wild) {
+        size_t path_len = 0;
+        int dir_fd = AT_FDCWD;
+        if (pattern[0] == '/') {
+            g->path[path_len++] = '/';
+            dir_fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (dir_fd != -1) {
+            glob_walk(g, dir_fd, 0, path_len);
+            if (dir_fd != AT_FDCWD) {
+                close(dir_fd);
+            }
+        }
+    }
+    free(g);
+
+    int count = out->count - start;
+    qsort(out->items + start, count, sizeof(char *), compare_strings);
+    return count;
+}
+
+// Function to run a parsed pipeline of any length, in the foreground or in
+// the background. Each pipe is created just before the stage that writes to
+// it and closed as soon as both of its neighbours have been spawned, so at
+// most three pipe descriptors are open in the shell at any time. Given a
+// capture buffer, the last stage writes into one more pipe, which is read
+// into the buffer until every writer is gone, before anything is waited for.
+void execute_pipeline(Pipeline *pipeline, StrBuf *capture) {
+    int num_stages = pipeline->num_commands;
+    pid_t *pids = arena_alloc(&line_arena, num_stages * sizeof(pid_t));
+    int *statuses = arena_alloc(&line_arena, num_stages * sizeof(int));
+    struct rusage *usages = arena_alloc(&line_arena, num_stages * sizeof(struct rusage));
+    memset(usages, 0, num_stages * sizeof(struct rusage));
+    BuiltinStage **threads = arena_alloc(&line_arena, num_stages * sizeof(BuiltinStage *));
+    memset(threads, 0, num_stages * sizeof(BuiltinStage *));
+
+    StageTimes *times = NULL;
+    if (trace_fd >= 0) {
+        times = arena_alloc(&line_arena, num_stages * sizeof(StageTimes));
+        memset(times, 0, num_stages * sizeof(StageTimes));
+    }
+
+    // Pipe capacity: $QUASH_PIPESIZE, or a QUASH_PIPESIZE= prefix on any stage
+    long size = pipe_size;
+    for (int i = 0; i < num_stages; i++) {
+        Command *cmd = &pipeline->commands[i];
+        for (int j = 0; j < cmd->num_assignments; j++) {
+            if (strncmp(cmd->argv[j], "QUASH_PIPESIZE=", 15) == 0) {
+                size = parse_size(cmd->argv[j] + 15);
+                if (size < 0) {
+                    fprintf(stderr, "quash: QUASH_PIPESIZE: invalid size '%s'\n", cmd->argv[j] + 15);
+                    size = 0;
+                }
+            }
+        }
+    }
+
+    int capture_fds[2] = {-1, -1};
+    if (capture != NULL && make_pipe(capture_fds) == -1) {
+        perror("pipe failed");
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Every stage gets a process of its own for the settings to apply to
+    spawn_with = pipeline->with;
+    int prev_read = -1;  // Read end of the pipe feeding the current stage
+    for (int i = 0; i < num_stages; i++) {
+        int pipefds[2] = {-1, -1};
+        if (i != num_stages - 1 && make_pipe(pipefds) == -1) {
+            perror("pipe failed");
+            num_stages = i;
+            break;
+        }
+        if (i == num_stages - 1) {
+            pipefds[1] = capture_fds[1];
+            capture_fds[1] = -1;
+        }
+        if (pipefds[1] != -1 && size > 0) {
+            set_pipe_size(pipefds[1], size);
+        }
+
+        if (times != NULL) times[i].spawn = monotonic_ns();
+        // Background stages can't run on threads, which would outlive the line
+        BuiltinStage **thread = pipeline->background || spawn_with != NULL ? NULL : &threads[i];
+        pids[i] = spawn_stage(&pipeline->commands[i], prev_read, pipefds[1], &statuses[i], thread);
+        if (times != NULL) times[i].spawned = monotonic_ns();
+
+        // Parent process: this stage's ends are no longer needed here
+        if (prev_read != -1) close(prev_read);
+        if (pipefds[1] != -1) close(pipefds[1]);
+        prev_read = pipefds[0];
+    }
+    spawn_with = NULL;
+    if (prev_read != -1) close(prev_read);
+    if (capture_fds[1] != -1) close(capture_fds[1]);
+
+    // Collect the output in large reads straight into the buffer
+    while (capture_fds[0] != -1) {
+        strbuf_reserve(capture, READ_BUFFER_SIZE);
+        ssize_t n = read(capture_fds[0], capture->data + capture->len, capture->cap - capture->len - 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(capture_fds[0]);
+            capture_fds[0] = -1;
+            break;
+        }
+        capture->len += n;
+        capture->data[capture->len] = '\0';
+    }
+
+    if (pipeline->background) {
+        for (int i = 0; i < num_stages; i++) {
+            if (pids[i] > 0) num_background_children++;
+        }
+
+        // Track the pipeline as one job under the pid of its last stage
+        pid_t pid = num_stages > 0 ? pids[num_stages - 1] : -1;
+        Job *job = pid > 0 ? add_job(pid, pipeline->text) : NULL;
+        if (job != NULL) {
+            job->pids = malloc(num_stages * sizeof(pid_t));
+            for (int i = 0; job->pids != NULL && i < num_stages; i++) {
+                if (pids[i] > 0) {
+                    job->pids[job->num_pids++] = pids[i];
+                }
+            }
+            if (pipeline->with != NULL) {
+                job->settings = strdup(pipeline->with->text);
+                printf("Background job started: [%d] %d with %s %s &\n", job->job_id, pid, job->settings, job->command);
+            } else {
+                printf("Background job started: [%d] %d %s &\n", job->job_id, pid, job->command);
+            }
+        }
+        if (times != NULL) {
+            trace_line(pipeline, "background", pids, times, statuses, num_stages);
+        }
+        return;
+    }
+
+    // Wait for exactly the children this pipeline started, then for its
+    // builtin threads, keeping the resource usage of each for the time
+    // keyword
+    for (int i = 0; i < num_stages; i++) {
+        if (pids[i] > 0) {
+            int status;
+            if (wait4(pids[i], &status, 0, &usages[i]) == pids[i]) {
+                statuses[i] = status_to_exit_code(status);
+            }
+            if (times != NULL) times[i].exit = monotonic_ns();
+        }
+    }
+    for (int i = 0; i < num_stages; i++) {
+        if (threads[i] != NULL) {
+            pthread_join(threads[i]->thread, NULL);
+            statuses[i] = threads[i]->status;
+            usages[i] = threads[i]->usage;
+            if (times != NULL) times[i].exit = monotonic_ns();
+        }
+    }
+
+    set_pipe_status(statuses, num_stages);
+    if (times != NULL) {
+        const char *executor = "command";
+        if (num_stages > 1) {
+            executor = "pipeline";
+        } else if (num_stages == 1 && pipeline->commands[0].redirects != NULL) {
+            executor = "redirect";
+        }
+        trace_line(pipeline, executor, pids, times, statuses, num_stages);
+    }
+    if (pipeline->timed) {
+        time_report(pipeline, elapsed_since(&start), usages, statuses, num_stages);
+    }
+}
+
+// Run the text of a command substitution and collect its standard output.
+// A lone utility builtin runs in the shell and writes straight into the
+// buffer; anything else is spawned as usual, the last stage writing into a
+// pipe that is read back here.
+void command_substitute(char *text, StrBuf *out) {
+    Pipeline *pipeline = parse_line(text);
+    if (pipeline == NULL) {
+        last_status = 2;
+        substitution_status = 2;
+        return;
+    }
+    Command *first = &pipeline->commands[0];
+    if (pipeline->num_commands == 0 || (pipeline->num_commands == 1 && first->argc > 0 &&
+                                        first->num_assignments == first->argc)) {
+        // Assignments in a substitution don't outlive it
+        last_status = 0;
+        substitution_status = 0;
+        return;
+    }
+
+    // The substitution is a single line, so its here-documents are empty
+    if (heredoc_read(pipeline, NULL, 0) == -1) {
+        last_status = 1;
+        substitution_status = 1;
+        return;
+    }
+    time_prefix(pipeline);
+    if (with_prefix(pipeline) == -1) {
+        last_status = 2;
+        substitution_status = 2;
+        return;
+    }
+
+    // Builtins that change the shell still get a process of their own
+    char **args = first->argv;
+    Builtin *builtin = NULL;
+    if (pipeline->num_commands == 1 && !pipeline->background && !pipeline->timed &&
+        pipeline->with == NULL && first->num_assignments == 0 && args[0] != NULL) {
+        int bypass = strcmp(args[0], "command") == 0;
+        builtin = builtin_lookup(args[bypass]);
+        if (builtin != NULL && (bypass || !(builtin->flags & BUILTIN_UTILITY))) {
+            builtin = NULL;
+        }
+    }
+    if (builtin != NULL) {
+        last_status = run_builtin(first, builtin, args, out);
+    } else {
+        execute_pipeline(pipeline, out);
+    }
+    substitution_status = last_status;
+}
+
+// Take a leading "time [-p | -j]" off the pipeline and note the format.
+// Background pipelines run untimed.
+void time_prefix(Pipeline *pipeline) {
+    Command *first = &pipeline->commands[0];
+    if (first->argc == 0 || first->argv[0] == NULL || strcmp(first->argv[0], "time") != 0) {
+        return;
+    }
+
+    int n = 1;
+    TimeFormat format = TIME_DEFAULT;
+    if (first->argv[1] != NULL && strcmp(first->argv[1], "-p") == 0) {
+        format = TIME_POSIX;
+        n++;
+    } else if (first->argv[1] != NULL && strcmp(first->argv[1], "-j") == 0) {
+        format = TIME_JSON;
+        n++;
+    }
+    first->argv += n;
+    first->argc -= n;
+
+    // NAME=value prefixes may follow: time NAME=value command
+    while (first->num_assignments < first->argc && is_assignment_word(first->argv[first->num_assignments])) {
+        first->num_assignments++;
+    }
+    if (!pipeline->background) {
+        pipeline->timed = format;
+    }
+}
+
+// Take leading "with KEY=VALUE..." settings off the pipeline; its children
+// are started with them applied. "with %N ..." is left for the builtin,
+// which changes a running job. Returns -1 after reporting a bad setting.
+int with_prefix(Pipeline *pipeline) {
+    Command *first = &pipeline->commands[0];
+    if (first->argc == 0 || first->argv[0] == NULL || strcmp(first->argv[0], "with") != 0 ||
+        (first->argv[1] != NULL && first->argv[1][0] == '%')) {
+        return 0;
+    }
+
+    WithSettings *with = arena_alloc(&line_arena, sizeof(WithSettings));
+    memset(with, 0, sizeof(WithSettings));
+    with->ioprio = -1;
+    StrBuf text = {NULL, 0, 0};
+    int n = 1;
+    while (first->argv[n] != NULL) {
+        int parsed = with_parse(with, first->argv[n]);
+        if (parsed == -1) {
+            return -1;
+        }
+
+        // NAME=value words after the settings are the command's; before
+        // any setting one can only be a misspelt key
+        if (parsed == 1 && n == 1 && strchr(first->argv[n], '=') != NULL) {
+            fprintf(stderr, "quash: with: %s: unknown setting\n", first->argv[n]);
+            return -1;
+        }
+        if (parsed == 1) {
+            break;
+        }
+        if (text.len > 0) {
+            strbuf_append(&text, " ", 1);
+        }
+        strbuf_append(&text, first->argv[n], strlen(first->argv[n]));
+        n++;
+    }
+    with->text = text.data;
+
+    // Job listings show the job's current settings in front of the rest of
+    // the text, so drop them from it when they were written plainly
+    const char *p = pipeline->text;
+    if (strncmp(p, "with", 4) == 0 && IS_BLANK(p[4])) {
+        int i = 1;
+        for (p += 4; i < n; i++) {
+            while (IS_BLANK(*p)) {
+                p++;
+            }
+            size_t len = strlen(first->argv[i]);
+            if (strncmp(p, first->argv[i], len) != 0 || !IS_BLANK(p[len])) {
+                break;
+            }
+            p += len;
+        }
+        if (i == n) {
+            while (IS_BLANK(*p)) {
+                p++;
+            }
+            pipeline->text = (char *)p;
+        }
+    }
+
+    first->argv += n;
+    first->argc -= n;
+    while (first->num_assignments < first->argc && is_assignment_word(first->argv[first->num_assignments])) {
+        first->num_assignments++;
+    }
+    if (n == 1 || first->num_assignments == first->argc) {
+        fprintf(stderr, "quash: with: usage: with KEY=VALUE... command, or with %%N KEY=VALUE...\n");
+        return -1;
+    }
+    pipeline->with = with;
+    return 0;
+}
+
+// Parse one KEY=VALUE setting of "with": cpus=LIST, nice=N,
+// ionice=CLASS[:LEVEL] or rlimit.NAME=SIZE. Returns 1 if word is not a
+// setting, or -1 after reporting an invalid value.
+int with_parse(WithSettings *with, const char *word) {
+    const char *value = strchr(word, '=');
+    if (value == NULL) {
+        return 1;
+    }
+    int key_len = value - word;
+    value++;
+
+    int valid = 0;
+    if (key_len == 4 && strncmp(word, "cpus", 4) == 0) {
+#ifdef __linux__
+        valid = with_cpus(value, &with->cpus) == 0;
+        with->has_cpus = 1;
+#else
+        fprintf(stderr, "quash: with: cpus: not supported on this system\n");
+        return -1;
+#endif
+    } else if (key_len == 4 && strncmp(word, "nice", 4) == 0) {
+        char *end;
+        long nice = strtol(value, &end, 10);
+        valid = end != value && *end == '\0' && nice >= -20 && nice <= 19;
+        with->has_nice = 1;
+        with->nice = nice;
+    } else if (key_len == 6 && strncmp(word, "ionice", 6) == 0) {
+        // Class 1 is realtime, 2 best-effort and 3 idle, which has no levels
+        size_t name_len = strcspn(value, ":");
+        int class = 0;
+        if ((name_len == 8 && strncmp(value, "realtime", 8) == 0) || (name_len == 2 && strncmp(value, "rt", 2) == 0)) {
+            class = 1;
+        } else if ((name_len == 11 && strncmp(value, "best-effort", 11) == 0) || (name_len == 2 && strncmp(value, "be", 2) == 0)) {
+            class = 2;
+        } else if (name_len == 4 && strncmp(value, "idle", 4) == 0) {
+            class = 3;
+        }
+        long level = class == 3 ? 0 : 4;
+        valid = class != 0;
+        if (value[name_len] == ':') {
+            char *end;
+            level = strtol(value + name_len + 1, &end, 10);
+            valid = valid && class != 3 && end != value + name_len + 1 && *end == '\0' && level >= 0 && level <= 7;
+        }
+        with->ioprio = class << IOPRIO_CLASS_SHIFT | level;
+    } else if (key_len > 7 && strncmp(word, "rlimit.", 7) == 0) {
+        RlimitName *limit = rlimit_names;
+        while (limit->name != NULL && (strlen(limit->name) != (size_t)key_len - 7 ||
+                                       strncmp(limit->name, word + 7, key_len - 7) != 0)) {
+            limit++;
+        }
+        if (limit->name == NULL) {
+            fprintf(stderr, "quash: with: %.*s: unknown resource limit\n", key_len, word);
+            return -1;
+        }
+        long size = strcmp(value, "unlimited") == 0 ? 0 : parse_size(value);
+        valid = size >= 0;
+
+        // Soft and hard limit both, like ulimit; a later setting of the same
+        // resource replaces an earlier one
+        int i = 0;
+        while (i < with->num_rlimits && with->rlimit_resources[i] != limit->resource) {
+            i++;
+        }
+        with->num_rlimits += i == with->num_rlimits;
+        with->rlimit_resources[i] = limit->resource;
+        with->rlimits[i].rlim_cur = strcmp(value, "unlimited") == 0 ? RLIM_INFINITY : (rlim_t)size;
+        with->rlimits[i].rlim_max = with->rlimits[i].rlim_cur;
+    } else {
+        return 1;
+    }
+
+    if (!valid) {
+        fprintf(stderr, "quash: with: %.*s: invalid value '%s'\n", key_len, word, value);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+// Parse a CPU list such as "4-7,9" into a set. Returns -1 if it is malformed.
+int with_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (1) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || !isdigit((unsigned char)*p)) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || !isdigit((unsigned char)*p) || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == '\0') {
+            return 0;
+        }
+        if (*p != ',') {
+            return -1;
+        }
+        p++;
+    }
+}
+#endif
+
+// Apply settings to process pid, or to the calling process for 0. A
+// process that has exited in the meantime is skipped. Returns -1 after
+// reporting the first setting that could not be applied.
+int with_apply(WithSettings *with, pid_t pid) {
+    const char *failed = NULL;
+#ifdef __linux__
+    if (with->has_cpus && sched_setaffinity(pid, sizeof(cpu_set_t), &with->cpus) == -1) {
+        failed = "cpus";
+    } else if (with->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, with->ioprio) == -1) {
+        failed = "ionice";
+    }
+#else
+    if (with->ioprio != -1) {
+        errno = ENOSYS;
+        failed = "ionice";
+    }
+#endif
+    if (failed == NULL && with->has_nice && setpriority(PRIO_PROCESS, pid, with->nice) == -1) {
+        failed = "nice";
+    }
+    for (int i = 0; failed == NULL && i < with->num_rlimits; i++) {
+#ifdef __linux__
+        int result = prlimit(pid, with->rlimit_resources[i], &with->rlimits[i], NULL);
+#else
+        int result = -1;
+        errno = ENOSYS;
+        if (pid == 0) {
+            result = setrlimit(with->rlimit_resources[i], &with->rlimits[i]);
+        }
+#endif
+        if (result == -1) {
+            failed = "rlimit";
+        }
+    }
+
+    if (failed == NULL || errno == ESRCH) {
+        return 0;
+    }
+    fprintf(stderr, "quash: with: %s: %s\n", failed, strerror(errno));
+    return -1;
+}
+
+// Merge new KEY=VALUE words into a job's settings text, replacing the old
+// value of each key they set. Returns a new malloc'd string.
+char *with_merge(const char *settings, char **words) {
+    StrBuf text = {NULL, 0, 0};
+    strbuf_reserve(&text, 0);
+    const char *p = settings != NULL ? settings : "";
+    while (*p != '\0') {
+        size_t len = strcspn(p, " ");
+        size_t key_len = strcspn(p, "=");
+        int replaced = 0;
+        for (char **word = words; *word != NULL && !replaced; word++) {
+            replaced = strncmp(*word, p, key_len + 1) == 0;
+        }
+        if (!replaced) {
+            strbuf_append(&text, p, len);
+            strbuf_append(&text, " ", 1);
+        }
+        p += len + (p[len] == ' ');
+    }
+    for (char **word = words; *word != NULL; word++) {
+        strbuf_append(&text, *word, strlen(*word));
+        strbuf_append(&text, " ", 1);
+    }
+    text.data[text.len > 0 ? text.len - 1 : 0] = '\0';
+    return strdup(text.data);
+}
+
+// Make the pipe a child started with settings holds open until it has
+// applied them and exec'd, so that a "with %N" right after can't be undone
+// by the child. The write end is kept clear of the descriptors the child's
+// actions can replace. On failure both ends are -1 and nothing is waited for.
+void with_sync_open(int fds[2]) {
+    if (make_pipe(fds) == -1) {
+        fds[0] = fds[1] = -1;
+        return;
+    }
+    int moved = fcntl(fds[1], F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+    close(fds[1]);
+    fds[1] = moved;
+}
+
+// In the shell, wait for the child to close its end of the pipe
+void with_sync_wait(int fds[2]) {
+    if (fds[1] != -1) {
+        close(fds[1]);
+    }
+    if (fds[0] != -1) {
+        char c;
+        while (read(fds[0], &c, 1) == -1 && errno == EINTR) {
+        }
+        close(fds[0]);
+    }
+}
+
+// Seconds elapsed on the monotonic clock since start
+double elapsed_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Print to stderr what a timed pipeline used: wall time for the whole
+// pipeline, and CPU time, peak RSS, context switches and page faults for
+// each stage and in total. Peak RSS is a maximum, the rest are sums.
+void time_report(Pipeline *pipeline, double real, struct rusage *usages, int *statuses, int num_stages) {
+    double user = 0, sys = 0;
+    long maxrss = 0, nvcsw = 0, nivcsw = 0, minflt = 0, majflt = 0;
+    for (int i = 0; i < num_stages; i++) {
+        user += usages[i].ru_utime.tv_sec + usages[i].ru_utime.tv_usec / 1e6;
+        sys += usages[i].ru_stime.tv_sec + usages[i].ru_stime.tv_usec / 1e6;
+        if (RU_MAXRSS_KB(usages[i]) > maxrss) maxrss = RU_MAXRSS_KB(usages[i]);
+        nvcsw += usages[i].ru_nvcsw;
+        nivcsw += usages[i].ru_nivcsw;
+        minflt += usages[i].ru_minflt;
+        majflt += usages[i].ru_majflt;
+    }
+
+    // Builtin output must not land after the report
+    fflush(stdout);
+
+    if (pipeline->timed == TIME_POSIX) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", real, user, sys);
+        return;
+    }
+
+    if (pipeline->timed == TIME_JSON) {
+        fprintf(stderr, "{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                "\"nvcsw\":%ld,\"nivcsw\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"stages\":[",
+                real, user, sys, maxrss, nvcsw, nivcsw, minflt, majflt);
+        for (int i = 0; i < num_stages; i++) {
+            struct rusage *ru = &usages[i];
+            char *name = command_name(&pipeline->commands[i]);
+            fputs(i > 0 ? ",{\"command\":\"" : "{\"command\":\"", stderr);
+            for (char *p = name ? name : ""; *p != '\0'; p++) {
+                if (*p == '"' || *p == '\\') {
+                    fprintf(stderr, "\\%c", *p);
+                } else if ((unsigned char)*p < 0x20) {
+                    fprintf(stderr, "\\u%04x", *p);
+                } else {
+                    fputc(*p, stderr);
+                }
+            }
+            fprintf(stderr, "\",\"status\":%d,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                    "\"nvcsw\":%ld,\"nivcsw\":%ld,\"minflt\":%ld,\"majflt\":%ld}",
+                    statuses[i], ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+                    ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6, (long)RU_MAXRSS_KB(*ru),
+                    ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    if (num_stages > 1) {
+        for (int i = 0; i < num_stages; i++) {
+            struct rusage *ru = &usages[i];
+            char *name = command_name(&pipeline->commands[i]);
+            fprintf(stderr, "%d %-12s user %.3fs sys %.3fs maxrss %ld KB ctxsw %ld/%ld faults %ld/%ld status %d\n",
+                    i + 1, name ? name : "", ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+                    ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6, (long)RU_MAXRSS_KB(*ru),
+                    ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt, statuses[i]);
+        }
+    }
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", real, user, sys);
+    fprintf(stderr, "maxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\nfaults\t%ld minor, %ld major\n",
+            maxrss, nvcsw, nivcsw, minflt, majflt);
+}
+
+// Current time on the monotonic clock, in nanoseconds
+long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Open or close the trace log when $QUASH_TRACE changes: a number is a
+// descriptor the shell inherited, anything else a file to append to
+void trace_update() {
+    trace_flush();
+    if (trace_fd_owned) {
+        close(trace_fd);
+    }
+    trace_fd = -1;
+    trace_fd_owned = 0;
+
+    char *value = var_get("QUASH_TRACE");
+    if (value == NULL || value[0] == '\0') {
+        return;
+    }
+
+    char *end;
+    long fd = strtol(value, &end, 10);
+    if (*end == '\0') {
+        if (fcntl(fd, F_GETFD) == -1) {
+            fprintf(stderr, "quash: QUASH_TRACE: %s: %s\n", value, strerror(errno));
+            return;
+        }
+        // Commands don't get the trace descriptor, unless it is a standard one
+        if (fd > STDERR_FILENO) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        trace_fd = fd;
+        return;
+    }
+
+    trace_fd = open(value, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd == -1) {
+        fprintf(stderr, "quash: QUASH_TRACE: %s: %s\n", value, strerror(errno));
+        return;
+    }
+    trace_fd_owned = 1;
+}
+
+// Write out the buffered trace records
+void trace_flush() {
+    if (trace_fd >= 0 && trace_len > 0) {
+        write_all(trace_fd, trace_buf, trace_len);
+    }
+    trace_len = 0;
+}
+
+// Append formatted text to the trace buffer, flushing it first when it is
+// nearly full. Never allocates.
+void trace_printf(const char *fmt, ...) {
+    if (TRACE_BUFFER_SIZE - trace_len < 512) {
+        trace_flush();
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(trace_buf + trace_len, TRACE_BUFFER_SIZE - trace_len, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        size_t room = TRACE_BUFFER_SIZE - trace_len - 1;
+        trace_len += (size_t)n < room ? (size_t)n : room;
+    }
+}
+
+// Append str as a JSON string, cut to a sane length
+void trace_string(const char *str) {
+    trace_printf("\"");
+    for (int i = 0; str != NULL && str[i] != '\0' && i < 1024; i++) {
+        unsigned char c = str[i];
+        if (TRACE_BUFFER_SIZE - trace_len < 8) {
+            trace_flush();
+        }
+        if (c == '"' || c == '\\') {
+            trace_buf[trace_len++] = '\\';
+            trace_buf[trace_len++] = c;
+        } else if (c < 0x20) {
+            trace_len += snprintf(trace_buf + trace_len, 8, "\\u%04x", c);
+        } else {
+            trace_buf[trace_len++] = c;
+        }
+    }
+    trace_printf("\"");
+}
+
+// Write the trace record of one executed line: when it was read and
+// parsed (expansion happens during parsing and is given as a total), and
+// for each child its pid and when it was spawned and reaped
+void trace_line(Pipeline *pipeline, const char *executor, pid_t *pids, StageTimes *times, int *statuses, int num_stages) {
+    trace_printf("{\"line\":%lu,\"executor\":\"%s\",\"text\":", trace_lines, executor);
+    trace_string(pipeline->text);
+    trace_printf(",\"start\":%lld,\"parsed\":%lld,\"expand_ns\":%lld,\"children\":[",
+                 trace_line_start, trace_parse_end, trace_expand_ns);
+    for (int i = 0; i < num_stages; i++) {
+        trace_printf("%s{\"pid\":%d,\"command\":", i > 0 ? "," : "", (int)pids[i]);
+        trace_string(command_name(&pipeline->commands[i]));
+        trace_printf(",\"spawn\":%lld,\"spawned\":%lld", times[i].spawn, times[i].spawned);
+        if (!pipeline->background && times[i].exit != 0) {
+            trace_printf(",\"exit\":%lld", times[i].exit);
+        }
+        if (!pipeline->background) {
+            trace_printf(",\"status\":%d", statuses[i]);
+        }
+        trace_printf("}");
+    }
+    trace_printf("],\"end\":%lld,\"status\":%d}\n", monotonic_ns(), pipeline->background ? 0 : last_status);
+}
+
+// Write the trace record of a reaped background child
+void trace_exit(pid_t pid, int status) {
+    trace_printf("{\"exit\":%lld,\"pid\":%d,\"status\":%d}\n", monotonic_ns(), (int)pid, status_to_exit_code(status));
+}
+
+// Convert a waitpid status into a shell exit status
+int status_to_exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return status;
+}
+
+// Record the exit status of every stage of the last foreground command;
+// $? is the status of the last stage and $PIPESTATUS lists them all
+void set_pipe_status(int *statuses, int count) {
+    int *copy = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, statuses, count * sizeof(int));
+    free(pipe_status);
+    pipe_status = copy;
+    num_pipe_status = count;
+    last_status = count > 0 ? statuses[count - 1] : 0;
+}
+
+// Create a pipe whose ends are not inherited across exec
+int make_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+// Parse a byte count with an optional k, m or g suffix. Returns -1 if invalid.
+long parse_size(const char *value) {
+    char *end;
+    long size = strtol(value, &end, 10);
+    if (end == value || size < 0) {
+        return -1;
+    }
+    switch (tolower((unsigned char)*end)) {
+    case 'g':
+        size *= 1024;
+        // fall through
+    case 'm':
+        size *= 1024;
+        // fall through
+    case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// Pick up the pipe capacity from $QUASH_PIPESIZE
+void pipe_size_update() {
+    char *value = var_get("QUASH_PIPESIZE");
+    pipe_size = 0;
+    if (value != NULL && value[0] != '\0') {
+        pipe_size = parse_size(value);
+        if (pipe_size < 0) {
+            fprintf(stderr, "quash: QUASH_PIPESIZE: invalid size '%s'\n", value);
+            pipe_size = 0;
+        }
+    }
+}
+
+// Resize a pipe. Only Linux can; elsewhere pipes keep the default size.
+void set_pipe_size(int fd, long size) {
+#ifdef F_SETPIPE_SZ
+    if (fcntl(fd, F_SETPIPE_SZ, (int)size) == -1) {
+        fprintf(stderr, "quash: pipe size %ld: %s\n", size, strerror(errno));
+    }
+#endif
+}
+
+
+
+// Hash len bytes of a name for the shell's lookup tables (FNV-1a)
+size_t hash_string(const char *str, size_t len) {
+    size_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Find the slot holding name, or the empty slot where it would go
+PathCacheEntry *path_cache_slot(PathCacheEntry *table, size_t size, const char *name) {
+    size_t mask = size - 1;
+    size_t i = hash_string(name, strlen(name)) & mask;
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+// Double the table once it is 70% full
+void path_cache_grow() {
+    size_t new_size = path_cache_size ? path_cache_size * 2 : PATH_CACHE_INITIAL_SIZE;
+    PathCacheEntry *new_table = calloc(new_size, sizeof(PathCacheEntry));
+    if (new_table == NULL) {
+        perror("quash: calloc failed");
+        return;
+    }
+    for (size_t i = 0; i < path_cache_size; i++) {
+        if (path_cache[i].name != NULL) {
+            *path_cache_slot(new_table, new_size, path_cache[i].name) = path_cache[i];
+        }
+    }
+    free(path_cache);
+    path_cache = new_table;
+    path_cache_size = new_size;
+}
+
+// Drop every cached path and re-read the $PATH directory list
+void path_cache_clear() {
+    for (size_t i = 0; i < path_cache_size; i++) {
+        free(path_cache[i].name);
+        free(path_cache[i].path);
+        path_cache[i].name = NULL;
+        path_cache[i].path = NULL;
+    }
+    path_cache_count = 0;
+
+    for (int i = 0; i < num_path_dirs; i++) {
+        free(path_dirs[i].dir);
+    }
+    free(path_dirs);
+    path_dirs = NULL;
+    num_path_dirs = 0;
+    free(path_cache_path);
+    path_cache_path = NULL;
+
+    char *path_env = var_get("PATH");
+    if (path_env == NULL) {
+        path_env = "/usr/local/bin:/usr/bin:/bin";
+    }
+    path_cache_path = strdup(path_env);
+
+    // Split $PATH into directories; an empty entry means the current directory
+    int count = 1;
+    for (char *p = path_env; *p != '\0'; p++) {
+        if (*p == ':') count++;
+    }
+    path_dirs = calloc(count, sizeof(PathDir));
+    char *start = path_env;
+    while (path_dirs != NULL) {
+        char *end = strchr(start, ':');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        PathDir *pd = &path_dirs[num_path_dirs++];
+        pd->dir = len ? strndup(start, len) : strdup(".");
+
+        struct stat st;
+        if (stat(pd->dir, &st) == 0) {
+            pd->mtime = ST_MTIM(st);
+        }
+        if (end == NULL) break;
+        start = end + 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &path_cache_checked);
+}
+
+// Invalidate the cache if $PATH changed or one of its directories was modified
+void path_cache_check() {
+    char *path_env = var_get("PATH");
+    if (path_cache_path == NULL || path_env == NULL || strcmp(path_env, path_cache_path) != 0) {
+        path_cache_clear();
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - path_cache_checked.tv_sec) * 1000000000L + (now.tv_nsec - path_cache_checked.tv_nsec);
+    if (elapsed < PATH_RECHECK_INTERVAL_NS) {
+        return;
+    }
+    path_cache_checked = now;
+
+    for (int i = 0; i < num_path_dirs; i++) {
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if (stat(path_dirs[i].dir, &st) == 0) {
+            mtime = ST_MTIM(st);
+        }
+        if (mtime.tv_sec != path_dirs[i].mtime.tv_sec || mtime.tv_nsec != path_dirs[i].mtime.tv_nsec) {
+            path_cache_clear();
+            return;
+        }
+    }
+}
+
+// Resolve a command name through the cache, searching $PATH on a miss.
+// Paths found through relative $PATH entries are not cached and are only
+// valid until the next call.
+char *path_cache_resolve(const char *name, int count_hit) {
+    static char uncached[4096];
+
+    if (path_cache_path == NULL) {
+        path_cache_clear();
+    }
+    if (path_cache_count * 10 >= path_cache_size * 7) {
+        path_cache_grow();
+        if (path_cache == NULL) return NULL;
+    }
+
+    PathCacheEntry *entry = path_cache_slot(path_cache, path_cache_size, name);
+    if (entry->name != NULL) {
+        if (count_hit) entry->hits++;
+        return entry->path;
+    }
+
+    for (int i = 0; i < num_path_dirs; i++) {
+        char candidate[4096];
+        snprintf(candidate, sizeof(candidate), "%s/%s", path_dirs[i].dir, name);
+
+        struct stat st;
+        if (stat(candidate, &st) != 0 || !S_ISREG(st.st_mode) || access(candidate, X_OK) != 0) {
+            continue;
+        }
+
+        if (path_dirs[i].dir[0] != '/') {
+            strcpy(uncached, candidate);
+            return uncached;
+        }
+        entry->name = strdup(name);
+        entry->path = strdup(candidate);
+        entry->hits = count_hit ? 1 : 0;
+        path_cache_count++;
+        return entry->path;
+    }
+    return NULL;
+}
+
+// Resolve the executable for a command, reporting it if it cannot be run
+char *lookup_command(char *name) {
+    if (name == NULL) {
+        return NULL;
+    }
+
+    // Names with a slash are run as given, without searching $PATH
+    if (strchr(name, '/') != NULL) {
+        if (access(name, X_OK) != 0) {
+            fprintf(stderr, "quash: %s: %s\n", name, strerror(errno));
+            return NULL;
+        }
+        return name;
+    }
+
+    char *path = path_cache_resolve(name, 1);
+    if (path == NULL) {
+        fprintf(stderr, "quash: %s: command not found\n", name);
+    }
+    return path;
+}
+
+// Select the spawn backend from $QUASH_SPAWN ("posix_spawn", "fork" or
+// "zygote"). The zygote pool starts right away, so when the variable comes
+// from the environment it is forked while the shell is still small.
+void spawn_backend_update() {
+    char *value = var_get("QUASH_SPAWN");
+    if (value == NULL || value[0] == '\0' || strcmp(value, "posix_spawn") == 0) {
+        spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+    } else if (strcmp(value, "fork") == 0) {
+        spawn_backend = SPAWN_BACKEND_FORK;
+    } else if (strcmp(value, "zygote") == 0) {
+        spawn_backend = SPAWN_BACKEND_ZYGOTE;
+    } else {
+        fprintf(stderr, "quash: QUASH_SPAWN: unknown backend '%s', using posix_spawn\n", value);
+        spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+    }
+
+    if (spawn_backend == SPAWN_BACKEND_ZYGOTE) {
+        zygote_start();
+    } else {
+        zygote_stop();
+    }
+}
+
+// Start the zygote: a process forked from the shell that drops everything
+// it doesn't need and keeps $QUASH_ZYGOTE_POOL helpers waiting for spawn
+// requests on a shared socket. Helpers are created with CLONE_PARENT, so
+// the commands they exec are children of the shell and are waited for like
+// any other. Only available on Linux; elsewhere the fork backend is used.
+void zygote_start() {
+#ifdef __linux__
+    if (zygote_fd != -1) {
+        return;
+    }
+    char *value = var_get("QUASH_ZYGOTE_POOL");
+    int pool = value != NULL && value[0] != '\0' ? atoi(value) : ZYGOTE_POOL_DEFAULT;
+    if (pool < 1 || pool > ZYGOTE_POOL_MAX) {
+        fprintf(stderr, "quash: QUASH_ZYGOTE_POOL: pool size must be 1 to %d\n", ZYGOTE_POOL_MAX);
+        pool = ZYGOTE_POOL_DEFAULT;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("quash: socketpair failed");
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        zygote_main(fds[1], pool);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        perror("quash: fork failed");
+        close(fds[0]);
+        return;
+    }
+    zygote_fd = fds[0];
+    zygote_pid = pid;
+#endif
+}
+
+// Shut the pool down. Closing the socket makes the zygote and the idle
+// helpers exit; they are reaped with the other children.
+void zygote_stop() {
+    if (zygote_fd == -1) {
+        return;
+    }
+    close(zygote_fd);
+    zygote_fd = -1;
+    zygote_pid = 0;
+}
+
+#ifdef __linux__
+// The zygote process: reset the signal state the shell set up, shed the
+// shell's descriptors and mappings, then start a helper for every one that
+// takes a request. Exits when the shell closes its end of the socket.
+void zygote_main(int sock, int pool) {
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+    for (int sig = 1; sig < NSIG; sig++) {
+        signal(sig, SIG_DFL);
+    }
+    if (history_map != NULL) {
+        munmap(history_map, history_map_size);
+    }
+    arena_reset(&line_arena);
+
+    int refill[2];
+    if (fcntl(sock, F_SETFD, 0) == -1 || pipe(refill) == -1) {
+        _exit(1);
+    }
+    close_cloexec_fds();
+
+    int pending = pool;
+    while (1) {
+        for (; pending > 0; pending--) {
+            pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+            if (pid == 0) {
+                close(refill[0]);
+                zygote_helper(sock, refill[1]);
+            } else if (pid < 0) {
+                break;
+            }
+        }
+
+        struct pollfd fds[2] = {{refill[0], POLLIN, 0}, {sock, 0, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        if (fds[1].revents & (POLLHUP | POLLERR)) {
+            _exit(0);
+        }
+        if (fds[0].revents & POLLIN) {
+            char buf[ZYGOTE_POOL_MAX];
+            ssize_t n = read(refill[0], buf, sizeof(buf));
+            pending += n > 0 ? n : 0;
+        }
+    }
+}
+
+// A pooled helper: wait for one request, tell the zygote to replace it,
+// and reply with its pid. Then rebuild the shell's descriptors from the
+// attached copies, apply the spawn actions as a forked child would, and
+// exec. The helper never returns.
+void zygote_helper(int sock, int refill_fd) {
+    char *buf = malloc(ZYGOTE_MESSAGE_MAX);
+    char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    struct iovec iov = {buf, ZYGOTE_MESSAGE_MAX};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = buf != NULL ? recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) : -1;
+    } while (n == -1 && errno == EINTR);
+    if (n < (ssize_t)sizeof(ZygoteRequest)) {
+        _exit(0);
+    }
+    if (write(refill_fd, "", 1) == -1) {
+        // The pool just runs one helper short
+        perror("quash: zygote refill failed");
+    }
+    close(refill_fd);
+
+    pid_t pid = getpid();
+    send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+    close(sock);
+
+    ZygoteRequest *req = (ZygoteRequest *)buf;
+    int32_t *fd_info = (int32_t *)(req + 1);
+    SpawnAction *actions = (SpawnAction *)(fd_info + 2 * req->num_fds);
+    char *str = (char *)(actions + req->num_actions);
+    char **args = malloc((req->num_args + req->num_env + 2) * sizeof(char *));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (args == NULL || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(req->num_fds * sizeof(int))) {
+        _exit(127);
+    }
+    int *received = (int *)CMSG_DATA(cmsg);
+
+    char *path = str;
+    str += strlen(str) + 1;
+    for (uint32_t i = 0; i < req->num_args + req->num_env; i++) {
+        args[i + (i >= req->num_args)] = str;
+        str += strlen(str) + 1;
+    }
+    args[req->num_args] = NULL;
+    args[req->num_args + req->num_env + 1] = NULL;
+    char **envp = args + req->num_args + 1;
+
+    // Move the received descriptors above every number in use, then put
+    // each at the number it had in the shell
+    if (fchdir(received[0]) == -1) {
+        perror("quash: fchdir failed");
+        _exit(127);
+    }
+    close(received[0]);
+    int top = 0;
+    for (uint32_t i = 0; i < req->num_fds; i++) {
+        top = fd_info[2 * i] > top ? fd_info[2 * i] : top;
+        top = received[i] > top ? received[i] : top;
+    }
+    for (uint32_t i = 1; i < req->num_fds; i++) {
+        int fd = fcntl(received[i], F_DUPFD_CLOEXEC, top + 1);
+        close(received[i]);
+        received[i] = fd;
+    }
+    for (uint32_t i = 1; i < req->num_fds; i++) {
+        int target = fd_info[2 * i];
+        if (received[i] == -1 || dup2(received[i], target) == -1) {
+            perror("quash: dup2 failed");
+            _exit(127);
+        }
+        if (fd_info[2 * i + 1]) {
+            fcntl(target, F_SETFD, FD_CLOEXEC);
+        }
+        close(received[i]);
+    }
+
+    if (apply_spawn_actions(actions, req->num_actions) == -1) {
+        _exit(127);
+    }
+    exec_command(path, args, envp);
+    perror("quash: command execution failed");
+    _exit(127);
+}
+#endif
+
+// Hand a spawn to a zygote helper. Standard input, output and error, the
+// sources of the actions and the working directory go along as descriptor
+// copies. Returns the new pid, -1 after reporting an error, or -2 when no
+// pool is available and the command should be forked instead.
+pid_t zygote_spawn(char *path, char **args, char **envp, SpawnAction *actions, int num_actions) {
+#ifdef __linux__
+    if (zygote_fd == -1) {
+        zygote_start();
+        if (zygote_fd == -1) {
+            return -2;
+        }
+    }
+
+    int fds[ZYGOTE_MAX_FDS];
+    int32_t fd_info[2 * ZYGOTE_MAX_FDS];
+    int num_fds = 0;
+    fds[num_fds] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fds[num_fds] == -1) {
+        return -2;
+    }
+    fd_info[0] = -1;
+    fd_info[1] = 1;
+    num_fds++;
+    for (int i = -3; i < num_actions; i++) {
+        int fd = i < 0 ? i + 3 : actions[i].src_fd;
+        int flags = fd >= 0 ? fcntl(fd, F_GETFD) : -1;
+        int seen = 0;
+        for (int j = 1; j < num_fds && !seen; j++) {
+            seen = fd_info[2 * j] == fd;
+        }
+        if (flags == -1 || seen) {
+            continue;
+        }
+        if (num_fds == ZYGOTE_MAX_FDS) {
+            close(fds[0]);
+            return -2;
+        }
+        fds[num_fds] = fd;
+        fd_info[2 * num_fds] = fd;
+        fd_info[2 * num_fds + 1] = (flags & FD_CLOEXEC) != 0;
+        num_fds++;
+    }
+
+    ZygoteRequest req = {0, 0, (uint32_t)num_actions, (uint32_t)num_fds};
+    StrBuf msg = {NULL, 0, 0};
+    strbuf_append(&msg, (char *)&req, sizeof(req));
+    strbuf_append(&msg, (char *)fd_info, 2 * num_fds * sizeof(int32_t));
+    strbuf_append(&msg, (char *)actions, num_actions * sizeof(SpawnAction));
+    strbuf_append(&msg, path, strlen(path) + 1);
+    for (char **arg = args; *arg != NULL; arg++) {
+        strbuf_append(&msg, *arg, strlen(*arg) + 1);
+        req.num_args++;
+    }
+    for (char **env = envp; *env != NULL; env++) {
+        strbuf_append(&msg, *env, strlen(*env) + 1);
+        req.num_env++;
+    }
+    memcpy(msg.data, &req, sizeof(req));
+    if (msg.len > ZYGOTE_MESSAGE_MAX) {
+        close(fds[0]);
+        return -2;
+    }
+
+    char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {msg.data, msg.len};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(zygote_fd, &mh, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    close(fds[0]);
+
+    pid_t pid = -1;
+    ssize_t got = -1;
+    if (sent == (ssize_t)msg.len) {
+        do {
+            got = recv(zygote_fd, &pid, sizeof(pid), 0);
+        } while (got == -1 && errno == EINTR);
+    }
+    if (got != sizeof(pid)) {
+        // The pool is gone: report it once and fall back to fork
+        fprintf(stderr, "quash: zygote pool unavailable, forking instead\n");
+        zygote_stop();
+        return -2;
+    }
+    return pid;
+#else
+    return -2;
+#endif
+}
+
+// Apply descriptor actions in a new child. Returns -1 if one fails.
+int apply_spawn_actions(SpawnAction *actions, int num_actions) {
+    for (int i = 0; i < num_actions; i++) {
+        if (actions[i].src_fd < 0) {
+            close(actions[i].target_fd);
+        } else if (dup2(actions[i].src_fd, actions[i].target_fd) == -1) {
+            perror("quash: dup2 failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Arguments for running path, an executable without a #! line, as a
+// /bin/sh script the way execvp does. Returns NULL if out of memory.
+char **script_args(char *path, char **args) {
+    int n = 0;
+    while (args[n] != NULL) {
+        n++;
+    }
+    char **sh_args = malloc((n + 2) * sizeof(char *));
+    if (sh_args == NULL) {
+        return NULL;
+    }
+    sh_args[0] = "/bin/sh";
+    sh_args[1] = path;
+    for (int i = 1; i <= n; i++) {
+        sh_args[i + 1] = args[i];
+    }
+    return sh_args;
+}
+
+// Exec path in a new child, falling back to /bin/sh for a script without
+// a #! line. Returns only on failure.
+void exec_command(char *path, char **args, char **envp) {
+    execve(path, args, envp);
+    if (errno == ENOEXEC) {
+        char **sh_args = script_args(path, args);
+        if (sh_args != NULL) {
+            execve("/bin/sh", sh_args, envp);
+            errno = ENOEXEC;
+        }
+    }
+}
+
+// Start path with args and environment envp, applying the descriptor
+// actions in the child first. Returns the child's pid, or -1 after
+// reporting the error.
+pid_t spawn_command(char *path, char **args, char **envp, SpawnAction *actions, int num_actions) {
+    pid_t pid;
+
+    // Builtin output still sitting in stdio must come before the child's
+    fflush(stdout);
+
+    if (spawn_backend == SPAWN_BACKEND_ZYGOTE && spawn_with == NULL) {
+        pid = zygote_spawn(path, args, envp, actions, num_actions);
+        if (pid != -2) {
+            return pid;
+        }
+    }
+
+    // "with" settings have to be applied in the child before exec, which
+    // only fork allows
+    if (spawn_backend != SPAWN_BACKEND_POSIX_SPAWN || spawn_with != NULL) {
+        int applied[2] = {-1, -1};
+        if (spawn_with != NULL) {
+            with_sync_open(applied);
+        }
+        pid = fork();
+        if (pid == 0) {
+            // Child process: undo the shell's blocked SIGCHLD
+            sigset_t empty_mask;
+            sigemptyset(&empty_mask);
+            sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+
+            if (apply_spawn_actions(actions, num_actions) == -1) {
+                _exit(127);
+            }
+            if (spawn_with != NULL && with_apply(spawn_with, 0) == -1) {
+                _exit(127);
+            }
+
+            // Execute the command
+            exec_command(path, args, envp);
+            perror("quash: command execution failed");
+            _exit(127);
+        }
+        with_sync_wait(applied);
+        if (pid < 0) {
+            perror("quash: fork failed");
+            return -1;
+        }
+        return pid;
+    }
+
+    // posix_spawn never copies the shell's page tables (glibc uses
+    // CLONE_VM|CLONE_VFORK), and reports exec failures back to us
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    for (int i = 0; i < num_actions; i++) {
+        if (actions[i].src_fd < 0) {
+            posix_spawn_file_actions_addclose(&file_actions, actions[i].target_fd);
+        } else {
+            posix_spawn_file_actions_adddup2(&file_actions, actions[i].src_fd, actions[i].target_fd);
+        }
+    }
+
+    // Children start with an empty signal mask, not the shell's blocked SIGCHLD
+    posix_spawnattr_t attr;
+    sigset_t empty_mask;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&empty_mask);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    int err = posix_spawn(&pid, path, &file_actions, &attr, args, envp);
+    if (err == ENOEXEC) {
+        char **sh_args = script_args(path, args);
+        if (sh_args != NULL) {
+            err = posix_spawn(&pid, "/bin/sh", &file_actions, &attr, sh_args, envp);
+            free(sh_args);
+        }
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "quash: %s: %s\n", args[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// Open a redirection target in the shell so errors are reported before
+// anything is spawned. The descriptor is close-on-exec; it only reaches the
+// child through a SpawnAction.
+int open_redirect_file(const char *file, int flags) {
+    if (file == NULL) {
+        fprintf(stderr, "quash: syntax error: missing redirection target\n");
+        return -1;
+    }
+
+    int fd = open(file, flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "quash: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    // Keep it clear of the descriptors a command line can name (0-9), so
+    // dup2 always clears FD_CLOEXEC and no earlier action overwrites it
+    if (fd < REDIRECT_FD_MIN) {
+        int moved = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+        close(fd);
+        fd = moved;
+    }
+    return fd;
+}
+
+// Make the anonymous file a here-document or here-string body is kept in:
+// a sealable memfd on Linux, elsewhere an unlinked temporary file. It is
+// close-on-exec and clear of the descriptors a command line can name.
+// Returns -1 after reporting an error.
+int heredoc_create() {
+#ifdef __linux__
+    int fd = memfd_create("quash-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    char path[] = "/tmp/quash-heredoc-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd != -1) {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (fd == -1) {
+        perror("quash: here-document");
+        return -1;
+    }
+    if (fd < REDIRECT_FD_MIN) {
+        int moved = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+        close(fd);
+        fd = moved;
+    }
+    return fd;
+}
+
+// Seal a finished body against any change and rewind it for the command
+// that reads it. Readers see an ordinary seekable file of known size.
+void heredoc_seal(int fd) {
+#ifdef __linux__
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    lseek(fd, 0, SEEK_SET);
+}
+
+// Store a here-string, with the newline it gets, and return its descriptor,
+// or -1 after reporting an error
+int heredoc_string(const char *word) {
+    int fd = heredoc_create();
+    if (fd == -1) {
+        return -1;
+    }
+    size_t len = strlen(word);
+    char *body = arena_alloc(&line_arena, len + 1);
+    memcpy(body, word, len);
+    body[len] = '\n';
+    if (write_all(fd, body, len + 1) == -1) {
+        perror("quash: here-string");
+        close(fd);
+        return -1;
+    }
+    heredoc_seal(fd);
+    return fd;
+}
+
+// Read the bodies of the pipeline's << here-documents, in order, from the
+// lines that follow it (none for a NULL reader). Lines are batched straight
+// into each body's file; only those with something to expand are copied on
+// the way. Returns -1 if a body could not be stored.
+int heredoc_read(Pipeline *pipeline, LineReader *reader, int interactive) {
+    for (int i = 0; i < pipeline->num_commands; i++) {
+        for (Redirect *r = pipeline->commands[i].redirects; r != NULL; r = r->next) {
+            if (r->type != REDIR_HEREDOC || r->body_fd != -1) {
+                continue;
+            }
+            r->body_fd = heredoc_create();
+            if (r->body_fd == -1) {
+                return -1;
+            }
+
+            Output out;
+            out.fd = r->body_fd;
+            out.capture = NULL;
+            out.error = 0;
+            out.used = 0;
+            Output *outer = builtin_output;
+            builtin_output = &out;
+            while (1) {
+                char *line = NULL;
+                if (reader != NULL && interactive) {
+                    printf("> ");
+                    fflush(stdout);
+                    line = editor_read_line(reader, "> ");
+                } else if (reader != NULL) {
+                    line = reader_next_line(reader);
+                }
+                if (line == NULL) {
+                    fprintf(stderr, "quash: warning: here-document delimited by end-of-file (wanted `%s')\n", r->target);
+                    break;
+                }
+
+                if (r->strip_tabs) {
+                    while (*line == '\t') {
+                        line++;
+                    }
+                }
+                if (strcmp(line, r->target) == 0) {
+                    break;
+                }
+                if (r->expand && strpbrk(line, "$`\\") != NULL) {
+                    line = heredoc_expand(line);
+                }
+                output_write(line, strlen(line));
+                output_write("\n", 1);
+            }
+            output_flush();
+            builtin_output = outer;
+
+            if (out.error != 0) {
+                errno = out.error;
+                perror("quash: here-document");
+                return -1;
+            }
+            heredoc_seal(r->body_fd);
+        }
+    }
+    return 0;
+}
+
+// Close the bodies of the line's here-documents; the commands that read
+// them hold copies of their own
+void heredoc_close_all() {
+    for (Redirect *r = line_heredocs; r != NULL; r = r->next_heredoc) {
+        if (r->body_fd != -1) {
+            close(r->body_fd);
+        }
+    }
+    line_heredocs = NULL;
+}
+
+// Turn a stage's pipe ends (-1 for the shell's own) and redirections into
+// descriptor actions, opening the redirection files; opened receives the
+// descriptors to close once the stage has its copies. Returns -1 if a
+// file could not be opened.
+int stage_actions(Command *cmd, int in_fd, int out_fd, SpawnAction *actions, int *num_actions, int *opened, int *num_opened) {
+    *num_actions = 0;
+    *num_opened = 0;
+
+    // Pipe ends first, so the command's own redirections take precedence
+    if (in_fd != -1) {
+        actions[*num_actions].src_fd = in_fd;
+        actions[*num_actions].target_fd = STDIN_FILENO;
+        (*num_actions)++;
+    }
+    if (out_fd != -1) {
+        actions[*num_actions].src_fd = out_fd;
+        actions[*num_actions].target_fd = STDOUT_FILENO;
+        (*num_actions)++;
+    }
+
+    // Then every redirection, in source order, as one more descriptor action
+    for (Redirect *r = cmd->redirects; r != NULL; r = r->next) {
+        actions[*num_actions].target_fd = r->fd;
+        if (r->type == REDIR_DUP) {
+            // N>&M duplicates M, N>&- closes N
+            actions[*num_actions].src_fd = strcmp(r->target, "-") == 0 ? -1 : atoi(r->target);
+            (*num_actions)++;
+            continue;
+        }
+        if (r->type == REDIR_HEREDOC) {
+            // The body is already in its file, ready to be read from the start
+            actions[*num_actions].src_fd = r->body_fd;
+            (*num_actions)++;
+            continue;
+        }
+
+        int flags = O_RDONLY;
+        if (r->type == REDIR_OUTPUT) {
+            flags = O_CREAT | O_WRONLY | O_TRUNC;
+        } else if (r->type == REDIR_APPEND) {
+            flags = O_CREAT | O_WRONLY | O_APPEND;
+        } else if (r->type == REDIR_READ_WRITE) {
+            flags = O_CREAT | O_RDWR;
+        }
+
+        int fd = open_redirect_file(r->target, flags);
+        if (fd == -1) {
+            return -1;
+        }
+        opened[(*num_opened)++] = fd;
+        actions[*num_actions].src_fd = fd;
+        (*num_actions)++;
+    }
+    return 0;
+}
+
+// Start one command of a pipeline with its standard input and output
+// connected to in_fd/out_fd (-1 to inherit the shell's) and its own
+// redirections applied on top. Returns the child's pid, or -1 with *status
+// set when nothing was started. Given a thread slot, a utility builtin
+// runs on a thread instead, and *thread is set.
+pid_t spawn_stage(Command *cmd, int in_fd, int out_fd, int *status, BuiltinStage **thread) {
+    int num_redirects = 0;
+    for (Redirect *r = cmd->redirects; r != NULL; r = r->next) {
+        num_redirects++;
+    }
+
+    SpawnAction *actions = arena_alloc(&line_arena, (num_redirects + 2) * sizeof(SpawnAction));
+    int *opened = arena_alloc(&line_arena, (num_redirects + 1) * sizeof(int));
+    int num_actions;
+    int num_opened;
+    pid_t pid = -1;
+    int opened_all = stage_actions(cmd, in_fd, out_fd, actions, &num_actions, opened, &num_opened) == 0;
+
+    // Builtins run without an exec: utilities on a thread when they can,
+    // the others in a forked copy of the shell. "command" asks for the
+    // external program where there is one.
+    char **argv = cmd->argv + cmd->num_assignments;
+    int bypass = argv[0] != NULL && strcmp(argv[0], "command") == 0;
+    argv += bypass;
+    Builtin *builtin = builtin_lookup(argv[0]);
+    if (bypass && builtin != NULL && (builtin->flags & BUILTIN_UTILITY)) {
+        builtin = NULL;
+    }
+    if (!opened_all) {
+        *status = 1;
+    } else if (argv[0] == NULL) {
+        // A command made only of redirections (and assignments) just
+        // creates/opens the files
+        *status = 0;
+    } else if (builtin != NULL) {
+        *status = 1;
+        if (thread != NULL && (builtin->flags & BUILTIN_UTILITY)) {
+            *thread = builtin_stage_start(builtin, argv, actions, num_actions);
+        }
+        if (thread == NULL || *thread == NULL) {
+            pid = spawn_builtin(builtin->run, argv, actions, num_actions);
+        }
+    } else {
+        *status = 127;
+        char *path = lookup_command(argv[0]);
+        if (path != NULL) {
+            pid = spawn_command(path, argv, command_envp(cmd), actions, num_actions);
+        }
+    }
+
+    // The child has its own copies now
+    for (int i = 0; i < num_opened; i++) {
+        close(opened[i]);
+    }
+    return pid;
+}
+
+// The environment for a command: the exported variables, plus its
+// NAME=value prefixes
+char **command_envp(Command *cmd) {
+    if (cmd->num_assignments == 0) {
+        return var_envp();
+    }
+
+    char **envp = arena_alloc(&line_arena, (env_count + cmd->num_assignments + 1) * sizeof(char *));
+    memcpy(envp, env_snapshot, env_count * sizeof(char *));
+    int count = env_count;
+    for (int i = 0; i < cmd->num_assignments; i++) {
+        char *word = cmd->argv[i];
+        size_t name_len = strchr(word, '=') - word;
+
+        // Replace an exported variable in place, or a prefix given twice
+        ShellVar *var = var_lookup(word, name_len);
+        int slot = var != NULL && var->env_index >= 0 ? var->env_index : -1;
+        for (int j = env_count; slot < 0 && j < count; j++) {
+            if (strncmp(envp[j], word, name_len + 1) == 0) {
+                slot = j;
+            }
+        }
+        if (slot < 0) {
+            slot = count++;
+        }
+        envp[slot] = word;
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+// The name of the command run by cmd, after its NAME=value prefixes
+char *command_name(Command *cmd) {
+    return cmd->argv[cmd->num_assignments];
+}
+
+// Close the shell's private descriptors (the close-on-exec ones) in a
+// forked builtin, as exec does for a command. Otherwise a builtin stage
+// would keep pipe ends open and the stages around it would never see EOF.
+void close_cloexec_fds() {
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir != NULL) {
+        int dir_fd = dirfd(dir);
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int fd = atoi(entry->d_name);
+            if (fd > STDERR_FILENO && fd != dir_fd && (fcntl(fd, F_GETFD) & FD_CLOEXEC)) {
+                close(fd);
+            }
+        }
+        closedir(dir);
+        return;
+    }
+#endif
+    for (int fd = STDERR_FILENO + 1; fd < 1024; fd++) {
+        int flags = fcntl(fd, F_GETFD);
+        if (flags != -1 && (flags & FD_CLOEXEC)) {
+            close(fd);
+        }
+    }
+}
+
+// Run a builtin as a pipeline stage, in a forked child of the shell with
+// the descriptor actions applied. Returns the child's pid, or -1.
+pid_t spawn_builtin(int (*builtin)(char **), char **args, SpawnAction *actions, int num_actions) {
+    fflush(stdout);
+    int applied[2] = {-1, -1};
+    if (spawn_with != NULL) {
+        with_sync_open(applied);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // SIGCHLD stays blocked where the shell reads it from a signalfd
+        sigset_t mask;
+        sigemptyset(&mask);
+#ifdef __linux__
+        sigaddset(&mask, SIGCHLD);
+#endif
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        if (apply_spawn_actions(actions, num_actions) == -1) {
+            _exit(127);
+        }
+        if (spawn_with != NULL && with_apply(spawn_with, 0) == -1) {
+            _exit(127);
+        }
+
+        // The shell's child event source is close-on-exec and goes with
+        // the rest; builtins like parallel that wait for children of
+        // their own need a fresh one
+        close_cloexec_fds();
+        child_events_init();
+
+        // The zygote socket went too, and its number may be reused by a
+        // pipe the builtin opens; spawn from here by forking instead
+        zygote_fd = -1;
+        zygote_pid = 0;
+        if (spawn_backend == SPAWN_BACKEND_ZYGOTE) {
+            spawn_backend = SPAWN_BACKEND_FORK;
+        }
+
+        // Likewise the history log; history_open() opens it again
+        history_fd = -1;
+        if (history_map != NULL) {
+            munmap(history_map, history_map_size);
+            history_map = NULL;
+        }
+        history_map_size = 0;
+        int status = builtin(args);
+        fflush(stdout);
+        _exit(status);
+    }
+    with_sync_wait(applied);
+    if (pid < 0) {
+        perror("quash: fork failed");
+    }
+    return pid;
+}
+
+// Start a utility builtin on a thread. Its standard input and output are
+// worked out from the descriptor actions rather than applied to the
+// shell's own descriptors. Returns NULL, for the caller to fork instead,
+// when the actions move standard error or no thread can be started.
+BuiltinStage *builtin_stage_start(Builtin *builtin, char **args, SpawnAction *actions, int num_actions) {
+    // Where descriptors 0-9 would point in a child after the actions
+    int fds[10];
+    for (int i = 0; i < 10; i++) {
+        fds[i] = i;
+    }
+    for (int i = 0; i < num_actions; i++) {
+        int src = actions[i].src_fd;
+        if (src >= 0 && src < 10) {
+            src = fds[src];
+        }
+        if (actions[i].target_fd < 10) {
+            fds[actions[i].target_fd] = src;
+        }
+    }
+    if (fds[STDERR_FILENO] != STDERR_FILENO) {
+        return NULL;
+    }
+
+    BuiltinStage *stage = arena_alloc(&line_arena, sizeof(BuiltinStage));
+    memset(stage, 0, sizeof(BuiltinStage));
+    stage->builtin = builtin;
+    stage->args = args;
+    stage->status = 1;
+    stage->in_fd = fds[STDIN_FILENO] >= 0 ? fcntl(fds[STDIN_FILENO], F_DUPFD_CLOEXEC, REDIRECT_FD_MIN) : -1;
+    stage->out_fd = fds[STDOUT_FILENO] >= 0 ? fcntl(fds[STDOUT_FILENO], F_DUPFD_CLOEXEC, REDIRECT_FD_MIN) : -1;
+
+    // Shell output still sitting in stdio must come before the stage's
+    fflush(stdout);
+    if (pthread_create(&stage->thread, NULL, builtin_stage_main, stage) != 0) {
+        if (stage->in_fd != -1) close(stage->in_fd);
+        if (stage->out_fd != -1) close(stage->out_fd);
+        return NULL;
+    }
+    return stage;
+}
+
+// Body of a builtin stage's thread. A write to a pipe nobody reads fails
+// with EPIPE here instead of raising SIGPIPE, which would end the shell.
+void *builtin_stage_main(void *arg) {
+    BuiltinStage *stage = arg;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    Output *out = malloc(sizeof(Output));
+    if (out != NULL) {
+        out->fd = stage->out_fd;
+        out->capture = NULL;
+        out->error = 0;
+        out->used = 0;
+        builtin_output = out;
+        builtin_input = stage->in_fd;
+        stage->status = stage->builtin->run(stage->args);
+        output_flush();
+        builtin_output = NULL;
+        free(out);
+    }
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &stage->usage);
+#endif
+
+    if (stage->in_fd != -1) close(stage->in_fd);
+    if (stage->out_fd != -1) close(stage->out_fd);
+    return NULL;
+}
+
+// Run a builtin in the shell itself. Its redirections are applied to the
+// shell's own descriptors for the time being, with the originals set
+// aside above the range a command line can name and put back afterwards.
+// Given a capture buffer, what it writes to standard output lands there.
+int run_builtin(Command *cmd, Builtin *builtin, char **args, StrBuf *capture) {
+    if (cmd->redirects == NULL && capture == NULL) {
+        return builtin->run(args);
+    }
+
+    int num_redirects = 0;
+    for (Redirect *r = cmd->redirects; r != NULL; r = r->next) {
+        num_redirects++;
+    }
+    SpawnAction *actions = arena_alloc(&line_arena, num_redirects * sizeof(SpawnAction));
+    int *opened = arena_alloc(&line_arena, num_redirects * sizeof(int));
+    int *saved = arena_alloc(&line_arena, num_redirects * sizeof(int));
+    int num_actions;
+    int num_opened;
+    int status = 1;
+    if (stage_actions(cmd, -1, -1, actions, &num_actions, opened, &num_opened) == 0) {
+        fflush(stdout);
+
+        // -1 marks a descriptor that was closed to begin with. Output
+        // redirected away from standard output is not captured.
+        Output out;
+        out.fd = STDOUT_FILENO;
+        out.capture = capture;
+        out.error = 0;
+        out.used = 0;
+        for (int i = 0; i < num_actions; i++) {
+            saved[i] = fcntl(actions[i].target_fd, F_DUPFD_CLOEXEC, REDIRECT_FD_MIN);
+            if (actions[i].target_fd == STDOUT_FILENO) {
+                out.capture = NULL;
+            }
+        }
+        if (apply_spawn_actions(actions, num_actions) == 0) {
+            Output *outer = builtin_output;
+            builtin_output = &out;
+            status = builtin->run(args);
+            output_flush();
+            builtin_output = outer;
+            fflush(stdout);
+        }
+        for (int i = num_actions - 1; i >= 0; i--) {
+            if (saved[i] == -1) {
+                close(actions[i].target_fd);
+            } else {
+                dup2(saved[i], actions[i].target_fd);
+                close(saved[i]);
+            }
+        }
+    }
+    for (int i = 0; i < num_opened; i++) {
+        close(opened[i]);
+    }
+    return status;
+}
+
+// Copy in to out (builtin output, if -1) and to every descriptor in fds
+// through a user-space buffer
+int tee_copy(int in, int out, int *fds, int num_fds) {
+    char buf[READ_BUFFER_SIZE];
+    int status = 0;
+    while (1) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n == 0) break;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("quash: tee: read");
+            return 1;
+        }
+        if (out < 0) {
+            output_write(buf, n);
+        }
+        if (out < 0 ? output_failed() : write_all(out, buf, n) == -1) {
+            perror("quash: tee: write");
+            return 1;
+        }
+        for (int i = 0; i < num_fds; i++) {
+            if (fds[i] != -1 && write_all(fds[i], buf, n) == -1) {
+                perror("quash: tee: write");
+                fds[i] = -1;
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+#ifdef __linux__
+// Move exactly len bytes from the pipe in to out with splice(2), falling
+// back to read/write when out can't be spliced to (a terminal, say)
+int splice_all(int in, int out, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINVAL) {
+            char buf[READ_BUFFER_SIZE];
+            n = read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n > 0 && write_all(out, buf, n) == -1) {
+                return -1;
+            }
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Zero-copy tee for a pipe on in. Each round tee(2) duplicates what is
+// buffered in the input pipe into one private pipe per file, those are
+// spliced into the files and the input is finally spliced to out. The
+// private pipes are at least as large as the input pipe, so every tee(2)
+// of a round copies the same bytes. Returns -1 if in is not a pipe,
+// before anything is consumed.
+int tee_splice(int in, int out, int *fds, int num_fds) {
+    struct stat st;
+    if (fstat(in, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        return -1;
+    }
+
+    int in_size = fcntl(in, F_GETPIPE_SZ);
+    int (*pipes)[2] = malloc((num_fds > 0 ? num_fds : 1) * sizeof(int[2]));
+    if (pipes == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < num_fds; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            while (i-- > 0) {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+            free(pipes);
+            return -1;
+        }
+        if (in_size > 0 && fcntl(pipes[i][1], F_GETPIPE_SZ) < in_size) {
+            fcntl(pipes[i][1], F_SETPIPE_SZ, in_size);
+        }
+    }
+
+    int status = 0;
+    while (1) {
+        ssize_t len;
+        if (num_fds == 0) {
+            len = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE);
+            if (len == -1 && errno == EINTR) continue;
+            if (len == -1 && errno == EINVAL) {
+                status = tee_copy(in, out, fds, 0);
+                break;
+            }
+            if (len <= 0) {
+                if (len == -1) status = 1;
+                break;
+            }
+            continue;
+        }
+
+        // Blocks until there is input; 0 means the writers are gone
+        len = tee(in, pipes[0][1], 1 << 30, 0);
+        if (len == -1 && errno == EINTR) continue;
+        if (len <= 0) {
+            if (len == -1) {
+                perror("quash: tee");
+                status = 1;
+            }
+            break;
+        }
+        for (int i = 1; i < num_fds; i++) {
+            ssize_t n = tee(in, pipes[i][1], len, 0);
+            while (n == -1 && errno == EINTR) {
+                n = tee(in, pipes[i][1], len, 0);
+            }
+            if (n != len) {
+                fprintf(stderr, "quash: tee: short tee(2)\n");
+                status = 1;
+                break;
+            }
+        }
+        if (status != 0) break;
+
+        for (int i = 0; i < num_fds; i++) {
+            // A file that failed to take a write still has its pipe drained
+            if (fds[i] == -1) {
+                char buf[READ_BUFFER_SIZE];
+                for (ssize_t left = len; left > 0;) {
+                    ssize_t n = read(pipes[i][0], buf, left < (ssize_t)sizeof(buf) ? left : (ssize_t)sizeof(buf));
+                    if (n <= 0) break;
+                    left -= n;
+                }
+            } else if (splice_all(pipes[i][0], fds[i], len) == -1) {
+                perror("quash: tee: write");
+                fds[i] = -1;
+                status = 1;
+            }
+        }
+        if (splice_all(in, out, len) == -1) {
+            perror("quash: tee: write");
+            status = 1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < num_fds; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    free(pipes);
+    return status;
+}
+#endif
+
+// Built-in command: tee [-a] [file ...], run as a pipeline stage.
+// Copies standard input to standard output and to each file; a pipe on
+// standard input is copied without passing through user space.
+int quash_tee(char **args) {
+    int i = 1;
+    int flags = O_CREAT | O_WRONLY | O_TRUNC;
+    int status = 0;
+    if (args[1] != NULL && strcmp(args[1], "-a") == 0) {
+        flags = O_CREAT | O_WRONLY | O_APPEND;
+        i++;
+    }
+
+    int num_fds = 0;
+    int max_fds = 1;
+    while (args[max_fds] != NULL) {
+        max_fds++;
+    }
+    int *fds = malloc(max_fds * sizeof(int));
+    if (fds == NULL) {
+        perror("quash: tee");
+        return 1;
+    }
+    for (; args[i] != NULL; i++) {
+        int fd = open(args[i], flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "quash: tee: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        fds[num_fds++] = fd;
+    }
+
+    int out = output_fd();
+    int result = -1;
+#ifdef __linux__
+    if (out >= 0) {
+        result = tee_splice(builtin_input, out, fds, num_fds);
+    }
+#endif
+    if (result == -1) {
+        result = tee_copy(builtin_input, out, fds, num_fds);
+    }
+    return result != 0 ? result : status;
+}
+
+// Function to run the shell over an input source. Only an interactive
+// shell prints prompts and job notifications. Returns the exit status.
+int run_shell(LineReader *reader, int interactive) {
+    char *input;            // Current input line
+
+    shell_interactive = interactive;
+    while (!shell_exiting) {
+        // Everything allocated for the previous line is released at once
+        heredoc_close_all();
+        arena_reset(&line_arena);
+
+        if (interactive) {
+            // Log the previous line, and write out trace records while the
+            // shell sits idle
+            history_finish_line();
+            trace_flush();
+
+            // Print prompt
+            printf("[QUASH]$ ");
+            fflush(stdout);
+
+            // Check for completed background jobs
+            check_background_jobs(1);
+        } else if (num_background_children > 0) {
+            // Scripts reap finished background jobs quietly
+            check_background_jobs(0);
+        }
+
+        // Get the next line, however long it is
+        input = interactive ? editor_read_line(reader, "[QUASH]$ ") : reader_next_line(reader);
+        if (input == NULL) {
+            // Handle Ctrl+D (EOF)
+            if (interactive) printf("\n");
+            break;
+        }
+
+        trace_lines++;
+
+        // Check if the input is empty
+        if (input[0] == '\0') {
+            continue;
+        }
+
+        // Interactive lines starting with ! run an earlier entry again
+        if (interactive && input[0] == '!' && input[1] != '\0' && !IS_BLANK(input[1])) {
+            input = history_expand(input);
+            if (input == NULL) {
+                last_status = 1;
+                continue;
+            }
+            printf("%s\n", input);
+        }
+        if (interactive) {
+            history_begin_line(input);
+        }
+        if (trace_fd >= 0) {
+            trace_line_start = monotonic_ns();
+            trace_expand_ns = 0;
+        }
+
+        // Drop cached command paths if $PATH or its directories changed
+        path_cache_check();
+
+        // Parse the whole line in one pass
+        substitution_status = -1;
+        Pipeline *pipeline = parse_line(input);
+        if (pipeline == NULL) {
+            last_status = 2;
+            continue;
+        }
+        if (pipeline->num_commands == 0) {
+            continue;
+        }
+
+        // Here-document bodies come from the lines after this one
+        if (heredoc_read(pipeline, reader, interactive) == -1) {
+            last_status = 1;
+            continue;
+        }
+        time_prefix(pipeline);
+        if (with_prefix(pipeline) == -1) {
+            last_status = 2;
+            continue;
+        }
+        if (trace_fd >= 0) {
+            trace_parse_end = monotonic_ns();
+        }
+
+        // A line made only of NAME=value words sets shell variables
+        Command *first = &pipeline->commands[0];
+        if (pipeline->num_commands == 1 && !pipeline->background && first->redirects == NULL &&
+            first->argc > 0 && first->num_assignments == first->argc) {
+            for (int i = 0; i < first->argc; i++) {
+                char *value = strchr(first->argv[i], '=');
+                *value++ = '\0';
+                var_set(first->argv[i], value, 0);
+            }
+            last_status = substitution_status >= 0 ? substitution_status : 0;
+            if (trace_fd >= 0) {
+                trace_line(pipeline, "assignment", NULL, NULL, NULL, 0);
+            }
+            continue;
+        }
+
+        // Built-ins run in the shell itself when they are the whole line,
+        // redirections and all. "command NAME" skips the utility builtins,
+        // but not cd and the like, which have no external counterpart.
+        char **args = pipeline->commands[0].argv;
+        Builtin *builtin = NULL;
+        if (pipeline->num_commands == 1 && !pipeline->background && pipeline->with == NULL && args[0] != NULL) {
+            int bypass = strcmp(args[0], "command") == 0;
+            builtin = builtin_lookup(args[bypass]);
+            if (bypass && builtin != NULL && (builtin->flags & BUILTIN_UTILITY)) {
+                builtin = NULL;
+            }
+            args += bypass && builtin != NULL;
+        }
+        if (builtin == NULL) {
+            reader_sync(reader);
+            execute_pipeline(pipeline, NULL);
+            continue;
+        }
+
+        // A timed builtin is charged with the shell's own usage meanwhile
+        struct timespec start;
+        struct rusage before;
+        if (pipeline->timed) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            getrusage(RUSAGE_SELF, &before);
+        }
+
+        if (builtin->flags & BUILTIN_READS_INPUT) {
+            reader_sync(reader);
+        }
+        last_status = run_builtin(&pipeline->commands[0], builtin, args, NULL);
+
+        if (pipeline->timed) {
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            usage.ru_utime.tv_sec -= before.ru_utime.tv_sec;
+            usage.ru_utime.tv_usec -= before.ru_utime.tv_usec;
+            usage.ru_stime.tv_sec -= before.ru_stime.tv_sec;
+            usage.ru_stime.tv_usec -= before.ru_stime.tv_usec;
+            usage.ru_nvcsw -= before.ru_nvcsw;
+            usage.ru_nivcsw -= before.ru_nivcsw;
+            usage.ru_minflt -= before.ru_minflt;
+            usage.ru_majflt -= before.ru_majflt;
+            time_report(pipeline, elapsed_since(&start), &usage, &last_status, 1);
+        }
+        if (trace_fd >= 0) {
+            trace_line(pipeline, "builtin", NULL, NULL, NULL, 0);
+        }
+    }
+
+    history_finish_line();
+    fflush(stdout);
+    trace_flush();
+    arena_report(&line_arena);
+    return last_status;
+}
+
+// Fill the builtin lookup table, keyed by name like the variable table
+void builtin_table_init() {
+    for (Builtin *b = builtins; b->name != NULL; b++) {
+        size_t i = hash_string(b->name, strlen(b->name)) & (BUILTIN_TABLE_SIZE - 1);
+        while (builtin_table[i] != NULL) {
+            i = (i + 1) & (BUILTIN_TABLE_SIZE - 1);
+        }
+        builtin_table[i] = b;
+    }
+}
+
+// Find a builtin by name: one hash and usually one comparison
+Builtin *builtin_lookup(const char *name) {
+    if (name == NULL) {
+        return NULL;
+    }
+    size_t i = hash_string(name, strlen(name)) & (BUILTIN_TABLE_SIZE - 1);
+    for (; builtin_table[i] != NULL; i = (i + 1) & (BUILTIN_TABLE_SIZE - 1)) {
+        if (strcmp(builtin_table[i]->name, name) == 0) {
+            return builtin_table[i];
+        }
+    }
+    return NULL;
+}
+
+// Built-in command: exit [status], also spelled quit
+int quash_exit(char **args) {
+    shell_exiting = 1;
+    return args[1] != NULL ? atoi(args[1]) & 0xff : last_status;
+}
+
+// Write builtin output: into stdio's stdout in the shell itself, otherwise
+// into the thread's batch. A piece too large to batch goes out in the same
+// writev as the batch before it.
+void output_write(const char *data, size_t len) {
+    Output *out = builtin_output;
+    if (out == NULL) {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+    if (out->used + len > sizeof(out->buffer)) {
+        if (len >= sizeof(out->buffer) / 2) {
+            output_writev(out, data, len);
+            return;
+        }
+        output_writev(out, NULL, 0);
+    }
+    memcpy(out->buffer + out->used, data, len);
+    out->used += len;
+}
+
+// Write out the batch followed by len bytes of data with writev, retrying
+// short writes. After a failure the output is dropped and the error kept.
+void output_writev(Output *out, const char *data, size_t len) {
+    if (out->capture != NULL) {
+        strbuf_append(out->capture, out->buffer, out->used);
+        strbuf_append(out->capture, data, len);
+        out->used = 0;
+        return;
+    }
+    struct iovec iov[2] = {{out->buffer, out->used}, {(void *)data, len}};
+    int first = 0;
+    out->used = 0;
+    while (out->error == 0 && first < 2) {
+        ssize_t n = writev(out->fd, iov + first, 2 - first);
+        if (n == -1) {
+            if (errno != EINTR) {
+                out->error = errno;
+            }
+            continue;
+        }
+        for (; first < 2 && (size_t)n >= iov[first].iov_len; first++) {
+            n -= iov[first].iov_len;
+        }
+        if (first < 2) {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+}
+
+// printf into builtin output
+void output_format(const char *fmt, ...) {
+    Output *out = builtin_output;
+    va_list ap;
+    va_start(ap, fmt);
+    if (out == NULL) {
+        vprintf(fmt, ap);
+        va_end(ap);
+        return;
+    }
+    size_t room = sizeof(out->buffer) - out->used;
+    int n = vsnprintf(out->buffer + out->used, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n < room) {
+        out->used += n;
+        return;
+    }
+
+    // Didn't fit: format again, after the batch or on its own
+    char *text = malloc(n + 1);
+    if (text == NULL) {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(text, n + 1, fmt, ap);
+    va_end(ap);
+    output_write(text, n);
+    free(text);
+}
+
+// Send the thread's batch on its way
+void output_flush() {
+    if (builtin_output != NULL && builtin_output->used > 0) {
+        output_writev(builtin_output, NULL, 0);
+    }
+}
+
+// Whether builtin output has failed to be written, as to a closed pipe
+int output_failed() {
+    return builtin_output != NULL ? builtin_output->error != 0 : ferror(stdout);
+}
+
+// The descriptor builtin output goes to, for builtins that move data
+// themselves; whatever was written before is flushed first. -1 means the
+// data must go through output_write.
+int output_fd() {
+    if (builtin_output == NULL) {
+        fflush(stdout);
+        return STDOUT_FILENO;
+    }
+    output_flush();
+    return builtin_output->capture != NULL ? -1 : builtin_output->fd;
+}
+
+// Built-in commands: true and false
+int quash_true(char **args) {
+    (void)args;
+    return 0;
+}
+
+int quash_false(char **args) {
+    (void)args;
+    return 1;
+}
+
+// Read an integer operand of test, setting *error if it is not one
+int test_integer(const char *str, long long *value, int *error) {
+    char *end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (end == str || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "quash: test: %s: integer expression expected\n", str);
+        *error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// Whether op is one of test's unary operators
+int test_is_unary(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghLkprsStuwxOGnz", op[1]) != NULL;
+}
+
+// Whether op is one of test's binary operators
+int test_is_binary(const char *op) {
+    static const char *ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL
+    };
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Evaluate a unary test: string length, descriptor, or file attribute
+int test_unary(const char *op, const char *arg, int *error) {
+    struct stat st;
+    long long fd;
+    switch (op[1]) {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 't':
+        return test_integer(arg, &fd, error) && isatty((int)fd);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+
+    if (stat(arg, &st) == -1) {
+        return 0;
+    }
+    switch (op[1]) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    }
+    return 1;  // -e
+}
+
+// Evaluate a binary test: string comparison, integer comparison, or file
+// age and identity
+int test_binary(const char *left, const char *op, const char *right, int *error) {
+    if (op[0] != '-') {
+        int cmp = strcmp(left, right);
+        switch (op[0]) {
+        case '<': return cmp < 0;
+        case '>': return cmp > 0;
+        case '!': return cmp != 0;
+        }
+        return cmp == 0;
+    }
+
+    if ((op[1] == 'n' && op[2] == 't') || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+        struct stat a, b;
+        int have_a = stat(left, &a) == 0;
+        int have_b = stat(right, &b) == 0;
+        if (op[1] == 'e') {
+            return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        if (!have_a || !have_b) {
+            return op[1] == 'n' ? have_a : have_b;
+        }
+        struct timespec ta = ST_MTIM(a), tb = ST_MTIM(b);
+        if (op[1] == 'o') {
+            struct timespec t = ta;
+            ta = tb;
+            tb = t;
+        }
+        return ta.tv_sec > tb.tv_sec || (ta.tv_sec == tb.tv_sec && ta.tv_nsec > tb.tv_nsec);
+    }
+
+    long long x, y;
+    if (!test_integer(left, &x, error) || !test_integer(right, &y, error)) {
+        return 0;
+    }
+    if (op[1] == 'e') return x == y;
+    if (op[1] == 'n') return x != y;
+    if (op[1] == 'l') return op[2] == 't' ? x < y : x <= y;
+    return op[2] == 't' ? x > y : x >= y;
+}
+
+// expr: and-expr [-o and-expr]...
+int test_or(char **args, int *pos, int end, int *error) {
+    int result = test_and(args, pos, end, error);
+    while (!*error && *pos < end && strcmp(args[*pos], "-o") == 0) {
+        (*pos)++;
+        result = test_and(args, pos, end, error) || result;
+    }
+    return result;
+}
+
+// and-expr: not-expr [-a not-expr]...
+int test_and(char **args, int *pos, int end, int *error) {
+    int result = test_not(args, pos, end, error);
+    while (!*error && *pos < end && strcmp(args[*pos], "-a") == 0) {
+        (*pos)++;
+        result = test_not(args, pos, end, error) && result;
+    }
+    return result;
+}
+
+// not-expr: ! not-expr | primary
+int test_not(char **args, int *pos, int end, int *error) {
+    if (*pos < end && strcmp(args[*pos], "!") == 0) {
+        (*pos)++;
+        return !test_not(args, pos, end, error);
+    }
+    return test_primary(args, pos, end, error);
+}
+
+// primary: ( expr ) | string op string | -op string | string
+int test_primary(char **args, int *pos, int end, int *error) {
+    if (*pos >= end) {
+        fprintf(stderr, "quash: test: argument expected\n");
+        *error = 1;
+        return 0;
+    }
+    char *arg = args[*pos];
+    if (*pos + 2 < end && test_is_binary(args[*pos + 1])) {
+        *pos += 3;
+        return test_binary(arg, args[*pos - 2], args[*pos - 1], error);
+    }
+    if (strcmp(arg, "(") == 0) {
+        (*pos)++;
+        int result = test_or(args, pos, end, error);
+        if (!*error && (*pos >= end || strcmp(args[*pos], ")") != 0)) {
+            fprintf(stderr, "quash: test: ')' expected\n");
+            *error = 1;
+        }
+        (*pos)++;
+        return result;
+    }
+    if (*pos + 1 < end && test_is_unary(arg)) {
+        *pos += 2;
+        return test_unary(arg, args[*pos - 1], error);
+    }
+    (*pos)++;
+    return arg[0] != '\0';
+}
+
+// Evaluate args[pos..end). Up to four arguments are read by the POSIX
+// rules, which settle cases like "test ! = x" that a grammar cannot; longer
+// expressions are parsed with -o binding loosest, then -a, then !.
+int test_eval(char **args, int pos, int end, int *error) {
+    int n = end - pos;
+    if (n == 0) {
+        return 0;
+    }
+    if (n == 1) {
+        return args[pos][0] != '\0';
+    }
+    if (n == 2) {
+        if (strcmp(args[pos], "!") == 0) {
+            return !test_eval(args, pos + 1, end, error);
+        }
+        if (test_is_unary(args[pos])) {
+            return test_unary(args[pos], args[pos + 1], error);
+        }
+    } else if (n == 3) {
+        if (test_is_binary(args[pos + 1])) {
+            return test_binary(args[pos], args[pos + 1], args[pos + 2], error);
+        }
+        if (strcmp(args[pos], "!") == 0) {
+            return !test_eval(args, pos + 1, end, error);
+        }
+        if (strcmp(args[pos], "(") == 0 && strcmp(args[pos + 2], ")") == 0) {
+            return test_eval(args, pos + 1, pos + 2, error);
+        }
+    } else if (n == 4) {
+        if (strcmp(args[pos], "!") == 0) {
+            return !test_eval(args, pos + 1, end, error);
+        }
+        if (strcmp(args[pos], "(") == 0 && strcmp(args[pos + 3], ")") == 0) {
+            return test_eval(args, pos + 1, pos + 3, error);
+        }
+    }
+
+    int result = test_or(args, &pos, end, error);
+    if (!*error && pos < end) {
+        fprintf(stderr, "quash: test: %s: unexpected argument\n", args[pos]);
+        *error = 1;
+    }
+    return result;
+}
+
+// Built-in command: test EXPRESSION, or [ EXPRESSION ]. Status 0 if the
+// expression is true, 1 if false, 2 on a malformed expression.
+int quash_test(char **args) {
+    int end = 0;
+    while (args[end] != NULL) {
+        end++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[end - 1], "]") != 0) {
+            fprintf(stderr, "quash: [: missing ']'\n");
+            return 2;
+        }
+        end--;
+    }
+
+    int error = 0;
+    int result = test_eval(args, 1, end, &error);
+    return error ? 2 : !result;
+}
+
+
+// Decode the backslash escape at p onto out + *len, returning the number of
+// bytes it takes up. The result is never longer than the escape. In a %b
+// argument octal escapes are written \0NNN; \c sets *stop, ending all
+// output.
+int printf_escape(const char *p, char *out, size_t *len, int in_b, int *stop) {
+    const char *start = p++;
+    char c;
+    switch (*p) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'e': c = 033; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case '\\': c = '\\'; break;
+    case '"': c = '"'; break;
+    case '\'': c = '\''; break;
+    case 'c':
+        *stop = 1;
+        return 2;
+    case 'x':
+        if (!isxdigit((unsigned char)p[1])) {
+            out[(*len)++] = '\\';
+            out[(*len)++] = 'x';
+            return 2;
+        }
+        c = 0;
+        for (int i = 0; i < 2 && isxdigit((unsigned char)p[1]); i++) {
+            p++;
+            c = c * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
+        }
+        out[(*len)++] = c;
+        return p + 1 - start;
+    case '\0':
+        out[(*len)++] = '\\';
+        return 1;
+    default:
+        if (*p < '0' || *p > '7') {
+            out[(*len)++] = start[0];
+            out[(*len)++] = start[1];
+            return 2;
+        }
+        if (in_b && *p == '0') {
+            p++;
+        }
+        c = 0;
+        for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++, p++) {
+            c = c * 8 + (*p - '0');
+        }
+        out[(*len)++] = c;
+        return p - start;
+    }
+    out[(*len)++] = c;
+    return 2;
+}
+
+// Read a numeric printf argument: decimal, octal, hex, or 'c for the
+// character's value. Sets *status to 1 (keeping the value read so far)
+// if the argument is not entirely a number.
+long long printf_integer(const char *arg, int *status) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (errno == ERANGE && arg[0] != '-') {
+        errno = 0;
+        value = (long long)strtoull(arg, &end, 0);
+    }
+    if (errno == ERANGE) {
+        fprintf(stderr, "quash: printf: %s: %s\n", arg, strerror(errno));
+        *status = 1;
+    } else if (end == arg || *end != '\0') {
+        fprintf(stderr, "quash: printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+// Built-in command: printf FORMAT [argument ...]. The format is reused
+// while arguments remain; missing arguments read as empty or zero.
+int quash_printf(char **args) {
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "--") == 0) {
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "quash: printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *format = args[i];
+    char **argp = args + i + 1;
+    int status = 0;
+    int stop = 0;
+    int consumed;
+
+    do {
+        consumed = 0;
+        const char *p = format;
+        while (*p != '\0' && !stop) {
+            if (*p == '\\') {
+                char c[2];
+                size_t len = 0;
+                p += printf_escape(p, c, &len, 0, &stop);
+                output_write(c, len);
+                continue;
+            }
+            if (*p != '%') {
+                size_t len = strcspn(p, "\\%");
+                output_write(p, len);
+                p += len;
+                continue;
+            }
+            if (p[1] == '%') {
+                output_write("%", 1);
+                p += 2;
+                continue;
+            }
+
+            // Rebuild the directive with * widths filled in, then hand it
+            // to the C library with a length modifier matching the argument
+            char spec[96];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while (*p != '\0' && strchr("-+ #0", *p) != NULL && n < 16) {
+                spec[n++] = *p++;
+            }
+            if (*p == '*') {
+                n += snprintf(spec + n, 24, "%d", (int)printf_integer(*argp ? *argp : "0", &status));
+                argp += *argp != NULL;
+                consumed = 1;
+                p++;
+            } else {
+                while (isdigit((unsigned char)*p) && n < 40) {
+                    spec[n++] = *p++;
+                }
+            }
+            if (*p == '.') {
+                p++;
+                int precision = 0;
+                if (*p == '*') {
+                    precision = (int)printf_integer(*argp ? *argp : "0", &status);
+                    argp += *argp != NULL;
+                    consumed = 1;
+                    p++;
+                } else {
+                    precision = atoi(p);
+                    while (isdigit((unsigned char)*p)) {
+                        p++;
+                    }
+                }
+                if (precision >= 0) {
+                    n += snprintf(spec + n, 24, ".%d", precision);
+                }
+            }
+            while (isdigit((unsigned char)*p)) {
+                p++;  // Width digits past what spec holds
+            }
+
+            char conversion = *p;
+            if (conversion == '\0') {
+                fprintf(stderr, "quash: printf: %s: missing format character\n", format);
+                status = 1;
+                break;
+            }
+            p++;
+            const char *arg = *argp ? *argp : "";
+            if (strchr("diouxXcsbeEfFgGaA", conversion) == NULL) {
+                fprintf(stderr, "quash: printf: %c: invalid format character\n", conversion);
+                status = 1;
+                stop = 1;
+                break;
+            }
+            argp += *argp != NULL;
+            consumed = 1;
+
+            if (conversion == 'd' || conversion == 'i') {
+                strcpy(spec + n, "lld");
+                output_format(spec, printf_integer(*arg ? arg : "0", &status));
+            } else if (strchr("ouxX", conversion) != NULL) {
+                snprintf(spec + n, 4, "ll%c", conversion);
+                output_format(spec, (unsigned long long)printf_integer(*arg ? arg : "0", &status));
+            } else if (conversion == 'c') {
+                char c[2] = {arg[0], '\0'};
+                strcpy(spec + n, "s");
+                output_format(spec, c);
+            } else if (conversion == 's' && n == 1) {
+                output_write(arg, strlen(arg));
+            } else if (conversion == 's') {
+                strcpy(spec + n, "s");
+                output_format(spec, arg);
+            } else if (conversion == 'b') {
+                char *expanded = malloc(strlen(arg) + 1);
+                size_t len = 0;
+                if (expanded == NULL) {
+                    perror("quash: printf");
+                    return 1;
+                }
+                for (const char *q = arg; *q != '\0' && !stop;) {
+                    if (*q == '\\') {
+                        q += printf_escape(q, expanded, &len, 1, &stop);
+                    } else {
+                        expanded[len++] = *q++;
+                    }
+                }
+                expanded[len] = '\0';
+                if (n == 1) {
+                    output_write(expanded, len);  // Keeps any NUL bytes
+                } else {
+                    strcpy(spec + n, "s");
+                    output_format(spec, expanded);
+                }
+                free(expanded);
+            } else {
+                char *end = NULL;
+                double value = (arg[0] == '\'' || arg[0] == '"') ? (unsigned char)arg[1] : strtod(*arg ? arg : "0", &end);
+                if (arg[0] != '\'' && arg[0] != '"' && *arg && (end == arg || *end != '\0')) {
+                    fprintf(stderr, "quash: printf: %s: invalid number\n", arg);
+                    status = 1;
+                }
+                snprintf(spec + n, 2, "%c", conversion);
+                output_format(spec, value);
+            }
+        }
+    } while (consumed && *argp != NULL && !stop && !output_failed());
+
+    return status;
+}
+
+// Copy fd to builtin output through cat's line formatting. *state counts
+// the newlines since the last other character (so it is nonzero at the
+// start of a line) and *line numbers the lines; both carry across files.
+// Returns 0, or -1 on a read error.
+int cat_copy(int fd, int *state, long long *line, int flags) {
+    char in[READ_BUFFER_SIZE];
+    char out[READ_BUFFER_SIZE + 64];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fd, in, sizeof(in))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            output_write(out, len);
+            return -1;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (len > READ_BUFFER_SIZE) {
+                output_write(out, len);
+                len = 0;
+            }
+            unsigned char c = in[i];
+            if (c == '\n') {
+                if (*state >= 2 && (flags & CAT_SQUEEZE)) {
+                    continue;
+                }
+                if (*state >= 1 && (flags & CAT_NUMBER)) {
+                    len += snprintf(out + len, 32, "%6lld\t", ++*line);
+                }
+                if (flags & CAT_ENDS) {
+                    out[len++] = '$';
+                }
+                out[len++] = '\n';
+                (*state)++;
+                continue;
+            }
+            if (*state >= 1 && (flags & (CAT_NUMBER | CAT_NUMBER_NONBLANK))) {
+                len += snprintf(out + len, 32, "%6lld\t", ++*line);
+            }
+            *state = 0;
+            if (c == '\t') {
+                if (flags & CAT_TABS) {
+                    out[len++] = '^';
+                    c = 'I';
+                }
+            } else if (flags & CAT_NONPRINTING) {
+                if (c >= 128) {
+                    out[len++] = 'M';
+                    out[len++] = '-';
+                    c -= 128;
+                }
+                if (c < 32) {
+                    out[len++] = '^';
+                    c += 64;
+                } else if (c == 127) {
+                    out[len++] = '^';
+                    c = '?';
+                }
+            }
+            out[len++] = c;
+        }
+    }
+    output_write(out, len);
+    return 0;
+}
+
+// Built-in command: cat [-AbeEnstTuv] [file ...], where - is standard
+// input. Without formatting options the files are copied straight through,
+// by sendfile or splice where the kernel allows it.
+int quash_cat(char **args) {
+    int flags = 0;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = args[i] + 1; *o != '\0'; o++) {
+            switch (*o) {
+            case 'A': flags |= CAT_NONPRINTING | CAT_ENDS | CAT_TABS; break;
+            case 'b': flags |= CAT_NUMBER_NONBLANK; break;
+            case 'e': flags |= CAT_NONPRINTING | CAT_ENDS; break;
+            case 'E': flags |= CAT_ENDS; break;
+            case 'n': flags |= CAT_NUMBER; break;
+            case 's': flags |= CAT_SQUEEZE; break;
+            case 't': flags |= CAT_NONPRINTING | CAT_TABS; break;
+            case 'T': flags |= CAT_TABS; break;
+            case 'u': break;
+            case 'v': flags |= CAT_NONPRINTING; break;
+            default:
+                fprintf(stderr, "quash: cat: invalid option -- '%c'\n", *o);
+                return 1;
+            }
+        }
+    }
+    if (flags & CAT_NUMBER_NONBLANK) {
+        flags &= ~CAT_NUMBER;
+    }
+
+    static char *stdin_only[] = {"-", NULL};
+    char **files = args[i] != NULL ? args + i : stdin_only;
+    int status = 0;
+    int state = 1;
+    long long line = 0;
+    for (; *files != NULL && !output_failed(); files++) {
+        int fd = builtin_input;
+        if (strcmp(*files, "-") != 0) {
+            fd = open(*files, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                fprintf(stderr, "quash: cat: %s: %s\n", *files, strerror(errno));
+                status = 1;
+                continue;
+            }
+        }
+
+        int result;
+        if (flags != 0) {
+            result = cat_copy(fd, &state, &line, flags);
+        } else {
+            result = 0;
+            int out = output_fd();
+            ssize_t n = -1;
+            errno = ENOSYS;
+#ifdef __linux__
+            while (out >= 0 && (n = sendfile(out, fd, NULL, 1 << 30)) > 0) {
+            }
+            if (out >= 0 && n == -1 && errno == EINVAL) {
+                // Input from a pipe moves by splice
+                while ((n = splice(fd, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE)) > 0) {
+                }
+            }
+#endif
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                // Not a file sendfile can read from
+                char buffer[READ_BUFFER_SIZE];
+                while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+                    if (n == -1) {
+                        if (errno == EINTR) continue;
+                        break;
+                    }
+                    if (out < 0) {
+                        output_write(buffer, n);
+                    }
+                    if (out < 0 ? output_failed() : write_all(out, buffer, n) == -1) {
+                        if (out < 0) {
+                            errno = builtin_output->error;
+                        }
+                        n = -1;
+                        break;
+                    }
+                }
+            }
+            if (n == -1) {
+                result = -1;
+            }
+        }
+        if (result == -1) {
+            // A reader that went away needs no message
+            if (errno != EPIPE) {
+                fprintf(stderr, "quash: cat: %s: %s\n", *files, strerror(errno));
+            }
+            status = 1;
+        }
+        if (fd != builtin_input) {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+// Built-in command: basename [-az] [-s SUFFIX] NAME [SUFFIX], or with -a
+// or -s any number of names. -z ends each name with NUL, not newline.
+int quash_basename(char **args) {
+    int multiple = 0;
+    char terminator = '\n';
+    const char *suffix = NULL;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = args[i] + 1; *o != '\0'; o++) {
+            if (*o == 'a') {
+                multiple = 1;
+            } else if (*o == 'z') {
+                terminator = '\0';
+            } else if (*o == 's') {
+                suffix = o[1] != '\0' ? o + 1 : args[++i];
+                if (suffix == NULL) {
+                    fprintf(stderr, "quash: basename: option requires an argument -- 's'\n");
+                    return 1;
+                }
+                multiple = 1;
+                break;
+            } else {
+                fprintf(stderr, "quash: basename: invalid option -- '%c'\n", *o);
+                return 1;
+            }
+        }
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "quash: basename: missing operand\n");
+        return 1;
+    }
+    if (!multiple && args[i + 1] != NULL) {
+        if (args[i + 2] != NULL) {
+            fprintf(stderr, "quash: basename: extra operand '%s'\n", args[i + 2]);
+            return 1;
+        }
+        suffix = args[i + 1];
+    }
+
+    for (; args[i] != NULL; i++) {
+        const char *name = args[i];
+        size_t end = strlen(name);
+        while (end > 1 && name[end - 1] == '/') {
+            end--;
+        }
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '/') {
+            start--;
+        }
+        if (start == end && end > 0) {
+            start = end - 1;  // All slashes
+        }
+        size_t suffix_len = suffix != NULL ? strlen(suffix) : 0;
+        if (suffix_len > 0 && suffix_len < end - start && memcmp(name + end - suffix_len, suffix, suffix_len) == 0) {
+            end -= suffix_len;
+        }
+        output_write(name + start, end - start);
+        output_write(&terminator, 1);
+        if (!multiple) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Built-in command: dirname [-z] NAME ...
+int quash_dirname(char **args) {
+    char terminator = '\n';
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-z") != 0) {
+            fprintf(stderr, "quash: dirname: invalid option -- '%c'\n", args[i][1]);
+            return 1;
+        }
+        terminator = '\0';
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "quash: dirname: missing operand\n");
+        return 1;
+    }
+
+    for (; args[i] != NULL; i++) {
+        const char *name = args[i];
+        size_t end = strlen(name);
+        while (end > 1 && name[end - 1] == '/') {
+            end--;
+        }
+        while (end > 0 && name[end - 1] != '/') {
+            end--;
+        }
+        while (end > 1 && name[end - 1] == '/') {
+            end--;
+        }
+        if (end == 0) {
+            output_write(".", 1);
+        } else {
+            output_write(name, end);
+        }
+        output_write(&terminator, 1);
+    }
+    return 0;
+}
+
+// Format one value of a non-integer sequence: through the -f format, in
+// exponent form when decimals is negative, or with that many decimals
+int seq_format(char *text, size_t size, const char *format, int decimals, long double value) {
+    int len;
+    if (format != NULL) {
+        len = snprintf(text, size, format, (double)value);
+    } else if (decimals < 0) {
+        len = snprintf(text, size, "%Lg", value);
+    } else {
+        len = snprintf(text, size, "%.*Lf", decimals, value);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// Write the formatted number in text to builtin output, with leading zeros up to
+// width after any sign
+void seq_write(const char *text, int len, int width) {
+    if (len < width && (text[0] == '-' || text[0] == '+')) {
+        output_write(text, 1);
+        text++;
+        len--;
+        width--;
+    }
+    static const char zeros[] = "0000000000000000";
+    for (int pad = width - len; pad > 0; pad -= sizeof(zeros) - 1) {
+        output_write(zeros, pad < (int)sizeof(zeros) - 1 ? pad : (int)sizeof(zeros) - 1);
+    }
+    output_write(text, len);
+}
+
+// Built-in command: seq [-w] [-f FORMAT] [-s SEPARATOR] [FIRST [INCREMENT]] LAST.
+// Integer sequences are formatted by hand; others go through printf with
+// as many decimals as FIRST and INCREMENT have.
+int quash_seq(char **args) {
+    const char *separator = "\n";
+    const char *format = NULL;
+    int equal_width = 0;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        char o = args[i][1];
+        if (isdigit((unsigned char)o) || o == '.') {
+            break;  // A negative number
+        }
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (o == 'w' && args[i][2] == '\0') {
+            equal_width = 1;
+        } else if (o == 's' || o == 'f') {
+            const char *value = args[i][2] != '\0' ? args[i] + 2 : args[++i];
+            if (value == NULL) {
+                fprintf(stderr, "quash: seq: option requires an argument -- '%c'\n", o);
+                return 1;
+            }
+            *(o == 's' ? &separator : &format) = value;
+        } else {
+            fprintf(stderr, "quash: seq: invalid option -- '%c'\n", o);
+            return 1;
+        }
+    }
+
+    int num_operands = 0;
+    while (args[i + num_operands] != NULL) {
+        num_operands++;
+    }
+    if (num_operands == 0) {
+        fprintf(stderr, "quash: seq: missing operand\n");
+        return 1;
+    }
+    if (num_operands > 3) {
+        fprintf(stderr, "quash: seq: extra operand '%s'\n", args[i + 3]);
+        return 1;
+    }
+    if (format != NULL) {
+        int directives = 0;
+        for (const char *p = format; *p != '\0'; p++) {
+            if (*p != '%') {
+                continue;
+            }
+            if (p[1] == '%') {
+                p++;
+                continue;
+            }
+            p += 1 + strspn(p + 1, "-+ #0'123456789.");
+            if (*p == '\0' || strchr("eEfFgGaA", *p) == NULL) {
+                directives = -1;
+                break;
+            }
+            directives++;
+        }
+        if (directives != 1) {
+            fprintf(stderr, "quash: seq: format '%s' needs exactly one floating point directive\n", format);
+            return 1;
+        }
+    }
+
+    // Operands in order FIRST, INCREMENT, LAST, with the defaults of 1
+    char *operands[3] = {"1", "1", args[i + num_operands - 1]};
+    if (num_operands >= 2) {
+        operands[0] = args[i];
+    }
+    if (num_operands == 3) {
+        operands[1] = args[i + 1];
+    }
+    long double values[3];
+    int integers = format == NULL;
+    int decimals = 0;
+    for (int k = 0; k < 3; k++) {
+        char *end;
+        errno = 0;
+        values[k] = strtold(operands[k], &end);
+        if (end == operands[k] || *end != '\0' || values[k] != values[k]) {
+            fprintf(stderr, "quash: seq: invalid floating point argument: '%s'\n", operands[k]);
+            return 1;
+        }
+        const char *dot = strchr(operands[k], '.');
+        if (dot != NULL || strpbrk(operands[k], "eExXiInN") != NULL || errno == ERANGE || values[k] > 1e18L || values[k] < -1e18L) {
+            integers = 0;
+        }
+        if (strpbrk(operands[k], "eE") != NULL) {
+            decimals = -1;
+        } else if (dot != NULL && k < 2 && decimals >= 0 && (int)strlen(dot + 1) > decimals) {
+            decimals = strlen(dot + 1);
+        }
+    }
+    if (values[1] == 0) {
+        fprintf(stderr, "quash: seq: invalid Zero increment value: '%s'\n", operands[1]);
+        return 1;
+    }
+
+    char text[512];
+    size_t separator_len = strlen(separator);
+    int width = 0;
+    long long count = 0;
+    if (integers) {
+        long long first = (long long)values[0], step = (long long)values[1], last = (long long)values[2];
+        if (equal_width) {
+            int a = snprintf(text, sizeof(text), "%lld", first);
+            int b = snprintf(text, sizeof(text), "%lld", last);
+            width = a > b ? a : b;
+        }
+        for (long long v = first; step > 0 ? v <= last : v >= last; v += step) {
+            if (count++ > 0) {
+                output_write(separator, separator_len);
+            }
+            // Digits from the right, then the sign
+            char *p = text + sizeof(text);
+            unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+            do {
+                *--p = '0' + u % 10;
+                u /= 10;
+            } while (u != 0);
+            if (v < 0) {
+                *--p = '-';
+            }
+            seq_write(p, text + sizeof(text) - p, width);
+            if (output_failed() || (step > 0 ? v > LLONG_MAX - step : v < LLONG_MIN - step)) {
+                break;
+            }
+        }
+    } else {
+        if (equal_width && format == NULL) {
+            int a = seq_format(text, sizeof(text), NULL, decimals, values[0]);
+            int b = seq_format(text, sizeof(text), NULL, decimals, values[2]);
+            width = a > b ? a : b;
+        }
+        char last[sizeof(text)];
+        seq_format(last, sizeof(last), format, decimals, values[2]);
+        long double step = values[1];
+        for (int done = 0; !done && !output_failed(); count++) {
+            long double v = values[0] + count * step;
+            int len = seq_format(text, sizeof(text), format, decimals, v);
+            if (step > 0 ? v > values[2] : v < values[2]) {
+                // Rounding in the step can carry the final value just past
+                // LAST; it still counts if it prints the same
+                if (format != NULL || strcmp(text, last) != 0) {
+                    break;
+                }
+                done = 1;
+            }
+            if (count > 0) {
+                output_write(separator, separator_len);
+            }
+            seq_write(text, len, width);
+        }
+    }
+    if (count > 0) {
+        output_write("\n", 1);
+    }
+    return output_failed() ? 1 : 0;
+}
+
+
+
+
+
+
+// Built-in command: pwd
+int quash_pwd(char **args) {
+    char cwd[PATH_MAX + 1];
+    if (getcwd(cwd, sizeof(cwd) - 1) != NULL) {
+        size_t len = strlen(cwd);
+        cwd[len++] = '\n';
+        output_write(cwd, len);
+        return 0;
+    }
+    perror("quash: getcwd failed");
+    return 1;
+}
+
+
+// Built-in command: echo
+int quash_echo(char **args) {
+    // Quotes were already removed and variables expanded by the parser
+    for (int i = 1; args[i] != NULL; i++) {
+        output_write(args[i], strlen(args[i]));
+        output_write(args[i + 1] != NULL ? " " : "\n", 1);
+    }
+    if (args[1] == NULL) {
+        output_write("\n", 1);
+    }
+    return 0;
+}
+
+
+
+
+
+
+
+
+// Built-in command: export NAME=value | NAME ...
+int quash_export(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "quash: export: missing argument\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        // Split the argument at the first '=' sign to get the variable name and value
+        char *value = strchr(args[i], '=');
+        if (value == args[i]) {
+            fprintf(stderr, "quash: export: invalid syntax\n");
+            status = 1;
+            continue;
+        }
+
+        if (value == NULL) {
+            // Export an existing shell variable as it is
+            if (var_export(args[i]) == -1) {
+                fprintf(stderr, "quash: export: %s: not set\n", args[i]);
+                status = 1;
+            }
+            continue;
+        }
+
+        *value++ = '\0';
+        var_set(args[i], value, 1);
+    }
+    return status;
+}
+
+// Built-in command: unset NAME ...
+int quash_unset(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        var_unset(args[i]);
+    }
+    return 0;
+}
+
+
+
+// Built-in command: hash [-r] [name ...]
+int quash_hash(char **args) {
+    if (args[1] == NULL) {
+        // List the cached commands
+        if (path_cache_count == 0) {
+            printf("quash: hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < path_cache_size; i++) {
+            if (path_cache[i].name != NULL) {
+                printf("%4lu\t%s\n", path_cache[i].hits, path_cache[i].path);
+            }
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0) {
+        // Forget every remembered location
+        path_cache_clear();
+        return 0;
+    }
+
+    // Pre-warm the cache with the given commands
+    int status = 0;
+    path_cache_check();
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strchr(args[i], '/') != NULL || path_cache_resolve(args[i], 0) == NULL) {
+            fprintf(stderr, "quash: hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+
+// Function to handle built-in cd command
+int quash_cd(char **args) {
+    char *dir;
+
+    if (args[1] == NULL) {
+        // If no directory is specified, change to the HOME directory
+        dir = var_get("HOME");
+        if (dir == NULL) {
+            fprintf(stderr, "quash: cd: HOME environment variable not set\n");
+            return 1;
+        }
+    } else {
+        dir = args[1];
+    }
+
+    // Attempt to change the directory
+    if (chdir(dir) != 0) {
+        perror("quash: cd");
+        return 1;
+    }
+
+    // Get the new current directory and update PWD
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        var_set("PWD", cwd, 0);  // Update the PWD variable
+        printf("%s\n", cwd);    // Print the new current directory
+    } else {
+        perror("quash: cd: getcwd failed");
+    }
+    return 0;
+}
+
+
+// Find the pid map slot for pid, or the first free slot if it is not there
+JobPidEntry *job_pid_slot(JobPidEntry *table, size_t size, pid_t pid) {
+    size_t mask = size - 1;
+    size_t i = ((size_t)pid * 2654435761UL) & mask;
+    JobPidEntry *free_slot = NULL;
+    while (table[i].pid != 0) {
+        if (table[i].pid == pid) {
+            return &table[i];
+        }
+        if (table[i].pid == -1 && free_slot == NULL) {
+            free_slot = &table[i];  // Tombstone
+        }
+        i = (i + 1) & mask;
+    }
+    return free_slot ? free_slot : &table[i];
+}
+
+// Rehash the pid map into a table twice the size, dropping tombstones
+void job_pid_map_grow() {
+    size_t new_size = job_pid_map_size ? job_pid_map_size * 2 : JOB_TABLE_INITIAL_SIZE;
+    JobPidEntry *new_table = calloc(new_size, sizeof(JobPidEntry));
+    if (new_table == NULL) {
+        perror("quash: calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < job_pid_map_size; i++) {
+        if (job_pid_map[i].pid > 0) {
+            *job_pid_slot(new_table, new_size, job_pid_map[i].pid) = job_pid_map[i];
+        }
+    }
+    free(job_pid_map);
+    job_pid_map = new_table;
+    job_pid_map_size = new_size;
+    job_pid_map_used = num_jobs;
 }
 
-char *expand_env_var_in_string(char *arg) {
-    char *result = malloc(strlen(arg) * 2 + 1);  // Allocate more than needed for safety
-    if (result == NULL) {
-        perror("malloc failed");
+// Look up a background job by the pid it was started with
+Job *find_job_by_pid(pid_t pid) {
+    if (job_pid_map_size == 0 || pid <= 0) {
         return NULL;
     }
+    JobPidEntry *entry = job_pid_slot(job_pid_map, job_pid_map_size, pid);
+    return entry->pid == pid ? entry->job : NULL;
+}
 
-    result[0] = '\0';  // Initialize the result string
-
-    char *ptr = arg;  // Pointer to traverse the input string
-    while (*ptr != '\0') {
-        if (*ptr == '$') {
-            ptr++;  // Skip the '$'
-            char env_var_name[100];
-            int i = 0;
-
-            // Extract the environment variable name (letters, digits, and underscores)
-            while (isalnum(*ptr) || *ptr == '_') {
-                if (i >= sizeof(env_var_name) - 1) break;  // Ensure no overflow
-                env_var_name[i++] = *ptr++;
-            }
-            env_var_name[i] = '\0';  // Null-terminate the environment variable name
+// Look up a background job by its job id
+Job *find_job_by_id(int job_id) {
+    if (job_id < 1 || job_id > max_job_id) {
+        return NULL;
+    }
+    return job_slots[job_id - 1];
+}
 
-            // Get the value of the environment variable
-            char *env_value = getenv(env_var_name);
-            if (env_value != NULL) {
-                strcat(result, env_value);  // Append the environment variable's value to the result
-            } else {
-                strcat(result, "$");        // Append the '$' back if the variable doesn't exist
-                strcat(result, env_var_name);
-            }
-        } else {
-            // Append characters that are not part of environment variables
-            strncat(result, ptr, 1);
-            ptr++;
+// Function to add a background job. Like other shells, the new job gets
+// the id after the highest one in use, so ids are reused once the jobs at
+// the top of the table have finished.
+Job *add_job(pid_t pid, const char *command) {
+    int job_id = max_job_id + 1;
+    if (job_id > job_slots_cap) {
+        int cap = job_slots_cap ? job_slots_cap * 2 : JOB_TABLE_INITIAL_SIZE;
+        Job **slots = realloc(job_slots, cap * sizeof(Job *));
+        if (slots == NULL) {
+            perror("quash: realloc failed");
+            return NULL;
         }
+        memset(slots + job_slots_cap, 0, (cap - job_slots_cap) * sizeof(Job *));
+        job_slots = slots;
+        job_slots_cap = cap;
+    }
+    if ((job_pid_map_used + 1) * 10 >= job_pid_map_size * 7) {
+        job_pid_map_grow();
     }
 
-    return result;
+    Job *job = malloc(sizeof(Job));
+    char *text = strdup(command);
+    if (job == NULL || text == NULL) {
+        perror("quash: malloc failed");
+        free(job);
+        free(text);
+        return NULL;
+    }
+    job->job_id = job_id;
+    job->pid = pid;
+    job->command = text;
+    job->settings = NULL;
+    job->pids = NULL;
+    job->num_pids = 0;
+
+    job_slots[job_id - 1] = job;
+    max_job_id = job_id;
+    num_jobs++;
+
+    JobPidEntry *entry = job_pid_slot(job_pid_map, job_pid_map_size, pid);
+    if (entry->pid == 0) {
+        job_pid_map_used++;
+    }
+    entry->pid = pid;
+    entry->job = job;
+    return job;
 }
 
+// Function to remove a job when it finishes
+void remove_job(pid_t pid) {
+    Job *job = find_job_by_pid(pid);
+    if (job == NULL) {
+        return;
+    }
 
-char *expand_env_var_in_string_2(char *arg) {
-    char *result = malloc(strlen(arg) + 1);
-    char *dollar_sign = strchr(arg, '$');  // Find the '$' symbol in the string
-
-    if (dollar_sign != NULL) {
-        // Extract the environment variable name (starts after '$')
-        char env_var_name[100];
-        int i = 0;
-        dollar_sign++;  // Move past the '$'
+    JobPidEntry *entry = job_pid_slot(job_pid_map, job_pid_map_size, pid);
+    entry->pid = -1;  // Tombstone
+    entry->job = NULL;
 
-        // Extract the environment variable name (letters, digits, and underscores)
-        while (dollar_sign[i] != '/' && dollar_sign[i] != '\0' && i < sizeof(env_var_name) - 1) {
-            env_var_name[i] = dollar_sign[i];
-            i++;
-        }
-        env_var_name[i] = '\0';  // Null-terminate the environment variable name
-
-        // Get the value of the environment variable
-        char *env_value = getenv(env_var_name);
-        if (env_value != NULL) {
-            // Copy the part before the '$'
-            strncpy(result, arg, dollar_sign - arg - 1);
-            result[dollar_sign - arg - 1] = '\0';  // Null-terminate the result so far
-            // Concatenate the expanded environment variable value
-            strcat(result, env_value);
-            // Concatenate the rest of the string after the environment variable
-            strcat(result, dollar_sign + strlen(env_var_name));
-        } else {
-            fprintf(stderr, "quash: %s: environment variable not set\n", env_var_name);
-            free(result);
-            return NULL;
-        }
-    } else {
-        // If there's no '$', return the original string
-        strcpy(result, arg);
+    job_slots[job->job_id - 1] = NULL;
+    while (max_job_id > 0 && job_slots[max_job_id - 1] == NULL) {
+        max_job_id--;
     }
+    num_jobs--;
 
-    return result;
+    free(job->command);
+    free(job->settings);
+    free(job->pids);
+    free(job);
 }
 
+// Function to print all background jobs, in job id order
+int quash_jobs(char **args) {
+    for (int i = 0; i < max_job_id; i++) {
+        Job *job = job_slots[i];
+        if (job != NULL && job->settings != NULL) {
+            output_format("[%d] %d with %s %s &\n", job->job_id, job->pid, job->settings, job->command);
+        } else if (job != NULL) {
+            output_format("[%d] %d %s &\n", job->job_id, job->pid, job->command);
+        }
+    }
+    return 0;
+}
 
-// Tokenize command correctly with environment variable expansion
-void tokenize_command(char *command, char **args) {
-    int i = 0;
-    char *token;
-
-    // Tokenize based on spaces, but handle quotes and environment variables properly
-    while ((token = strtok(command, " ")) != NULL) {
-        command = NULL;  // For subsequent calls, pass NULL
+// Builtin: with %N KEY=VALUE... changes the scheduling and limits of every
+// process of a running job
+int quash_with(char **args) {
+    if (args[1] == NULL || args[1][0] != '%' || args[2] == NULL) {
+        fprintf(stderr, "quash: with: usage: with KEY=VALUE... command, or with %%N KEY=VALUE...\n");
+        return 2;
+    }
+    Job *job = find_job_by_id(atoi(&args[1][1]));
+    if (job == NULL) {
+        fprintf(stderr, "quash: with: no such job [%s]\n", &args[1][1]);
+        return 1;
+    }
 
-        // Expand environment variables if any
-        char *expanded_value = expand_env_var_in_string(token);
-        if (expanded_value != NULL) {
-            args[i] = strdup(expanded_value);  // Use the expanded value
-            free(expanded_value);  // Free the memory after use
-        } else {
-            args[i] = strdup(token);  // If no expansion, use the original token
+    WithSettings with;
+    memset(&with, 0, sizeof(with));
+    with.ioprio = -1;
+    for (int i = 2; args[i] != NULL; i++) {
+        int parsed = with_parse(&with, args[i]);
+        if (parsed == 1) {
+            fprintf(stderr, "quash: with: %s: unknown setting\n", args[i]);
+        }
+        if (parsed != 0) {
+            return 2;
         }
+    }
 
-        i++;
+    int status = 0;
+    for (int i = 0; i < job->num_pids; i++) {
+        if (with_apply(&with, job->pids[i]) == -1) {
+            status = 1;
+            break;
+        }
     }
-    args[i] = NULL;  // Null-terminate the arguments array
+    char *settings = status == 0 ? with_merge(job->settings, args + 2) : NULL;
+    if (settings != NULL) {
+        free(job->settings);
+        job->settings = settings;
+    }
+    return status;
 }
 
+// Function to kill a background job or a process
+int quash_kill(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "quash: kill: missing argument\n");
+        return 1;
+    }
 
+    pid_t pid = 0;
+    int job_id = 0;
 
+    // Check if the user is trying to kill a job using %job_id
+    if (args[1][0] == '%') {
+        // Extract job ID (e.g., %1 becomes 1)
+        job_id = atoi(&args[1][1]);
 
-// Function to handle pipes in commands
-void execute_piped_commands(char *input) {
-    char *commands[MAX_ARGS];  // Array to store individual commands
-    int num_pipes = 0;
+        // Find the corresponding job in the job table
+        Job *job = find_job_by_id(job_id);
+        if (job != NULL) {
+            pid = job->pid;
+        }
 
-    // Split the input into individual commands based on the pipe '|'
-    char *command = strtok(input, "|");
-    while (command != NULL && num_pipes < MAX_ARGS - 1) {
-        commands[num_pipes++] = command;
-        command = strtok(NULL, "|");
+        if (pid == 0) {
+            fprintf(stderr, "quash: kill: no such job [%d]\n", job_id);
+            return 1;
+        }
+    } else {
+        // Otherwise, treat it as a direct PID
+        pid = atoi(args[1]);
     }
-    commands[num_pipes] = NULL;  // Null-terminate the commands array
 
-    // Array to store file descriptors for pipes
-    int pipefds[2 * (num_pipes - 1)];
-
-    // Create the required number of pipes
-    for (int i = 0; i < num_pipes - 1; i++) {
-        if (pipe(pipefds + 2 * i) == -1) {
-            perror("pipe failed");
-            return;
-        }
+    // Attempt to kill the process or job
+    if (kill(pid, SIGKILL) == -1) {
+        perror("quash: kill");
+        return 1;
     }
+    printf("Killed process %d\n", pid);
 
-    for (int i = 0; i < num_pipes; i++) {
-        char *cmd_args[MAX_ARGS];
-        tokenize_command(commands[i], cmd_args);
+    // Remove the job from the job list if it's a background job
+    if (job_id > 0) {
+        remove_job(pid);
+    }
+    return 0;
+}
 
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child process
+// Set up the main-loop event source for exited children. On Linux SIGCHLD
+// is blocked and read through a signalfd; elsewhere the handler writes to
+// a self-pipe. Either way child_event_fd becomes readable when children exit.
+void child_events_init() {
+#ifdef __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        perror("sigprocmask");
+        exit(EXIT_FAILURE);
+    }
+    child_event_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (child_event_fd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+#else
+    if (make_pipe(child_event_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(child_event_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(child_event_pipe[1], F_SETFL, O_NONBLOCK);
+    child_event_fd = child_event_pipe[0];
 
-            // If not the first command, get input from the previous pipe
-            if (i != 0) {
-                if (dup2(pipefds[(i - 1) * 2], STDIN_FILENO) == -1) {
-                    perror("dup2 input failed");
-                    exit(EXIT_FAILURE);
-                }
-            }
+    // Set up the signal handler for SIGCHLD
+    struct sigaction sa;
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;  // Restart interrupted system calls
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
 
-            // If not the last command, write output to the next pipe
-            if (i != num_pipes - 1) {
-                if (dup2(pipefds[i * 2 + 1], STDOUT_FILENO) == -1) {
-                    perror("dup2 output failed");
-                    exit(EXIT_FAILURE);
-                }
-            }
+// Account for one reaped child. Completed background jobs are removed and,
+// if notify is set, queued for the next report to the user.
+void child_exited(pid_t pid, int status, int notify) {
+    if (num_background_children > 0) {
+        num_background_children--;
+    }
+    if (trace_fd >= 0) {
+        trace_exit(pid, status);
+    }
 
-            // Close all pipe file descriptors in the child process
-            for (int j = 0; j < 2 * (num_pipes - 1); j++) {
-                close(pipefds[j]);
-            }
+    Job *job = find_job_by_pid(pid);
+    if (job == NULL) {
+        return;  // An earlier stage of a background pipeline
+    }
 
-            // Execute the command
-            execvp(cmd_args[0], cmd_args);
-            perror("quash: command execution failed");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            // Fork failed
-            perror("fork failed");
+    if (notify) {
+        // Sized for the whole command text, however long
+        const char *format = "\n[QUASH] Job [%d] %d (%s) completed\n";
+        int len = snprintf(NULL, 0, format, job->job_id, job->pid, job->command);
+        char *notice = malloc(len + 1);
+        if (notice == NULL) {
+            perror("quash: malloc failed");
+            remove_job(pid);
             return;
         }
+        snprintf(notice, len + 1, format, job->job_id, job->pid, job->command);
+        if (num_job_notices == job_notices_cap) {
+            int cap = job_notices_cap ? job_notices_cap * 2 : 16;
+            char **notices = realloc(job_notices, cap * sizeof(char *));
+            if (notices == NULL) {
+                perror("quash: realloc failed");
+                free(notice);
+                remove_job(pid);
+                return;
+            }
+            job_notices = notices;
+            job_notices_cap = cap;
+        }
+        job_notices[num_job_notices++] = notice;
     }
+    last_job_status = status_to_exit_code(status);
+    remove_job(pid);
+}
 
-    // Parent process: Close all pipes
-    for (int i = 0; i < 2 * (num_pipes - 1); i++) {
-        close(pipefds[i]);
+// Reap every child that has exited since the last wakeup: one waitpid(-1)
+// drain, so the cost follows the number of exited children, not the number
+// of live jobs. Does nothing if the event source has nothing pending.
+void reap_children(int notify) {
+    char buf[1024];
+    int pending = 0;
+    while (read(child_event_fd, buf, sizeof(buf)) > 0) {
+        pending = 1;
+    }
+    if (!pending) {
+        return;
     }
 
-    // Wait for all child processes to finish
-    for (int i = 0; i < num_pipes; i++) {
-        wait(NULL);
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        child_exited(pid, status, notify);
     }
 }
 
-// Function to handle multiple pipes in commands
-void execute_multiple_pipes(char *input) {
-    char *commands[MAX_ARGS];  // Array to store individual commands
-    int num_pipes = 0;
-
-    // Split the input into individual commands based on the pipe '|'
-    char *command = strtok(input, "|");
-    while (command != NULL && num_pipes < MAX_ARGS - 1) {
-        commands[num_pipes++] = command;
-        command = strtok(NULL, "|");
+// Print the queued completion notices
+void flush_job_notices() {
+    for (int i = 0; i < num_job_notices; i++) {
+        fputs(job_notices[i], stdout);
+        free(job_notices[i]);
     }
-    commands[num_pipes] = NULL;  // Null-terminate the commands array
-
-    // Array to store file descriptors for pipes
-    int pipefds[2 * (num_pipes - 1)];
+    num_job_notices = 0;
+    fflush(stdout);
+}
 
-    // Create the required number of pipes
-    for (int i = 0; i < num_pipes - 1; i++) {
-        if (pipe(pipefds + 2 * i) == -1) {
-            perror("pipe failed");
-            return;
-        }
+// Function to check for completed background jobs and notify the user
+void check_background_jobs(int notify) {
+    reap_children(notify);
+    if (notify) {
+        flush_job_notices();
     }
+}
 
-    for (int i = 0; i < num_pipes; i++) {
-        char *cmd_args[MAX_ARGS];
-        tokenize_command(commands[i], cmd_args);
-
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child process
+// Called while an interactive shell waits for input and a child exits:
+// report it right away and show the prompt again
+void interactive_child_event() {
+    reap_children(1);
+    if (num_job_notices > 0) {
+        flush_job_notices();
+        printf("[QUASH]$ ");
+        fflush(stdout);
+    }
+}
 
-            // If not the first command, get input from the previous pipe
-            if (i != 0) {
-                if (dup2(pipefds[(i - 1) * 2], STDIN_FILENO) == -1) {
-                    perror("dup2 input failed");
-                    exit(EXIT_FAILURE);
-                }
-            }
+// Built-in command: wait [-n] [%job | pid ...]
+// Blocks in waitpid until all jobs, the next job (-n) or the given ones end.
+int quash_wait(char **args) {
+    int status;
+    pid_t pid;
+    int i = 1;
+    int any = 0;
 
-            // If not the last command, write output to the next pipe
-            if (i != num_pipes - 1) {
-                if (dup2(pipefds[i * 2 + 1], STDOUT_FILENO) == -1) {
-                    perror("dup2 output failed");
-                    exit(EXIT_FAILURE);
-                }
-            }
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        any = 1;
+        i++;
+    }
 
-            // Close all pipe file descriptors in the child process
-            for (int j = 0; j < 2 * (num_pipes - 1); j++) {
-                close(pipefds[j]);
+    if (args[i] == NULL) {
+        if (any && num_jobs == 0) {
+            last_status = 127;
+            return last_status;
+        }
+        last_status = 0;
+        while (num_jobs > 0 && (pid = waitpid(-1, &status, 0)) > 0) {
+            int was_job = find_job_by_pid(pid) != NULL;
+            child_exited(pid, status, 0);
+            if (any && was_job) {
+                last_status = last_job_status;
+                return last_status;
             }
-
-            // Execute the command
-            execvp(cmd_args[0], cmd_args);
-            perror("quash: command execution failed");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            // Fork failed
-            perror("fork failed");
-            return;
         }
+        return last_status;
     }
 
-    // Parent process: Close all pipes
-    for (int i = 0; i < 2 * (num_pipes - 1); i++) {
-        close(pipefds[i]);
-    }
+    for (; args[i] != NULL; i++) {
+        Job *job;
+        if (args[i][0] == '%') {
+            job = find_job_by_id(atoi(&args[i][1]));
+        } else {
+            job = find_job_by_pid(atoi(args[i]));
+        }
+        if (job == NULL) {
+            fprintf(stderr, "quash: wait: %s: no such job\n", args[i]);
+            last_status = 127;
+            continue;
+        }
 
-    // Wait for all child processes to finish
-    for (int i = 0; i < num_pipes; i++) {
-        wait(NULL);
+        pid = job->pid;
+        if (waitpid(pid, &status, 0) == pid) {
+            child_exited(pid, status, 0);
+            last_status = last_job_status;
+        } else {
+            remove_job(pid);
+            last_status = 127;
+        }
     }
+    return last_status;
 }
 
+// Split each template argument at its {} placeholders once, so starting a
+// job only copies the parts around the item. *num_holes counts the {}.
+TemplateArg *parallel_compile(char **args, int argc, int *num_holes) {
+    TemplateArg *tmpl = arena_alloc(&line_arena, argc * sizeof(TemplateArg));
+    *num_holes = 0;
+    for (int i = 0; i < argc; i++) {
+        int holes = 0;
+        for (char *p = strstr(args[i], "{}"); p != NULL; p = strstr(p + 2, "{}")) {
+            holes++;
+        }
 
-
-int count_pipes(const char *input) {
-    int count = 0;
-    while (*input != '\0') {
-        if (*input == '|') {
-            count++;
+        tmpl[i].num_parts = holes + 1;
+        tmpl[i].parts = arena_alloc(&line_arena, (holes + 1) * sizeof(char *));
+        tmpl[i].part_lens = arena_alloc(&line_arena, (holes + 1) * sizeof(size_t));
+        tmpl[i].fixed_len = 0;
+        char *start = args[i];
+        for (int j = 0; j <= holes; j++) {
+            char *end = j < holes ? strstr(start, "{}") : start + strlen(start);
+            tmpl[i].parts[j] = start;
+            tmpl[i].part_lens[j] = end - start;
+            tmpl[i].fixed_len += end - start;
+            start = end + 2;
         }
-        input++;
+        *num_holes += holes;
     }
-    return count;
+    return tmpl;
 }
 
+// Fill par->argv for one item. Arguments without {} point into the
+// template; the others are built in arg_buf. Returns -1 if out of memory.
+int parallel_expand(Parallel *par, const char *item) {
+    size_t item_len = strlen(item);
+    size_t needed = 0;
+    for (int i = 0; i < par->tmpl_argc; i++) {
+        TemplateArg *arg = &par->tmpl[i];
+        if (arg->num_parts > 1) {
+            needed += arg->fixed_len + (arg->num_parts - 1) * item_len + 1;
+        }
+    }
 
-void execute_command_with_redirection(char **args, char *output_file) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Open the file for output
-        int fd = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-        if (fd == -1) {
-            perror("quash: open failed");
-            exit(EXIT_FAILURE);
+    if (needed > par->arg_buf_cap) {
+        size_t cap = par->arg_buf_cap ? par->arg_buf_cap : 256;
+        while (cap < needed) {
+            cap *= 2;
+        }
+        char *buf = realloc(par->arg_buf, cap);
+        if (buf == NULL) {
+            perror("quash: realloc failed");
+            return -1;
         }
+        par->arg_buf = buf;
+        par->arg_buf_cap = cap;
+    }
 
-        // Redirect stdout to the file
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+    char *out = par->arg_buf;
+    for (int i = 0; i < par->tmpl_argc; i++) {
+        TemplateArg *arg = &par->tmpl[i];
+        if (arg->num_parts == 1) {
+            par->argv[i] = arg->parts[0];
+            continue;
+        }
+        par->argv[i] = out;
+        for (int j = 0; j < arg->num_parts; j++) {
+            if (j > 0) {
+                memcpy(out, item, item_len);
+                out += item_len;
+            }
+            memcpy(out, arg->parts[j], arg->part_lens[j]);
+            out += arg->part_lens[j];
+        }
+        *out++ = '\0';
+    }
 
-        // Execute the command
-        execvp(args[0], args);
-        perror("quash: command execution failed");
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process: Wait for the child to finish
-        waitpid(pid, NULL, 0);
+    int argc = par->tmpl_argc;
+    if (par->append_item) {
+        par->argv[argc++] = (char *)item;
     }
+    par->argv[argc] = NULL;
+    return 0;
 }
 
-// Function to handle input redirection
-void execute_command_with_input_redirection(char **args, char *input_file) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Open the input file
-        int fd = open(input_file, O_RDONLY);
-        if (fd == -1) {
-            perror("quash: open failed");
-            exit(EXIT_FAILURE);
+// Write all of data, retrying short writes
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
         }
-
-        // Redirect stdin to the file
-        dup2(fd, STDIN_FILENO);
-        close(fd);
-
-        // Execute the command
-        execvp(args[0], args);
-        perror("quash: command execution failed");
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process: Wait for the child to finish
-        waitpid(pid, NULL, 0);
+        data += n;
+        len -= n;
     }
+    return 0;
 }
 
-void execute_command_with_append_redirection(char **args, char *output_file) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Open the file for appending
-        int fd = open(output_file, O_CREAT | O_WRONLY | O_APPEND, 0644);
-        if (fd == -1) {
-            perror("quash: open failed");
-            exit(EXIT_FAILURE);
-        }
+// Start the job for one item in a free slot. A job that cannot be started
+// is finished right away with status 127.
+void parallel_start(Parallel *par, ParallelSlot *slot, const char *item) {
+    slot->seq = par->next_seq++;
+    slot->item = strdup(item);
+    slot->pid = -1;
+    slot->out_fd = -1;
+    slot->exited = 0;
+    slot->status = 127;
+    slot->out_len = 0;
+    par->running++;
+
+    char *path = NULL;
+    int pipefds[2] = {-1, -1};
+    if (parallel_expand(par, item) == 0) {
+        path = par->path != NULL ? par->path : lookup_command(par->argv[0]);
+    }
+    if (path != NULL && par->keep_order && make_pipe(pipefds) == -1) {
+        perror("quash: pipe failed");
+        path = NULL;
+    }
 
-        // Redirect stdout to the file
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+    if (path != NULL) {
+        SpawnAction action = {pipefds[1], STDOUT_FILENO};
+        slot->pid = spawn_command(path, par->argv, var_envp(), &action, par->keep_order ? 1 : 0);
+    }
+    if (pipefds[1] != -1) close(pipefds[1]);
 
-        // Execute the command
-        execvp(args[0], args);
-        perror("quash: command execution failed");
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process: Wait for the child to finish
-        waitpid(pid, NULL, 0);
+    if (slot->pid > 0) {
+        slot->out_fd = pipefds[0];
+        return;
     }
+    if (pipefds[0] != -1) close(pipefds[0]);
+    slot->exited = 1;
+    parallel_finish(par, slot);
 }
 
-void execute_command_with_input_output_redirection(char **args, char *input_file, char *output_file) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Open the input file
-        int fd_in = open(input_file, O_RDONLY);
-        if (fd_in == -1) {
-            perror("quash: open input failed");
-            exit(EXIT_FAILURE);
-        }
+// Account for a job that has been reaped and, with -k, whose output has
+// been read to the end, then free its slot
+void parallel_finish(Parallel *par, ParallelSlot *slot) {
+    if (slot->status != 0) {
+        par->failed++;
+        fprintf(stderr, "quash: parallel: %s: exit status %d\n", slot->item ? slot->item : "", slot->status);
+    }
 
-        // Open the output file for truncating
-        int fd_out = open(output_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-        if (fd_out == -1) {
-            perror("quash: open output failed");
-            exit(EXIT_FAILURE);
+    int was_next = par->keep_order && slot->seq == par->next_output;
+    if (was_next) {
+        // Anything buffered before it became the oldest job was written then
+        write_all(STDOUT_FILENO, slot->out, slot->out_len);
+    } else if (par->keep_order) {
+        HeldOutput *held = malloc(sizeof(HeldOutput));
+        if (held == NULL) {
+            perror("quash: malloc failed");
+            write_all(STDOUT_FILENO, slot->out, slot->out_len);
+        } else {
+            held->seq = slot->seq;
+            held->data = slot->out;
+            held->len = slot->out_len;
+            held->next = NULL;
+            slot->out = NULL;
+            slot->out_cap = 0;
+
+            // Jobs mostly finish in order, so this is usually an append
+            if (par->held == NULL) {
+                par->held = par->held_tail = held;
+            } else if (held->seq > par->held_tail->seq) {
+                par->held_tail->next = held;
+                par->held_tail = held;
+            } else {
+                HeldOutput **p = &par->held;
+                while ((*p)->seq < held->seq) {
+                    p = &(*p)->next;
+                }
+                held->next = *p;
+                *p = held;
+            }
         }
+    }
 
-        // Redirect stdin to input file
-        dup2(fd_in, STDIN_FILENO);
-        close(fd_in);
-
-        // Redirect stdout to output file
-        dup2(fd_out, STDOUT_FILENO);
-        close(fd_out);
-
-        // Execute the command
-        execvp(args[0], args);
-        perror("quash: command execution failed");
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process: Wait for the child to finish
-        waitpid(pid, NULL, 0);
+    free(slot->item);
+    slot->item = NULL;
+    slot->pid = 0;
+    slot->out_len = 0;
+    par->running--;
+    if (was_next) {
+        parallel_advance(par);
     }
 }
 
-void execute_command_with_input_output_append_redirection(char **args, char *input_file, char *output_file) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Open the input file
-        int fd_in = open(input_file, O_RDONLY);
-        if (fd_in == -1) {
-            perror("quash: open input failed");
-            exit(EXIT_FAILURE);
+// The oldest job is done: write the held outputs that follow it, up to the
+// first job still running, whose output so far is written too. From then
+// on that job writes straight through.
+void parallel_advance(Parallel *par) {
+    par->next_output++;
+    while (par->held != NULL && par->held->seq == par->next_output) {
+        HeldOutput *held = par->held;
+        write_all(STDOUT_FILENO, held->data, held->len);
+        par->held = held->next;
+        if (par->held == NULL) {
+            par->held_tail = NULL;
         }
+        free(held->data);
+        free(held);
+        par->next_output++;
+    }
 
-        // Open the output file for appending
-        int fd_out = open(output_file, O_CREAT | O_WRONLY | O_APPEND, 0644);
-        if (fd_out == -1) {
-            perror("quash: open output failed");
-            exit(EXIT_FAILURE);
+    for (int i = 0; i < par->max_jobs; i++) {
+        ParallelSlot *slot = &par->slots[i];
+        if (slot->pid != 0 && slot->seq == par->next_output) {
+            write_all(STDOUT_FILENO, slot->out, slot->out_len);
+            slot->out_len = 0;
         }
-
-        // Redirect stdin to input file
-        dup2(fd_in, STDIN_FILENO);
-        close(fd_in);
-
-        // Redirect stdout to output file
-        dup2(fd_out, STDOUT_FILENO);
-        close(fd_out);
-
-        // Execute the command
-        execvp(args[0], args);
-        perror("quash: command execution failed");
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process: Wait for the child to finish
-        waitpid(pid, NULL, 0);
     }
 }
 
+// Read what a job wrote (-k). The oldest unfinished job goes straight to
+// stdout, the others are buffered until their turn.
+void parallel_read_output(Parallel *par, ParallelSlot *slot) {
+    char buf[READ_BUFFER_SIZE];
+    ssize_t n = read(slot->out_fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        close(slot->out_fd);
+        slot->out_fd = -1;
+        return;
+    }
 
+    if (slot->seq == par->next_output) {
+        write_all(STDOUT_FILENO, buf, n);
+        return;
+    }
 
-
-
-void execute_command(char **args) {
-    int background = 0;
-
-    // Check if the command is a background job (if the last argument is '&')
-    int i = 0;
-    while (args[i] != NULL) i++;  // Find the last argument
-    if (i > 0 && strcmp(args[i - 1], "&") == 0) {
-        background = 1;
-        args[i - 1] = NULL;  // Remove the '&' from the arguments
+    if (slot->out_len + n > slot->out_cap) {
+        size_t cap = slot->out_cap ? slot->out_cap : READ_BUFFER_SIZE;
+        while (cap < slot->out_len + n) {
+            cap *= 2;
+        }
+        char *out = realloc(slot->out, cap);
+        if (out == NULL) {
+            perror("quash: realloc failed");
+            write_all(STDOUT_FILENO, buf, n);
+            return;
+        }
+        slot->out = out;
+        slot->out_cap = cap;
     }
+    memcpy(slot->out + slot->out_len, buf, n);
+    slot->out_len += n;
+}
 
-    // Tokenize and handle pipes, redirection, etc., as usual
+// Reap exited children. Our jobs are marked as exited; anything else is a
+// background job and goes through the shell's usual accounting.
+void parallel_reap(Parallel *par) {
+    char buf[1024];
+    while (read(child_event_fd, buf, sizeof(buf)) > 0) {
+    }
 
-    // Normal or background command execution
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process: Execute the command
-        execvp(args[0], args);
-        perror("quash: command execution failed");
-        exit(EXIT_FAILURE);
-    } else {
-        if (!background) {
-            // Parent process: Wait for the child if not in background
-            waitpid(pid, NULL, 0);
-        } else {
-            // Handle background jobs
-            printf("Background job started: [%d] %d %s &\n", next_job_id, pid, args[0]);
-            add_job(pid, args);  // Add the background job to the list
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        ParallelSlot *slot = NULL;
+        for (int i = 0; i < par->max_jobs; i++) {
+            if (par->slots[i].pid == pid) {
+                slot = &par->slots[i];
+                break;
+            }
         }
+        if (slot == NULL) {
+            child_exited(pid, status, par->notify);
+            continue;
+        }
+        slot->exited = 1;
+        slot->status = status_to_exit_code(status);
     }
 }
 
+// Finish the running jobs without polling, once the child event source or
+// an output pipe has failed: collect what they write, then wait for each
+void parallel_abort(Parallel *par) {
+    for (int i = 0; i < par->max_jobs; i++) {
+        ParallelSlot *slot = &par->slots[i];
+        if (slot->pid == 0) continue;
+        while (slot->out_fd != -1) {
+            parallel_read_output(par, slot);
+        }
+        if (!slot->exited) {
+            int status;
+            slot->status = waitpid(slot->pid, &status, 0) == slot->pid ? status_to_exit_code(status) : 1;
+            slot->exited = 1;
+        }
+        parallel_finish(par, slot);
+    }
+}
 
+// Built-in command: parallel [-j N] [-k] command [arg ...] [::: item ... | :::: file]
+// Runs the command once per item, lines of stdin by default, keeping up to
+// N jobs (one per CPU by default) running. {} in the arguments stands for
+// the item, which is otherwise appended. -k writes the outputs in input
+// order. $? is the number of failed jobs, at most 101.
+int quash_parallel(char **args) {
+    Parallel par;
+    memset(&par, 0, sizeof(Parallel));
+    par.max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    par.notify = shell_interactive;
+    last_status = 2;
+
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-k") == 0) {
+            par.keep_order = 1;
+        } else if (strncmp(args[i], "-j", 2) == 0) {
+            char *count = args[i][2] != '\0' ? &args[i][2] : args[++i];
+            if (count == NULL) {
+                fprintf(stderr, "quash: parallel: -j: option requires an argument\n");
+                return last_status;
+            }
+            if (atoi(count) > 0) {
+                par.max_jobs = atoi(count);
+            }
+        } else {
+            fprintf(stderr, "quash: parallel: %s: invalid option\n", args[i]);
+            return last_status;
+        }
+    }
+    if (par.max_jobs < 1) {
+        par.max_jobs = 1;
+    }
 
-// Function to run the shell
-void run_shell() {
-    char input[MAX_INPUT];  // Store user input
-    char *args[MAX_ARGS];   // Store parsed arguments
-    int running = 1;        // Shell running status
-
-    while (running) {
-        // Print prompt
-        printf("[QUASH]$ ");
-        fflush(stdout);
+    // The command template runs up to ::: or ::::
+    int start = i;
+    while (args[i] != NULL && strcmp(args[i], ":::") != 0 && strcmp(args[i], "::::") != 0) {
+        i++;
+    }
+    par.tmpl_argc = i - start;
+    if (par.tmpl_argc == 0) {
+        fprintf(stderr, "quash: parallel: missing command\n");
+        return last_status;
+    }
 
-        // Check for completed background jobs
-        check_background_jobs();
+    int num_holes;
+    par.tmpl = parallel_compile(&args[start], par.tmpl_argc, &num_holes);
+    par.append_item = num_holes == 0;
+    par.argv = arena_alloc(&line_arena, (par.tmpl_argc + 2) * sizeof(char *));
+    if (par.tmpl[0].num_parts == 1) {
+        // The same command for every item: resolve it once
+        par.path = lookup_command(args[start]);
+        if (par.path == NULL) {
+            last_status = 127;
+            return last_status;
+        }
+    }
 
-        // Get input from user
-        if (fgets(input, MAX_INPUT, stdin) == NULL) {
-            // Handle Ctrl+D (EOF)
-            printf("\n");
-            break;
+    LineReader reader;
+    if (args[i] != NULL && strcmp(args[i], ":::") == 0) {
+        par.items = &args[i + 1];
+    } else {
+        int fd = STDIN_FILENO;
+        if (args[i] != NULL) {
+            fd = args[i + 1] != NULL ? open(args[i + 1], O_RDONLY | O_CLOEXEC) : -1;
+            if (fd == -1) {
+                fprintf(stderr, "quash: parallel: %s: %s\n", args[i + 1] ? args[i + 1] : "::::",
+                        args[i + 1] ? strerror(errno) : "missing file");
+                last_status = 1;
+                return last_status;
+            }
         }
+        reader_init_fd(&reader, fd);
+        par.reader = &reader;
+    }
 
-        // Remove trailing newline
-        input[strcspn(input, "\n")] = '\0';
+    par.slots = calloc(par.max_jobs, sizeof(ParallelSlot));
+    struct pollfd *fds = calloc(par.max_jobs + 1, sizeof(struct pollfd));
+    int *fd_slots = calloc(par.max_jobs + 1, sizeof(int));
+    if (par.slots == NULL || fds == NULL || fd_slots == NULL) {
+        perror("quash: calloc failed");
+        par.max_jobs = 0;
+    }
 
-        // Check if the input is empty
-        if (input[0] == '\0') {
-            continue;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    fflush(stdout);
+
+    int more = par.max_jobs > 0;
+    int aborted = 0;
+    while (1) {
+        // Keep every slot busy while there are items left
+        for (int s = 0; more && s < par.max_jobs; s++) {
+            if (par.slots[s].pid != 0) continue;
+            char *item = par.items != NULL ? *par.items : reader_next_line(par.reader);
+            if (item == NULL) {
+                more = 0;
+                break;
+            }
+            if (par.items != NULL) par.items++;
+            parallel_start(&par, &par.slots[s], item);
         }
-
-        // Expand environment variables in the entire input
-        char *expanded_input = expand_env_var_in_string(input);
-        if (expanded_input == NULL) {
+        if (par.running == 0) {
+            if (!more) break;
             continue;
         }
 
-        // Process the expanded input
-        int pipe_count = count_pipes(expanded_input);
-        if (pipe_count == 1) {
-            // Single pipe case
-            execute_piped_commands(expanded_input);
-            free(expanded_input);
-            continue;
-        } else if (pipe_count > 1) {
-            // Multiple pipes case
-            execute_multiple_pipes(expanded_input);
-            free(expanded_input);
-            continue;
+        // Sleep until a job exits or, with -k, writes something
+        int nfds = 0;
+        fds[nfds].fd = child_event_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        for (int s = 0; s < par.max_jobs; s++) {
+            if (par.slots[s].pid != 0 && par.slots[s].out_fd != -1) {
+                fds[nfds].fd = par.slots[s].out_fd;
+                fds[nfds].events = POLLIN;
+                fd_slots[nfds] = s;
+                nfds++;
+            }
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("quash: poll failed");
+            break;
         }
 
-        // Handle input and output redirection as before
-        
-                // Handle input and output redirection
-        char *redirect_in = strchr(input, '<');
-        char *redirect_out = strchr(input, '>');
-        if (redirect_in != NULL && redirect_out != NULL) {
-            *redirect_in = '\0';
-            *redirect_out = '\0';
-            char *input_file = strtok(redirect_in + 1, " ");
-            char *output_file = NULL;
-
-            // Check if output redirection is append (>>) or overwrite (>)
-            if (*(redirect_out + 1) == '>') {
-                output_file = strtok(redirect_out + 2, " ");
-                tokenize_command(input, args);
-                execute_command_with_input_output_append_redirection(args, input_file, output_file);
-            } else {
-                output_file = strtok(redirect_out + 1, " ");
-                tokenize_command(input, args);
-                execute_command_with_input_output_redirection(args, input_file, output_file);
+        // A descriptor poll can't wait on would wake it up forever. A hangup
+        // on an output pipe is just the job closing it, read as end of file.
+        const char *broken = fds[0].revents & (POLLNVAL | POLLERR | POLLHUP) ? "child event source" : NULL;
+        for (int f = 1; f < nfds && broken == NULL; f++) {
+            if (fds[f].revents & (POLLNVAL | POLLERR)) {
+                broken = "job output pipe";
             }
-            continue;
         }
-
-        // Handle individual input or output redirection
-        if (redirect_in != NULL) {
-            *redirect_in = '\0';
-            char *input_file = strtok(redirect_in + 1, " ");
-            tokenize_command(input, args);
-            execute_command_with_input_redirection(args, input_file);
-            continue;
+        if (broken != NULL) {
+            fprintf(stderr, "quash: parallel: %s failed, starting no more jobs\n", broken);
+            parallel_abort(&par);
+            aborted = 1;
+            break;
         }
 
-        if (redirect_out != NULL) {
-            if (*(redirect_out + 1) == '>') {
-                *redirect_out = '\0';
-                char *output_file = strtok(redirect_out + 2, " ");
-                tokenize_command(input, args);
-                execute_command_with_append_redirection(args, output_file);
-            } else {
-                *redirect_out = '\0';
-                char *output_file = strtok(redirect_out + 1, " ");
-                tokenize_command(input, args);
-                execute_command_with_redirection(args, output_file);
+        for (int f = 1; f < nfds; f++) {
+            if (fds[f].revents != 0) {
+                parallel_read_output(&par, &par.slots[fd_slots[f]]);
             }
-            continue;
         }
+        if (fds[0].revents & POLLIN) {
+            parallel_reap(&par);
+        }
+        for (int s = 0; s < par.max_jobs; s++) {
+            ParallelSlot *slot = &par.slots[s];
+            if (slot->pid != 0 && slot->exited && slot->out_fd == -1) {
+                parallel_finish(&par, slot);
+            }
+        }
+    }
 
+    double elapsed = elapsed_since(&started);
+    fprintf(stderr, "parallel: %ld jobs, %ld failed, %.3f s, %.1f jobs/s\n",
+            par.next_seq, par.failed, elapsed, elapsed > 0 ? par.next_seq / elapsed : 0.0);
 
-        // Tokenize the command into arguments
-        tokenize_command(expanded_input, args);
+    for (int s = 0; s < par.max_jobs; s++) {
+        free(par.slots[s].out);
+    }
+    free(par.slots);
+    free(fds);
+    free(fd_slots);
+    free(par.arg_buf);
+    if (par.reader != NULL) {
+        if (reader.fd != STDIN_FILENO) close(reader.fd);
+        free(reader.buf);
+    }
+    last_status = par.failed > 101 ? 101 : par.failed;
+    if (aborted && last_status == 0) {
+        last_status = 1;
+    }
+    return last_status;
+}
 
-        // Check if the input is a built-in command or needs execution
-        if (args[0] == NULL) {
-            free(expanded_input);
-            continue;  // No command entered
-        }
+// Find the history log: $QUASH_HISTFILE, or ~/.quash_history
+char *history_path() {
+    static char path[4096];
+    char *value = var_get("QUASH_HISTFILE");
+    if (value != NULL && value[0] != '\0') {
+        return value;
+    }
+    char *home = var_get("HOME");
+    if (home == NULL) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/.quash_history", home);
+    return path;
+}
 
-        // Handle built-in commands
-        if (strcmp(args[0], "pwd") == 0) {
-            quash_pwd();
-        } else if (strcmp(args[0], "echo") == 0) {
-            quash_echo(args);
-        } else if (strcmp(args[0], "export") == 0) {
-            quash_export(args);
-        } else if (strcmp(args[0], "cd") == 0) {
-            quash_cd(args);
-        } else if (strcmp(args[0], "jobs") == 0) {
-            quash_jobs();
-        } else if (strcmp(args[0], "kill") == 0) {
-            quash_kill(args);
-        } else if (strcmp(args[0], "exit") == 0 || strcmp(args[0], "quit") == 0) {
-            running = 0;  // Exit the shell
-        } else {
-            // Handle regular command execution (foreground or background)
-            execute_command(args);
-        }
+// Open and map the history log. Only the size of the file is looked at, so
+// this costs the same for an empty log and for millions of entries.
+int history_open() {
+    if (history_fd >= 0) {
+        return 0;
+    }
+    char *path = history_path();
+    if (path == NULL) {
+        return -1;
+    }
+    history_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history_fd == -1) {
+        fprintf(stderr, "quash: history: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (history_map_refresh() == -1) {
+        return -1;
+    }
 
-        free(expanded_input);  // Clean up expanded input
+    // A session that died mid-write can leave a torn record at the end
+    if (history_map_size > 0 && history_entry_at(history_map_size, NULL) == -1) {
+        history_repair();
     }
+    return 0;
 }
 
+// Map the whole log again if it has grown since it was last mapped
+int history_map_refresh() {
+    struct stat st;
+    if (fstat(history_fd, &st) == -1) {
+        perror("quash: history");
+        return -1;
+    }
+    if ((size_t)st.st_size == history_map_size) {
+        return 0;
+    }
 
+    if (history_map != NULL) {
+        munmap(history_map, history_map_size);
+        history_map = NULL;
+    }
+    history_map_size = 0;
+    if (st.st_size == 0) {
+        return 0;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("quash: history: mmap");
+        return -1;
+    }
+    history_map = map;
+    history_map_size = st.st_size;
+    return 0;
+}
 
+// Decode the record that ends at offset end of the log. Returns -1 if
+// there is no complete record there.
+int history_entry_at(size_t end, HistoryEntry *entry) {
+    HistoryTrailer trailer;
+    if (end < sizeof(uint32_t) + sizeof(HistoryTrailer) || end > history_map_size) {
+        return -1;
+    }
+    memcpy(&trailer, history_map + end - sizeof(HistoryTrailer), sizeof(HistoryTrailer));
+    size_t record_len = sizeof(uint32_t) + (size_t)trailer.cwd_len + trailer.text_len + sizeof(HistoryTrailer);
+    if (trailer.magic != HISTORY_MAGIC || trailer.record_len != record_len || record_len > end) {
+        return -1;
+    }
 
+    if (entry != NULL) {
+        size_t start = end - record_len;
+        entry->cwd = history_map + start + sizeof(uint32_t);
+        entry->text = entry->cwd + trailer.cwd_len;
+        entry->start = start;
+        entry->trailer = trailer;
+    }
+    return 0;
+}
 
+// Cut the log back to its last complete record, found by walking the
+// records forward from the start through their leading lengths
+void history_repair() {
+    size_t end = 0;
+    while (end + sizeof(uint32_t) <= history_map_size) {
+        uint32_t record_len;
+        memcpy(&record_len, history_map + end, sizeof(uint32_t));
+        if (record_len == 0 || history_entry_at(end + record_len, NULL) == -1) {
+            break;
+        }
+        end += record_len;
+    }
+    fprintf(stderr, "quash: history: dropping %zu bytes of a torn record\n", history_map_size - end);
+    if (ftruncate(history_fd, end) == 0) {
+        history_map_refresh();
+    }
+}
 
+// Append one entry to the log with a single write, so sessions sharing
+// the file never interleave inside a record
+void history_append(const char *text, const char *cwd, time_t timestamp, long long duration_us, int status) {
+    if (history_open() == -1) {
+        return;
+    }
 
+    // Number it after the last record, read directly rather than remapping
+    HistoryTrailer trailer;
+    struct stat st;
+    uint32_t seq = 1;
+    if (fstat(history_fd, &st) == 0 && (size_t)st.st_size >= sizeof(HistoryTrailer) &&
+        pread(history_fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == sizeof(trailer) &&
+        trailer.magic == HISTORY_MAGIC) {
+        seq = trailer.seq + 1;
+    }
 
-// Built-in command: pwd
-void quash_pwd() {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("%s\n", cwd);
-    } else {
-        perror("quash: getcwd failed");
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.timestamp = timestamp;
+    trailer.duration_us = duration_us;
+    trailer.seq = seq;
+    trailer.status = status;
+    trailer.cwd_len = strlen(cwd);
+    trailer.text_len = strlen(text);
+    trailer.record_len = sizeof(uint32_t) + trailer.cwd_len + trailer.text_len + sizeof(HistoryTrailer);
+    trailer.magic = HISTORY_MAGIC;
+
+    char *record = malloc(trailer.record_len);
+    if (record == NULL) {
+        perror("quash: history");
+        return;
     }
+    memcpy(record, &trailer.record_len, sizeof(uint32_t));
+    memcpy(record + sizeof(uint32_t), cwd, trailer.cwd_len);
+    memcpy(record + sizeof(uint32_t) + trailer.cwd_len, text, trailer.text_len);
+    memcpy(record + trailer.record_len - sizeof(HistoryTrailer), &trailer, sizeof(HistoryTrailer));
+    if (write_all(history_fd, record, trailer.record_len) == -1) {
+        perror("quash: history");
+    }
+    free(record);
 }
 
+// Remember an interactive line that is about to run; it is logged by
+// history_finish_line once its status and duration are known
+void history_begin_line(const char *line) {
+    history_finish_line();
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    history_pending = strdup(line);
+    history_pending_cwd = strdup(cwd);
+    history_pending_time = time(NULL);
+    history_pending_start = monotonic_ns();
+}
 
-// Built-in command: echo
-void quash_echo(char **args) {
-    int inside_single_quotes = 0;
-    int inside_double_quotes = 0;
+// Log the line remembered by history_begin_line, if any
+void history_finish_line() {
+    if (history_pending == NULL) {
+        return;
+    }
+    if (history_pending_cwd != NULL) {
+        history_append(history_pending, history_pending_cwd, history_pending_time,
+                       (monotonic_ns() - history_pending_start) / 1000, last_status);
+    }
+    free(history_pending);
+    free(history_pending_cwd);
+    history_pending = NULL;
+    history_pending_cwd = NULL;
+}
 
-    for (int i = 1; args[i] != NULL; i++) {
-        // Check if the argument starts with a single quote
-        if (args[i][0] == '\'' && args[i][strlen(args[i]) - 1] != '\'') {
-            inside_single_quotes = 1;  // We are inside a single quoted string
-            printf("%s", args[i] + 1);  // Print without the leading single quote
-        } 
-        // Check if the argument ends with a single quote
-        else if (inside_single_quotes && args[i][strlen(args[i]) - 1] == '\'') {
-            printf(" %.*s", (int)(strlen(args[i]) - 1), args[i]);  // Print without the trailing single quote
-            inside_single_quotes = 0;  // We're done with the quoted string
-        } 
-        // Handle the middle of the single quoted string
-        else if (inside_single_quotes) {
-            printf(" %s", args[i]);  // Print with a space
-        } 
-        // Handle arguments with single quotes on both sides
-        else if (args[i][0] == '\'' && args[i][strlen(args[i]) - 1] == '\'') {
-            // Print the argument without surrounding single quotes
-            printf("%.*s", (int)(strlen(args[i]) - 2), args[i] + 1);
-        } 
-        
-        // Check if the argument starts with a double quote
-        else if (args[i][0] == '\"' && args[i][strlen(args[i]) - 1] != '\"') {
-            inside_double_quotes = 1;  // We are inside a double quoted string
-            printf("%s", args[i] + 1);  // Print without the leading double quote
-        } 
-        // Check if the argument ends with a double quote
-        else if (inside_double_quotes && args[i][strlen(args[i]) - 1] == '\"') {
-            printf(" %.*s", (int)(strlen(args[i]) - 1), args[i]);  // Print without the trailing double quote
-            inside_double_quotes = 0;  // We're done with the quoted string
-        } 
-        // Handle the middle of the double quoted string
-        else if (inside_double_quotes) {
-            printf(" %s", args[i]);  // Print with a space
-        } 
-        // Handle arguments with double quotes on both sides
-        else if (args[i][0] == '\"' && args[i][strlen(args[i]) - 1] == '\"') {
-            // Print the argument without surrounding double quotes
-            printf("%.*s", (int)(strlen(args[i]) - 2), args[i] + 1);
-        } 
-        
-        // Handle environment variables and regular arguments
-        else {
-            char *expanded_value = expand_env_var_in_string(args[i]);
-            if (expanded_value != NULL) {
-                printf("%s", expanded_value);
-                free(expanded_value);  // Free dynamically allocated memory
-            } else {
-                printf("%s", args[i]);
+// Expand a line starting with !! (the last entry) or !prefix (the latest
+// entry starting with prefix); the rest of the line is kept. Returns the
+// new line in the line arena, or NULL after reporting that nothing matched.
+char *history_expand(const char *line) {
+    const char *word_end = line + 1;
+    if (*word_end == '!') {
+        word_end++;
+    } else {
+        while (*word_end != '\0' && !IS_BLANK(*word_end)) {
+            word_end++;
+        }
+    }
+    const char *prefix = line + 1;
+    size_t prefix_len = line[1] == '!' ? 0 : (size_t)(word_end - prefix);
+
+    HistoryEntry entry;
+    int found = 0;
+    if (history_open() == 0 && history_map_refresh() == 0) {
+        for (size_t end = history_map_size; history_entry_at(end, &entry) == 0; end = entry.start) {
+            if (entry.trailer.text_len >= prefix_len && memcmp(entry.text, prefix, prefix_len) == 0) {
+                found = 1;
+                break;
             }
         }
+    }
+    if (!found) {
+        fprintf(stderr, "quash: %.*s: event not found\n", (int)(word_end - line), line);
+        return NULL;
+    }
 
+    size_t rest_len = strlen(word_end);
+    char *expanded = arena_alloc(&line_arena, entry.trailer.text_len + rest_len + 1);
+    memcpy(expanded, entry.text, entry.trailer.text_len);
+    memcpy(expanded + entry.trailer.text_len, word_end, rest_len + 1);
+    return expanded;
+}
 
-        // Add a space between arguments if more arguments exist
-        if (args[i + 1] != NULL && !(inside_single_quotes || inside_double_quotes)) {
-            printf(" ");
-        }
+// Find the posting list of a trigram, or the free slot where it would go
+TrigramPosting *trigram_slot(TrigramPosting *table, size_t size, uint32_t key) {
+    size_t mask = size - 1;
+    size_t i = (key * 2654435761UL) & mask;
+    while (table[i].key != 0 && table[i].key != key) {
+        i = (i + 1) & mask;
     }
-    printf("\n");
+    return &table[i];
 }
 
+// Double the trigram table
+void trigram_table_grow() {
+    size_t size = trigram_table_size ? trigram_table_size * 2 : TRIGRAM_TABLE_INITIAL_SIZE;
+    TrigramPosting *table = calloc(size, sizeof(TrigramPosting));
+    if (table == NULL) {
+        perror("quash: calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < trigram_table_size; i++) {
+        if (trigram_table[i].key != 0) {
+            *trigram_slot(table, size, trigram_table[i].key) = trigram_table[i];
+        }
+    }
+    free(trigram_table);
+    trigram_table = table;
+    trigram_table_size = size;
+}
 
+// Add entry id to the posting list of a trigram. Ids arrive in increasing
+// order and are stored as varint-encoded deltas, about a byte each.
+void trigram_add(uint32_t key, uint32_t id) {
+    if ((trigram_table_count + 1) * 2 > trigram_table_size) {
+        trigram_table_grow();
+    }
+    TrigramPosting *posting = trigram_slot(trigram_table, trigram_table_size, key);
+    if (posting->key == 0) {
+        posting->key = key;
+        trigram_table_count++;
+    } else if (posting->last_id == id) {
+        return;  // The trigram occurs more than once in this entry
+    }
 
-
-
-
-
-
-// Built-in command: export
-void quash_export(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "quash: export: missing argument\n");
-        return;
+    if (posting->len + 5 > posting->cap) {
+        size_t cap = posting->cap ? posting->cap * 2 : 16;
+        uint8_t *data = realloc(posting->data, cap);
+        if (data == NULL) {
+            perror("quash: realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        posting->data = data;
+        posting->cap = cap;
     }
+    uint32_t delta = posting->count > 0 ? id - posting->last_id : id;
+    while (delta >= 0x80) {
+        posting->data[posting->len++] = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    posting->data[posting->len++] = delta;
+    posting->last_id = id;
+    posting->count++;
+}
 
-    // Split the argument at the '=' sign to get the variable name and value
-    char *name = strtok(args[1], "=");
-    char *value = strtok(NULL, "=");
+// Decode a posting list into ids (room for posting->count of them)
+void trigram_decode(TrigramPosting *posting, uint32_t *ids) {
+    uint32_t id = 0;
+    size_t pos = 0;
+    for (uint32_t n = 0; n < posting->count; n++) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (posting->data[pos] & 0x80) {
+            delta |= (uint32_t)(posting->data[pos++] & 0x7f) << shift;
+            shift += 7;
+        }
+        delta |= (uint32_t)posting->data[pos++] << shift;
+        id = n > 0 ? id + delta : delta;
+        ids[n] = id;
+    }
+}
 
-    if (name == NULL || value == NULL) {
-        fprintf(stderr, "quash: export: invalid syntax\n");
+// Bring the search index up to date with the log. The first call indexes
+// the whole log; later ones only the entries appended since.
+void history_index_update() {
+    if (history_open() == -1 || history_map_refresh() == -1 || history_indexed_end == history_map_size) {
         return;
     }
 
-    // Check if the value contains an environment variable (e.g., $HOME)
-    if (value[0] == '$') {
-        value = expand_env_var_in_string(value);  // Expand the variable if it starts with '$'
+    // Walk back to where the index stops, then add the new entries in order
+    size_t first = history_num_indexed;
+    HistoryEntry entry;
+    for (size_t end = history_map_size; end > history_indexed_end && history_entry_at(end, &entry) == 0; end = entry.start) {
+        if (history_num_indexed == history_offsets_cap) {
+            size_t cap = history_offsets_cap ? history_offsets_cap * 2 : 1024;
+            size_t *offsets = realloc(history_offsets, cap * sizeof(size_t));
+            if (offsets == NULL) {
+                perror("quash: realloc failed");
+                exit(EXIT_FAILURE);
+            }
+            history_offsets = offsets;
+            history_offsets_cap = cap;
+        }
+        history_offsets[history_num_indexed++] = end;
+    }
+    for (size_t i = first, j = history_num_indexed - 1; i < j; i++, j--) {
+        size_t end = history_offsets[i];
+        history_offsets[i] = history_offsets[j];
+        history_offsets[j] = end;
     }
 
-    // Set the environment variable
-    if (setenv(name, value, 1) != 0) {
-        perror("quash: export: setenv failed");
+    for (size_t id = first; id < history_num_indexed; id++) {
+        history_entry_at(history_offsets[id], &entry);
+        const unsigned char *text = (const unsigned char *)entry.text;
+        for (uint32_t i = 0; i + 2 < entry.trailer.text_len; i++) {
+            trigram_add(TRIGRAM_KEY(text + i), id);
+        }
     }
+    history_indexed_end = history_map_size;
 }
 
+// Print one history entry, with its recorded details in the long format
+void history_print(HistoryEntry *entry, int long_format) {
+    if (long_format) {
+        char when[32];
+        time_t timestamp = entry->trailer.timestamp;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&timestamp));
+        printf("%6u  %s  %3d  %8.3fs  %.*s  ", entry->trailer.seq, when, entry->trailer.status,
+               entry->trailer.duration_us / 1e6, (int)entry->trailer.cwd_len, entry->cwd);
+    } else {
+        printf("%6u  ", entry->trailer.seq);
+    }
+    printf("%.*s\n", (int)entry->trailer.text_len, entry->text);
+}
 
+// Print the entries containing pattern, oldest first. Candidates come from
+// intersecting the posting lists of the pattern's trigrams, starting with
+// the shortest; patterns under three bytes are matched against every entry.
+void history_search(const char *pattern, int long_format) {
+    history_index_update();
+    size_t pattern_len = strlen(pattern);
+    uint32_t *ids = NULL;
+    size_t num_ids = 0;
+
+    if (pattern_len < 3) {
+        ids = malloc((history_num_indexed + 1) * sizeof(uint32_t));
+        for (size_t id = 0; ids != NULL && id < history_num_indexed; id++) {
+            ids[num_ids++] = id;
+        }
+    } else {
+        if (trigram_table_size == 0) {
+            return;  // No entry has a trigram yet, so none can match
+        }
 
-// Function to handle built-in cd command
-void quash_cd(char **args) {
-    char *dir;
-
-    if (args[1] == NULL) {
-        // If no directory is specified, change to the HOME directory
-        dir = getenv("HOME");
-        if (dir == NULL) {
-            fprintf(stderr, "quash: cd: HOME environment variable not set\n");
+        // The rarest trigram gives the smallest candidate set
+        TrigramPosting *rarest = NULL;
+        for (size_t i = 0; i + 2 < pattern_len; i++) {
+            TrigramPosting *posting = trigram_slot(trigram_table, trigram_table_size,
+                                                   TRIGRAM_KEY((const unsigned char *)pattern + i));
+            if (posting->key == 0) {
+                return;  // Some trigram never occurs: no entry can match
+            }
+            if (rarest == NULL || posting->count < rarest->count) {
+                rarest = posting;
+            }
+        }
+        ids = malloc(rarest->count * sizeof(uint32_t));
+        if (ids == NULL) {
+            perror("quash: malloc failed");
             return;
         }
-    } else {
-        // Expand environment variable if necessary
-        dir = expand_env_var_in_string(args[1]);
-        if (dir == NULL) {
-            return;  // If expansion fails, do nothing
+        trigram_decode(rarest, ids);
+        num_ids = rarest->count;
+
+        for (size_t i = 0; i + 2 < pattern_len && num_ids > 0; i++) {
+            TrigramPosting *posting = trigram_slot(trigram_table, trigram_table_size,
+                                                   TRIGRAM_KEY((const unsigned char *)pattern + i));
+            if (posting == rarest) continue;
+            uint32_t *other = malloc(posting->count * sizeof(uint32_t));
+            if (other == NULL) break;
+            trigram_decode(posting, other);
+            size_t kept = 0;
+            for (size_t a = 0, b = 0; a < num_ids && b < posting->count;) {
+                if (ids[a] < other[b]) {
+                    a++;
+                } else if (ids[a] > other[b]) {
+                    b++;
+                } else {
+                    ids[kept++] = ids[a];
+                    a++;
+                    b++;
+                }
+            }
+            num_ids = kept;
+            free(other);
         }
     }
 
-    // Attempt to change the directory
-    if (chdir(dir) != 0) {
-        perror("quash: cd");
-        free(dir);  // Free the allocated memory
-        return;
+    // Trigrams only narrow it down; check the candidates for real
+    for (size_t i = 0; i < num_ids; i++) {
+        HistoryEntry entry;
+        if (history_entry_at(history_offsets[ids[i]], &entry) == 0 &&
+            memmem(entry.text, entry.trailer.text_len, pattern, pattern_len) != NULL) {
+            history_print(&entry, long_format);
+        }
     }
+    free(ids);
+}
 
-    // Get the new current directory and update PWD
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        setenv("PWD", cwd, 1);  // Update the PWD environment variable
-        printf("%s\n", cwd);    // Print the new current directory
-    } else {
-        perror("quash: cd: getcwd failed");
+// Built-in command: history [-l] [N] | history -f [-l] TEXT | history -s TEXT
+// Lists the last N entries (all by default), finds the entries containing
+// TEXT, or adds TEXT as an entry. -l adds the time, exit status, duration
+// and directory of each entry.
+int quash_history(char **args) {
+    int i = 1;
+    int long_format = 0;
+    int find = 0;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-l") == 0) {
+            long_format = 1;
+        } else if (strcmp(args[i], "-f") == 0) {
+            find = 1;
+        } else if (strcmp(args[i], "-s") == 0) {
+            // Store the rest of the line as one entry
+            StrBuf text = {NULL, 0, 0};
+            for (int j = i + 1; args[j] != NULL; j++) {
+                if (j > i + 1) strbuf_append(&text, " ", 1);
+                strbuf_append(&text, args[j], strlen(args[j]));
+            }
+            char cwd[4096];
+            if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+            history_append(text.data != NULL ? text.data : "", cwd, time(NULL), 0, 0);
+            return 0;
+        } else {
+            fprintf(stderr, "quash: history: %s: invalid option\n", args[i]);
+            return 2;
+        }
     }
 
-    if (dir != getenv("HOME")) {
-        free(dir);  // Free dynamically allocated memory if it was not the home directory
+    if (history_open() == -1) {
+        return 1;
     }
-}
-
-
-// Function to add a background job
-void add_job(pid_t pid, char **args) {
-    if (num_jobs < 100) {
-        jobs[num_jobs].job_id = next_job_id++;
-        jobs[num_jobs].pid = pid;
-
-        // Build the full command string from the args array
-        char command[256] = "";
-        for (int i = 0; args[i] != NULL; i++) {
-            strcat(command, args[i]);
-            if (args[i + 1] != NULL) strcat(command, " ");
+    if (find) {
+        if (args[i] == NULL) {
+            fprintf(stderr, "quash: history: -f: missing text\n");
+            return 2;
         }
-        strncpy(jobs[num_jobs].command, command, sizeof(jobs[num_jobs].command) - 1);
-        jobs[num_jobs].command[sizeof(jobs[num_jobs].command) - 1] = '\0';  // Null-terminate the command
-
-        num_jobs++;
+        history_search(args[i], long_format);
+        return 0;
     }
-}
 
-// Function to remove a job when it finishes
-void remove_job(pid_t pid) {
-    for (int i = 0; i < num_jobs; i++) {
-        if (jobs[i].pid == pid) {
-            // Remove the job by shifting the rest of the array
-            for (int j = i; j < num_jobs - 1; j++) {
-                jobs[j] = jobs[j + 1];
+    if (args[i] == NULL) {
+        // Everything, in order
+        history_index_update();
+        for (size_t id = 0; id < history_num_indexed; id++) {
+            HistoryEntry entry;
+            if (history_entry_at(history_offsets[id], &entry) == 0) {
+                history_print(&entry, long_format);
             }
-            num_jobs--;
-            break;
         }
+        return 0;
     }
-}
 
-// Function to print all background jobs
-void quash_jobs() {
-    for (int i = 0; i < num_jobs; i++) {
-        printf("[%d] %d %s &\n", jobs[i].job_id, jobs[i].pid, jobs[i].command);
+    // The last N entries: walk back N records, then print them forward
+    int count = atoi(args[i]);
+    if (count <= 0 || history_map_refresh() == -1) {
+        return 0;
+    }
+    size_t *ends = malloc(count * sizeof(size_t));
+    if (ends == NULL) {
+        perror("quash: malloc failed");
+        return 1;
+    }
+    int n = 0;
+    HistoryEntry entry;
+    for (size_t end = history_map_size; n < count && history_entry_at(end, &entry) == 0; end = entry.start) {
+        ends[n++] = end;
     }
+    while (n-- > 0) {
+        history_entry_at(ends[n], &entry);
+        history_print(&entry, long_format);
+    }
+    free(ends);
+    return 0;
 }
 
-// Function to kill a background job or a process
-void quash_kill(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "quash: kill: missing argument\n");
-        return;
+
+#ifdef __linux__
+// Server used by --serve: accept clients on a Unix socket and run each
+// request in a forked copy of the shell, so it starts with the server's
+// variables and command path cache. Requests of different clients run
+// concurrently; a client sends its next request after the reply.
+int serve(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "quash: %s: socket path too long\n", path);
+        return 2;
     }
+    strcpy(addr.sun_path, path);
 
-    pid_t pid = 0;
-    int job_id = 0;
+    // Replace a socket left behind by an earlier server
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "quash: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
 
-    // Check if the user is trying to kill a job using %job_id
-    if (args[1][0] == '%') {
-        // Extract job ID (e.g., %1 becomes 1)
-        job_id = atoi(&args[1][1]);
+    // Lines run in separate processes, which would each need their own pool
+    if (spawn_backend == SPAWN_BACKEND_ZYGOTE) {
+        zygote_stop();
+        spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+    }
 
-        // Find the corresponding job in the jobs array
-        for (int i = 0; i < num_jobs; i++) {
-            if (jobs[i].job_id == job_id) {
-                pid = jobs[i].pid;
-                break;
+    while (1) {
+        struct pollfd *fds = arena_alloc(&line_arena, (num_serve_clients + 2) * sizeof(struct pollfd));
+        fds[0] = (struct pollfd){listen_fd, POLLIN, 0};
+        fds[1] = (struct pollfd){child_event_fd, POLLIN, 0};
+        for (int i = 0; i < num_serve_clients; i++) {
+            // Busy clients are only watched for hangups
+            fds[i + 2].fd = serve_clients[i].fd;
+            fds[i + 2].events = serve_clients[i].pid == 0 ? POLLIN : 0;
+            fds[i + 2].revents = 0;
+        }
+        if (poll(fds, num_serve_clients + 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("quash: poll failed");
+            return 1;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            serve_reap();
+        }
+        int count = num_serve_clients;
+        for (int i = 0; i < count; i++) {
+            ServeClient *client = &serve_clients[i];
+            if (client->fd == -1 || fds[i + 2].revents == 0) {
+                continue;
+            }
+            if (client->pid == 0) {
+                serve_request(client, listen_fd);
+            } else if (fds[i + 2].revents & (POLLHUP | POLLERR)) {
+                // The line keeps running, its reply is dropped
+                close(client->fd);
+                client->fd = -1;
             }
         }
+        if (fds[0].revents & POLLIN) {
+            serve_accept(listen_fd);
+        }
+        arena_reset(&line_arena);
+    }
+}
 
-        if (pid == 0) {
-            fprintf(stderr, "quash: kill: no such job [%d]\n", job_id);
+// Take a new client into a free slot
+void serve_accept(int listen_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    for (int i = 0; i < num_serve_clients; i++) {
+        if (serve_clients[i].fd == -1 && serve_clients[i].pid == 0) {
+            serve_clients[i].fd = fd;
             return;
         }
-    } else {
-        // Otherwise, treat it as a direct PID
-        pid = atoi(args[1]);
     }
+    ServeClient *clients = realloc(serve_clients, (num_serve_clients + 1) * sizeof(ServeClient));
+    if (clients == NULL) {
+        close(fd);
+        return;
+    }
+    serve_clients = clients;
+    serve_clients[num_serve_clients++] = (ServeClient){fd, 0, 0};
+}
 
-    // Attempt to kill the process or job
-    if (kill(pid, SIGKILL) == -1) {
-        perror("quash: kill");
-    } else {
-        printf("Killed process %d\n", pid);
+// Read one request and start a process for it, or drop the client if it
+// hung up or sent something malformed
+void serve_request(ServeClient *client, int listen_fd) {
+    ssize_t size = recv(client->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    char *buf = size > (ssize_t)sizeof(ServeRequest) && size <= SERVE_REQUEST_MAX ? malloc(size + 1) : NULL;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {buf, size > 0 ? size : 0};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = buf != NULL ? recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC) : -1;
+
+    int fds[3] = {-1, -1, -1};
+    int num_fds = 0;
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    }
 
-        // Remove the job from the job list if it's a background job
-        if (job_id > 0) {
-            remove_job(pid);
+    // The line, the directory and every override must be terminated
+    ServeRequest req;
+    char *strings = NULL;
+    uint32_t num_strings = 0;
+    if (n == size && size > 0) {
+        memcpy(&req, buf, sizeof(req));
+        buf[size] = '\0';
+        strings = buf + sizeof(req);
+        for (char *p = strings; p < buf + size; p += strlen(p) + 1) {
+            num_strings++;
         }
     }
-}
+    if (strings == NULL || buf[size - 1] != '\0' || num_fds != 3 || num_strings != req.num_env + 2) {
+        for (int i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+        free(buf);
+        close(client->fd);
+        client->fd = -1;
+        return;
+    }
 
-// Function to check for completed background jobs and notify the user
-void check_background_jobs() {
-    int status;
-    pid_t pid;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(listen_fd);
+        for (int i = 0; i < num_serve_clients; i++) {
+            if (serve_clients[i].fd != -1) {
+                close(serve_clients[i].fd);
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            if (dup2(fds[i], i) == -1) {
+                _exit(126);
+            }
+            close(fds[i]);
+        }
 
-    for (int i = 0; i < num_jobs; ) {
-        // Use waitpid() with WNOHANG to check if the job has completed
-        pid = waitpid(jobs[i].pid, &status, WNOHANG);
+        char *line = strings;
+        char *cwd = line + strlen(line) + 1;
+        if (cwd[0] != '\0') {
+            if (chdir(cwd) == -1) {
+                fprintf(stderr, "quash: %s: %s\n", cwd, strerror(errno));
+                _exit(126);
+            }
+            var_set("PWD", cwd, 0);
+        }
+        char *env = cwd + strlen(cwd) + 1;
+        for (uint32_t i = 0; i < req.num_env; i++, env += strlen(env) + 1) {
+            char *value = strchr(env, '=');
+            if (value != NULL && value > env) {
+                *value = '\0';
+                var_set(env, value + 1, 1);
+                value[0] = '=';
+            }
+        }
 
-        if (pid == 0) {
-            // Job is still running, continue checking the next job
-            i++;
-        } else if (pid > 0) {
-            // Job has completed, print a notification
-            printf("\n[QUASH] Job [%d] %d (%s) completed\n", jobs[i].job_id, jobs[i].pid, jobs[i].command);
+        LineReader reader;
+        reader_init_string(&reader, line);
+        _exit(run_shell(&reader, 0));
+    }
 
-            // Remove the job from the job list
-            remove_job(jobs[i].pid);
-        } else {
-            // Error or no more child processes, move to the next job
-            i++;
-        }
+    for (int i = 0; i < 3; i++) {
+        close(fds[i]);
+    }
+    free(buf);
+    if (pid < 0) {
+        perror("quash: fork failed");
+        ServeReply reply = {126, -1, 0, 0, 0, 0};
+        send(client->fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return;
     }
+    client->pid = pid;
+    client->start = monotonic_ns();
 }
 
+// Reply to the clients whose lines have finished, with the usage of the
+// process that ran each one and of the commands it waited for
+void serve_reap() {
+    char buf[1024];
+    while (read(child_event_fd, buf, sizeof(buf)) > 0) {
+    }
 
-void sigchld_handler(int signum) {
     int status;
+    struct rusage ru;
     pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+        for (int i = 0; i < num_serve_clients; i++) {
+            ServeClient *client = &serve_clients[i];
+            if (client->pid != pid) {
+                continue;
+            }
+            ServeReply reply;
+            reply.status = status_to_exit_code(status);
+            reply.pid = pid;
+            reply.real_us = (monotonic_ns() - client->start) / 1000;
+            reply.user_us = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec;
+            reply.sys_us = ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+            reply.maxrss_kb = RU_MAXRSS_KB(ru);
+            if (client->fd != -1) {
+                send(client->fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+            }
+            client->pid = 0;
+            break;
+        }
+    }
+}
 
-    // Check for all background jobs that have completed
-    for (int i = 0; i < num_jobs; ) {
-        pid = waitpid(jobs[i].pid, &status, WNOHANG);
-
-        if (pid > 0) {
-            // Job has completed
-            printf("\n[QUASH] Job [%d] %d (%s) completed\n", jobs[i].job_id, jobs[i].pid, jobs[i].command);
-            remove_job(jobs[i].pid);  // Remove the job from the list
+// The --client side: send a line with this process's directory, standard
+// descriptors and the -e overrides to a server, wait for it to finish and
+// exit with its status. -t prints the timings in the format of time -p.
+int client_main(const char *path, char **args) {
+    int timed = 0;
+    StrBuf env = {NULL, 0, 0};
+    ServeRequest req = {0};
+    strbuf_append(&env, "", 0);
+    for (; args[0] != NULL && args[1] != NULL; args++) {
+        if (strcmp(args[0], "-t") == 0) {
+            timed = 1;
+        } else if (strcmp(args[0], "-e") == 0 && strchr(args[1], '=') != NULL) {
+            strbuf_append(&env, args[1], strlen(args[1]) + 1);
+            req.num_env++;
+            args++;
         } else {
-            // Move to the next job
-            i++;
+            break;
         }
     }
-    fflush(stdout);  // Ensure output is displayed immediately
+    if (args[0] == NULL || args[1] != NULL) {
+        fprintf(stderr, "quash: usage: quash --client SOCKET [-t] [-e NAME=value]... LINE\n");
+        return 2;
+    }
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    StrBuf msg = {NULL, 0, 0};
+    strbuf_append(&msg, (char *)&req, sizeof(req));
+    strbuf_append(&msg, args[0], strlen(args[0]) + 1);
+    strbuf_append(&msg, cwd, strlen(cwd) + 1);
+    strbuf_append(&msg, env.data, env.len);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "quash: %s: %s\n", path, strerror(errno));
+        return 126;
+    }
+
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {msg.data, msg.len};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ServeReply reply;
+    ssize_t n = -1;
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) == (ssize_t)msg.len) {
+        do {
+            n = recv(fd, &reply, sizeof(reply), 0);
+        } while (n == -1 && errno == EINTR);
+    }
+    if (n != sizeof(reply)) {
+        fprintf(stderr, "quash: %s: no reply from server\n", path);
+        return 126;
+    }
+    if (timed) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n",
+                reply.real_us / 1e6, reply.user_us / 1e6, reply.sys_us / 1e6);
+    }
+    return reply.status;
+}
+#else
+int serve(const char *path) {
+    fprintf(stderr, "quash: --serve is only supported on Linux\n");
+    return 2;
+}
+
+int client_main(const char *path, char **args) {
+    fprintf(stderr, "quash: --client is only supported on Linux\n");
+    return 2;
+}
+#endif
+
+#ifndef __linux__
+// Wake the main loop; reaping happens there, where touching the job table is safe
+void sigchld_handler(int signum) {
+    int saved_errno = errno;
+    write(child_event_pipe[1], "x", 1);
+    errno = saved_errno;
 }
+#endif